@@ -0,0 +1,69 @@
+use std::io;
+use std::ops::Range;
+use tokio::io::{AsyncRead, AsyncReadExt};
+
+// Bump arena for decoding one frame at a time. Variable-length fields are
+// read into one buffer and handed out as spans, and decoded messages borrow
+// their strings and byte fields from it. reset() between frames keeps the
+// capacity, so once a connection has seen its largest frame, decoding
+// allocates nothing.
+#[derive(Default)]
+pub struct Arena {
+    buf: Vec<u8>,
+}
+
+#[derive(Clone, Copy)]
+pub struct Span {
+    start: usize,
+    end: usize,
+}
+
+impl Arena {
+    pub fn new() -> Arena {
+        Arena::default()
+    }
+
+    pub fn reset(&mut self) {
+        self.buf.clear();
+    }
+
+    // Reads the next `len` bytes of the frame into the arena.
+    pub async fn read<R: AsyncRead + Unpin>(
+        &mut self,
+        reader: &mut R,
+        len: usize,
+    ) -> io::Result<Span> {
+        let start = self.buf.len();
+        self.buf.resize(start + len, 0);
+        reader.read_exact(&mut self.buf[start..]).await?;
+        Ok(Span {
+            start,
+            end: start + len,
+        })
+    }
+
+    // Copies `bytes` into the arena, for messages built rather than read.
+    pub fn push(&mut self, bytes: &[u8]) -> Span {
+        let start = self.buf.len();
+        self.buf.extend_from_slice(bytes);
+        Span {
+            start,
+            end: self.buf.len(),
+        }
+    }
+
+    pub fn bytes(&self, span: Span) -> &[u8] {
+        &self.buf[Range::from(span)]
+    }
+
+    pub fn str(&self, span: Span) -> io::Result<&str> {
+        std::str::from_utf8(self.bytes(span))
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "string is not UTF-8"))
+    }
+}
+
+impl From<Span> for Range<usize> {
+    fn from(span: Span) -> Range<usize> {
+        span.start..span.end
+    }
+}
@@ -0,0 +1,531 @@
+use crate::buffers::{self, Buffer};
+use crate::bundle;
+use crate::catalog::{Catalog, Indexed};
+use crate::config::Config;
+use crate::cores;
+use crate::frame;
+use crate::index::ShareIndex;
+use crate::server::{self, serve_published, PerCore, Published};
+use crate::sockopt::SocketOptions;
+use crate::stripe::{Stripe, STRIPE_CHUNK};
+use crate::transport::Listener;
+use std::fs;
+use std::future::Future;
+use std::io;
+use std::path::Path;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use tokio::runtime::Runtime;
+
+const FILE_SIZE: usize = 64 << 20;
+
+// Small range fetches per row; each is one request/response round trip,
+// the shape of a small-file transfer.
+const SMALL_FETCHES: usize = 500;
+const SMALL_SIZE: usize = 4096;
+
+const BULK_FETCHES: usize = 64;
+
+// Files in the small-file run, spread over directories of 100.
+const TINY_FILES: usize = 5000;
+const TINY_SIZE: usize = 1024;
+
+// Catalog lookups per thread in the lookup run.
+const LOOKUPS: usize = 1 << 21;
+
+// Range fetches each load connection makes before hanging up.
+const LOAD_REQUESTS: usize = 16;
+
+struct Row {
+    name: &'static str,
+    options: SocketOptions,
+    // Random data never compresses, but zstd still frames every 128 KiB.
+    compress: bool,
+}
+
+impl Row {
+    fn new(name: &'static str, options: SocketOptions) -> Row {
+        Row {
+            name,
+            options,
+            compress: false,
+        }
+    }
+}
+
+struct Measurement {
+    p50: Duration,
+    p99: Duration,
+    throughput: f64,
+    // Socket writes made by the server per small response and per MB bulk.
+    small_writes: f64,
+    bulk_writes: f64,
+}
+
+fn rows(config: &Config) -> Vec<Row> {
+    let defaults = SocketOptions {
+        nodelay: false,
+        send_buffer: None,
+        recv_buffer: None,
+        keepalive: None,
+        busy_poll: None,
+        cork: false,
+    };
+    let nodelay = SocketOptions {
+        nodelay: true,
+        ..defaults
+    };
+    vec![
+        Row::new("kernel defaults", defaults),
+        Row::new("nodelay", nodelay),
+        Row::new(
+            "nodelay + cork",
+            SocketOptions {
+                cork: true,
+                ..nodelay
+            },
+        ),
+        Row::new(
+            "nodelay + 4 MiB buffers",
+            SocketOptions {
+                send_buffer: Some(4 << 20),
+                recv_buffer: Some(4 << 20),
+                ..nodelay
+            },
+        ),
+        Row::new(
+            "nodelay + busy poll 50us",
+            SocketOptions {
+                busy_poll: Some(Duration::from_micros(50)),
+                ..nodelay
+            },
+        ),
+        Row {
+            name: "nodelay + zstd framing",
+            options: nodelay,
+            compress: true,
+        },
+        Row::new("command line", config.socket),
+    ]
+}
+
+// Fills `buf` with xorshift output, so compression cannot hide the socket.
+fn fill(buf: &mut [u8]) {
+    let mut state = 0x9e37_79b9_7f4a_7c15u64;
+    for chunk in buf.chunks_mut(8) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        chunk.copy_from_slice(&state.to_le_bytes()[..chunk.len()]);
+    }
+}
+
+async fn measure(config: &Config) -> io::Result<Measurement> {
+    let transport = config.transport();
+    let mut stripe = Stripe::open(&*transport, config).await?;
+    let mut buf = Buffer::take(STRIPE_CHUNK as usize);
+
+    let mut latencies = Vec::with_capacity(SMALL_FETCHES);
+    let mut offset = 0u64;
+    let (calls, _) = frame::write_stats();
+    for _ in 0..SMALL_FETCHES {
+        // Stride through the file so every fetch reads a different page.
+        offset = (offset + 7 * SMALL_SIZE as u64) % (FILE_SIZE - SMALL_SIZE) as u64;
+        let start = Instant::now();
+        stripe.fetch(offset, &mut buf[..SMALL_SIZE]).await?;
+        latencies.push(start.elapsed());
+    }
+    latencies.sort();
+    let small_writes = (frame::write_stats().0 - calls) as f64 / SMALL_FETCHES as f64;
+
+    let (calls, _) = frame::write_stats();
+    let start = Instant::now();
+    let mut received = 0;
+    for i in 0..BULK_FETCHES {
+        let (_, n) = stripe
+            .fetch((i * STRIPE_CHUNK as usize % FILE_SIZE) as u64, &mut buf)
+            .await?;
+        received += n;
+    }
+    let elapsed = start.elapsed().as_secs_f64();
+    let bulk_writes = (frame::write_stats().0 - calls) as f64 / (received as f64 / 1e6);
+
+    Ok(Measurement {
+        p50: latencies[latencies.len() / 2],
+        p99: latencies[latencies.len() * 99 / 100],
+        throughput: received as f64 / elapsed / 1e6,
+        small_writes,
+        bulk_writes,
+    })
+}
+
+// The catalog of `share`, hashed in memory. Bench servers serve it as it is,
+// so they start no index or watch threads that would outlive their row and
+// write no index into the share.
+fn publish(share: &Path) -> io::Result<Published> {
+    let mut changes = Vec::new();
+    let mut dirs = vec![String::new()];
+    while let Some(dir) = dirs.pop() {
+        for entry in fs::read_dir(share.join(&dir))? {
+            let entry = entry?;
+            let Ok(name) = entry.file_name().into_string() else {
+                continue;
+            };
+            let path = if dir.is_empty() {
+                name
+            } else {
+                format!("{}/{}", dir, name)
+            };
+            let meta = entry.metadata()?;
+            if meta.is_dir() {
+                dirs.push(path);
+            } else if meta.is_file() {
+                let indexed = Indexed::hash(&share.join(&path), &meta)?;
+                changes.push((path, Some(indexed)));
+            }
+        }
+    }
+    let catalog = Catalog::new(Arc::new(ShareIndex::empty()));
+    catalog.apply(&changes);
+    Ok(Published::fixed(Arc::new(catalog)))
+}
+
+// Serves `published` on `listener` until `client` finishes. The server is
+// dropped with its accept loops before this returns.
+async fn against<T>(
+    listener: Box<dyn Listener>,
+    config: &Config,
+    published: &Published,
+    client: impl Future<Output = io::Result<T>>,
+) -> io::Result<T> {
+    tokio::select! {
+        served = server::serve_published(vec![listener], config, published.clone()) => match served {
+            Ok(()) => Err(io::Error::other("server stopped")),
+            Err(e) => Err(e),
+        },
+        result = client => result,
+    }
+}
+
+// Fetches a directory of tiny files through the bundle stream and times it
+// in files per second.
+async fn measure_tiny(config: &Config, target: &Path) -> io::Result<(Duration, usize)> {
+    let start = Instant::now();
+    let fetched = bundle::fetch(config, &["tiny".to_string()], target).await?;
+    if fetched.files != TINY_FILES {
+        return Err(io::Error::other(format!(
+            "fetched {} of {} files",
+            fetched.files, TINY_FILES
+        )));
+    }
+    Ok((start.elapsed(), fetched.bundles))
+}
+
+fn tiny_files(config: &Config, runtime: &Runtime) -> io::Result<()> {
+    let root = std::env::temp_dir().join(format!("peernet-bench-tiny-{}", std::process::id()));
+    let mut content = vec![0u8; TINY_SIZE * TINY_FILES];
+    fill(&mut content);
+    for (i, contents) in content.chunks(TINY_SIZE).enumerate() {
+        let dir = root.join("share/tiny").join(format!("{:03}", i / 100));
+        fs::create_dir_all(&dir)?;
+        fs::write(dir.join(format!("{:05}.bin", i)), contents)?;
+    }
+
+    let result = runtime.block_on(async {
+        let mut config = config.clone();
+        config.share = root.join("share");
+        let published = publish(&config.share)?;
+        let listener = config.transport().bind("127.0.0.1:0").await?;
+        config.connect = listener.local_addr()?.to_string();
+        let target = root.join("received");
+        against(
+            listener,
+            &config,
+            &published,
+            measure_tiny(&config, &target),
+        )
+        .await
+    });
+    match result {
+        Ok((elapsed, bundles)) => println!(
+            "small files: {} of {} bytes in {} bundles in {:?}: {:.0} files/s",
+            TINY_FILES,
+            TINY_SIZE,
+            bundles,
+            elapsed,
+            TINY_FILES as f64 / elapsed.as_secs_f64()
+        ),
+        Err(e) => println!("small files: failed: {}", e),
+    }
+    println!();
+    let looked_up = catalog_lookups(config, &root.join("share"));
+    fs::remove_dir_all(&root)?;
+    looked_up
+}
+
+// Looks the small-file share's files up in its catalog from 1, 2, 4, ...
+// threads, up to one per core, alternately by path and by Merkle root.
+// Readers write nothing they share, so the rate should grow with threads.
+fn catalog_lookups(config: &Config, share: &Path) -> io::Result<()> {
+    let (index, _) = ShareIndex::open(share, &config.index_options())?;
+    let files: Vec<(String, u128)> = index
+        .entries()
+        .map(|entry| (entry.path.to_string(), entry.root))
+        .collect();
+    if files.is_empty() {
+        return Err(io::Error::other("nothing indexed to look up"));
+    }
+    let catalog = Catalog::new(Arc::new(index));
+    let cores = std::thread::available_parallelism().map_or(1, |n| n.get());
+    let (files, catalog) = (&files, &catalog);
+    let mut threads = 1;
+    loop {
+        let start = Instant::now();
+        let found: usize = std::thread::scope(|scope| {
+            let workers: Vec<_> = (0..threads)
+                .map(|thread| {
+                    scope.spawn(move || {
+                        let mut found = 0;
+                        for i in 0..LOOKUPS {
+                            // A large prime stride, so consecutive lookups land far apart.
+                            let (path, root) = &files[(i * 7919 + thread) % files.len()];
+                            let hit = if i % 2 == 0 {
+                                catalog.lookup(path).is_some()
+                            } else {
+                                catalog.find(*root).is_some()
+                            };
+                            found += hit as usize;
+                        }
+                        found
+                    })
+                })
+                .collect();
+            workers
+                .into_iter()
+                .map(|worker| worker.join().unwrap())
+                .sum()
+        });
+        let elapsed = start.elapsed().as_secs_f64();
+        println!(
+            "catalog lookups, {} threads: {:.2} M/s ({} of {} found)",
+            threads,
+            (threads * LOOKUPS) as f64 / elapsed / 1e6,
+            found,
+            threads * LOOKUPS
+        );
+        if threads >= cores {
+            return Ok(());
+        }
+        threads = (threads * 2).min(cores);
+    }
+}
+
+// Runs a server and a client against each other on loopback once per row
+// of socket options, measuring small-range latency and bulk throughput
+// over one connection, and how many socket writes the server needed for
+// them. Only the zstd row compresses, so the rest measure just the socket.
+// Then times a directory of small files, with the command line's options,
+// and lookups in that directory's catalog.
+pub fn run(config: &Config, runtime: &Runtime) -> io::Result<()> {
+    if config.connections > 0 {
+        return load(config, runtime);
+    }
+    let share = std::env::temp_dir().join(format!("peernet-bench-{}", std::process::id()));
+    fs::create_dir_all(&share)?;
+    let mut content = vec![0u8; FILE_SIZE];
+    fill(&mut content);
+    fs::write(share.join("example.txt"), &content)?;
+    drop(content);
+
+    let results = runtime.block_on(async {
+        let published = publish(&share)?;
+        let mut results = Vec::new();
+        for row in rows(config) {
+            let mut config = config.clone();
+            config.share = share.clone();
+            config.compress = row.compress;
+            config.socket = row.options;
+            let listener = config.transport().bind("127.0.0.1:0").await?;
+            config.connect = listener.local_addr()?.to_string();
+            let result = against(listener, &config, &published, measure(&config)).await;
+            results.push((row.name, result));
+        }
+        Ok::<_, io::Error>(results)
+    });
+    fs::remove_dir_all(&share)?;
+
+    println!();
+    println!(
+        "{:<26} {:>10} {:>10} {:>12} {:>12} {:>10}",
+        "options", "p50 (us)", "p99 (us)", "bulk (MB/s)", "writes/resp", "writes/MB"
+    );
+    for (name, result) in results? {
+        match result {
+            Ok(measured) => println!(
+                "{:<26} {:>10} {:>10} {:>12.0} {:>12.2} {:>10.1}",
+                name,
+                measured.p50.as_micros(),
+                measured.p99.as_micros(),
+                measured.throughput,
+                measured.small_writes,
+                measured.bulk_writes
+            ),
+            Err(e) => println!("{:<26} failed: {}", name, e),
+        }
+    }
+    println!();
+    tiny_files(config, runtime)?;
+    println!();
+    buffers::report();
+    Ok(())
+}
+
+fn percentile(sorted: &[Duration], percent: usize) -> u128 {
+    sorted[(sorted.len() * percent / 100).min(sorted.len() - 1)].as_micros()
+}
+
+// How a load run serves its share: a work-stealing runtime with some
+// number of listeners, or one pinned runtime per core.
+enum Mode {
+    Listeners(usize),
+    PerCore,
+}
+
+struct Load {
+    elapsed: Duration,
+    failed: usize,
+    connects: Vec<Duration>,
+    requests: Vec<Duration>,
+}
+
+// Serves a small share in each server mode in turn and opens --connections
+// connections to it all at once, each making a few small range fetches, to
+// compare how the modes cope with a whole fleet arriving together.
+fn load(config: &Config, runtime: &Runtime) -> io::Result<()> {
+    let share = std::env::temp_dir().join(format!("peernet-bench-load-{}", std::process::id()));
+    fs::create_dir_all(&share)?;
+    let mut content = vec![0u8; LOAD_REQUESTS * SMALL_SIZE];
+    fill(&mut content);
+    fs::write(share.join("example.txt"), &content)?;
+    let mut config = config.clone();
+    config.share = share.clone();
+    let published = publish(&share)?;
+    let cores = cores::allowed()?.len();
+    let modes = [
+        ("work-stealing".to_string(), Mode::Listeners(1)),
+        (format!("--listeners {}", cores), Mode::Listeners(cores)),
+        ("--per-core".to_string(), Mode::PerCore),
+    ];
+    let mut results = Vec::new();
+    for (name, mode) in modes {
+        results.push((name, load_mode(&config, runtime, &published, mode)));
+    }
+    fs::remove_dir_all(&share)?;
+
+    println!();
+    println!(
+        "{:<16} {:>6} {:>7} {:>11} {:>22} {:>22}",
+        "mode", "conns", "failed", "requests/s", "connect p50/p99 (us)", "request p50/p99 (us)"
+    );
+    for (name, result) in results {
+        match result {
+            Ok(load) => println!(
+                "{:<16} {:>6} {:>7} {:>11.0} {:>22} {:>22}",
+                name,
+                config.connections,
+                load.failed,
+                load.requests.len() as f64 / load.elapsed.as_secs_f64(),
+                format!(
+                    "{}/{}",
+                    percentile(&load.connects, 50),
+                    percentile(&load.connects, 99)
+                ),
+                format!(
+                    "{}/{}",
+                    percentile(&load.requests, 50),
+                    percentile(&load.requests, 99)
+                )
+            ),
+            Err(e) => println!("{:<16} failed: {}", name, e),
+        }
+    }
+    Ok(())
+}
+
+// Starts a server in `mode`, loads it from `runtime` and stops it again.
+// Servers run on runtimes of their own, as they would in their own process.
+fn load_mode(
+    config: &Config,
+    runtime: &Runtime,
+    published: &Published,
+    mode: Mode,
+) -> io::Result<Load> {
+    let mut config = config.clone();
+    match mode {
+        Mode::Listeners(count) => {
+            let server = crate::build_runtime(&config.runtime, false)?;
+            let listeners = server.block_on(config.transport().bind_many("127.0.0.1:0", count))?;
+            config.connect = listeners[0].local_addr()?.to_string();
+            let (serving, published) = (config.clone(), published.clone());
+            server.spawn(async move { serve_published(listeners, &serving, published).await });
+            let result = runtime.block_on(load_once(&config));
+            server.shutdown_background();
+            result
+        }
+        Mode::PerCore => {
+            // Every core binds the address itself, so it needs a fixed port.
+            let port = std::net::TcpListener::bind("127.0.0.1:0")?
+                .local_addr()?
+                .port();
+            config.listen = format!("127.0.0.1:{}", port);
+            config.connect = config.listen.clone();
+            let _server = PerCore::spawn(&config, published.clone())?;
+            runtime.block_on(load_once(&config))
+        }
+    }
+}
+
+async fn load_once(config: &Config) -> io::Result<Load> {
+    let transport = config.transport();
+    let start = Instant::now();
+    let mut clients = tokio::task::JoinSet::new();
+    for _ in 0..config.connections {
+        let (transport, config) = (transport.clone(), config.clone());
+        clients.spawn(async move {
+            let connecting = Instant::now();
+            let mut stripe = Stripe::open(&*transport, &config).await?;
+            let connected = connecting.elapsed();
+            let mut buf = vec![0u8; SMALL_SIZE];
+            let mut latencies = Vec::with_capacity(LOAD_REQUESTS);
+            for i in 0..LOAD_REQUESTS {
+                let fetching = Instant::now();
+                stripe.fetch((i * SMALL_SIZE) as u64, &mut buf).await?;
+                latencies.push(fetching.elapsed());
+            }
+            Ok::<_, io::Error>((connected, latencies))
+        });
+    }
+
+    let (mut connects, mut requests, mut failed) = (Vec::new(), Vec::new(), 0);
+    while let Some(finished) = clients.join_next().await {
+        match finished {
+            Ok(Ok((connected, latencies))) => {
+                connects.push(connected);
+                requests.extend(latencies);
+            }
+            Ok(Err(_)) | Err(_) => failed += 1,
+        }
+    }
+    let elapsed = start.elapsed();
+    if requests.is_empty() {
+        return Err(io::Error::other("every connection failed"));
+    }
+    connects.sort();
+    requests.sort();
+    Ok(Load {
+        elapsed,
+        failed,
+        connects,
+        requests,
+    })
+}
@@ -0,0 +1,334 @@
+// Packed piece bitfields and rarest-first availability counts. A 1M-piece
+// file needs 128 KiB per bitfield, and set operations run 256 bits at a
+// time where AVX2 is available.
+
+#[derive(Clone)]
+pub struct Bitfield {
+    words: Vec<u64>,
+    len: usize,
+}
+
+#[derive(Clone, Copy)]
+enum Op {
+    And,
+    Or,
+    AndNot,
+}
+
+impl Bitfield {
+    pub fn new(len: usize) -> Bitfield {
+        Bitfield {
+            words: vec![0; len.div_ceil(64)],
+            len,
+        }
+    }
+
+    pub fn full(len: usize) -> Bitfield {
+        let mut bits = Bitfield {
+            words: vec![u64::MAX; len.div_ceil(64)],
+            len,
+        };
+        if len % 64 != 0 {
+            *bits.words.last_mut().unwrap() = (1 << (len % 64)) - 1;
+        }
+        bits
+    }
+
+    pub fn set(&mut self, bit: usize) {
+        self.words[bit / 64] |= 1 << (bit % 64);
+    }
+
+    pub fn get(&self, bit: usize) -> bool {
+        self.words[bit / 64] & (1 << (bit % 64)) != 0
+    }
+
+    pub fn and(&mut self, other: &Bitfield) {
+        self.combine(other, Op::And);
+    }
+
+    pub fn or(&mut self, other: &Bitfield) {
+        self.combine(other, Op::Or);
+    }
+
+    // Clears every bit that is set in `other`.
+    pub fn and_not(&mut self, other: &Bitfield) {
+        self.combine(other, Op::AndNot);
+    }
+
+    fn combine(&mut self, other: &Bitfield, op: Op) {
+        assert_eq!(self.len, other.len, "bitfields of different lengths");
+        let mut done = 0;
+        #[cfg(target_arch = "x86_64")]
+        {
+            if is_x86_feature_detected!("avx2") {
+                done = unsafe { simd::combine_avx2(&mut self.words, &other.words, op) };
+            }
+        }
+        for (word, &theirs) in self.words[done..].iter_mut().zip(&other.words[done..]) {
+            *word = match op {
+                Op::And => *word & theirs,
+                Op::Or => *word | theirs,
+                Op::AndNot => *word & !theirs,
+            };
+        }
+    }
+
+    pub fn count_ones(&self) -> usize {
+        #[cfg(target_arch = "x86_64")]
+        {
+            if is_x86_feature_detected!("popcnt") {
+                return unsafe { simd::count_ones_popcnt(&self.words) };
+            }
+        }
+        self.words
+            .iter()
+            .map(|word| word.count_ones() as usize)
+            .sum()
+    }
+
+    // The first set bit at or after `from`.
+    pub fn next_set(&self, from: usize) -> Option<usize> {
+        if from >= self.len {
+            return None;
+        }
+        let mut index = from / 64;
+        let first = self.words[index] & (u64::MAX << (from % 64));
+        if first != 0 {
+            return Some(index * 64 + first.trailing_zeros() as usize);
+        }
+        index += 1;
+        #[cfg(target_arch = "x86_64")]
+        {
+            if is_x86_feature_detected!("avx2") {
+                index += unsafe { simd::skip_zero_avx2(&self.words[index..]) };
+            }
+        }
+        let found = self.words[index..].iter().position(|&word| word != 0)?;
+        let word = index + found;
+        Some(word * 64 + self.words[word].trailing_zeros() as usize)
+    }
+
+    pub fn ones(&self) -> impl Iterator<Item = usize> + '_ {
+        std::iter::successors(self.next_set(0), |&bit| self.next_set(bit + 1))
+    }
+}
+
+#[cfg(target_arch = "x86_64")]
+mod simd {
+    use super::Op;
+    use std::arch::x86_64::*;
+
+    // Returns how many words were done; the caller finishes the tail.
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn combine_avx2(words: &mut [u64], other: &[u64], op: Op) -> usize {
+        let len = words.len().min(other.len()) / 4 * 4;
+        for i in (0..len).step_by(4) {
+            let a = _mm256_loadu_si256(words.as_ptr().add(i).cast());
+            let b = _mm256_loadu_si256(other.as_ptr().add(i).cast());
+            let result = match op {
+                Op::And => _mm256_and_si256(a, b),
+                Op::Or => _mm256_or_si256(a, b),
+                // andnot computes !first & second.
+                Op::AndNot => _mm256_andnot_si256(b, a),
+            };
+            _mm256_storeu_si256(words.as_mut_ptr().add(i).cast(), result);
+        }
+        len
+    }
+
+    #[target_feature(enable = "popcnt")]
+    pub unsafe fn count_ones_popcnt(words: &[u64]) -> usize {
+        words
+            .iter()
+            .map(|&word| _popcnt64(word as i64) as usize)
+            .sum()
+    }
+
+    // Words at the start of `words` that are zero, in whole 256-bit blocks.
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn skip_zero_avx2(words: &[u64]) -> usize {
+        let mut i = 0;
+        while i + 4 <= words.len() {
+            let block = _mm256_loadu_si256(words.as_ptr().add(i).cast());
+            if _mm256_testz_si256(block, block) == 0 {
+                break;
+            }
+            i += 4;
+        }
+        i
+    }
+}
+
+// How many sources can still supply each piece, kept sorted so the rarest
+// piece is always first. Pieces are ordered by count in one array with the
+// start of every count's run recorded, so moving a piece to the next count
+// is a swap to the edge of its run, and every update is O(1).
+pub struct Availability {
+    counts: Vec<u32>,
+    order: Vec<u32>,
+    position: Vec<u32>,
+    // starts[c] is the index in `order` of the first piece with count >= c.
+    starts: Vec<u32>,
+}
+
+impl Availability {
+    pub fn new(pieces: usize, max_count: u32) -> Availability {
+        let mut starts = vec![pieces as u32; max_count as usize + 2];
+        starts[0] = 0;
+        Availability {
+            counts: vec![0; pieces],
+            order: (0..pieces as u32).collect(),
+            position: (0..pieces as u32).collect(),
+            starts,
+        }
+    }
+
+    fn swap(&mut self, a: u32, b: u32) {
+        let (pa, pb) = (self.order[a as usize], self.order[b as usize]);
+        self.order.swap(a as usize, b as usize);
+        self.position[pa as usize] = b;
+        self.position[pb as usize] = a;
+    }
+
+    pub fn increment(&mut self, piece: usize) {
+        let count = self.counts[piece] as usize;
+        assert!(
+            count + 2 < self.starts.len(),
+            "availability over its maximum"
+        );
+        // Move to the end of this count's run, then shrink the run past it.
+        let last = self.starts[count + 1] - 1;
+        self.swap(self.position[piece], last);
+        self.starts[count + 1] -= 1;
+        self.counts[piece] += 1;
+    }
+
+    pub fn decrement(&mut self, piece: usize) {
+        let count = self.counts[piece] as usize;
+        assert!(count > 0, "availability below zero");
+        // Move to the start of this count's run, then grow the run below.
+        let first = self.starts[count];
+        self.swap(self.position[piece], first);
+        self.starts[count] += 1;
+        self.counts[piece] -= 1;
+    }
+
+    // The first piece of `wanted` in rarest-first order, with its count.
+    // Unwanted pieces are passed over, so this is O(1) while the rarest
+    // pieces are still wanted.
+    pub fn rarest(&self, wanted: &Bitfield) -> Option<(usize, u32)> {
+        self.order
+            .iter()
+            .map(|&piece| piece as usize)
+            .find(|&piece| wanted.get(piece))
+            .map(|piece| (piece, self.counts[piece]))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // A small deterministic generator, so failures reproduce.
+    fn next(state: &mut u64) -> u64 {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        *state
+    }
+
+    fn random(len: usize, state: &mut u64) -> (Bitfield, Vec<bool>) {
+        let mut bits = Bitfield::new(len);
+        let mut model = vec![false; len];
+        for bit in 0..len {
+            if next(state) % 3 == 0 {
+                bits.set(bit);
+                model[bit] = true;
+            }
+        }
+        (bits, model)
+    }
+
+    // Lengths either side of a word and of a 256-bit block, so both the
+    // vector loops and their scalar tails are covered.
+    const LENGTHS: [usize; 9] = [0, 1, 63, 64, 65, 255, 256, 257, 1000];
+
+    #[test]
+    fn set_operations_match_a_plain_model() {
+        let mut state = 0x9e3779b97f4a7c15;
+        for len in LENGTHS {
+            let (a, a_model) = random(len, &mut state);
+            let (b, b_model) = random(len, &mut state);
+            for (op, expect) in [
+                (Op::And, (|x, y| x && y) as fn(bool, bool) -> bool),
+                (Op::Or, |x, y| x || y),
+                (Op::AndNot, |x, y| x && !y),
+            ] {
+                let mut result = a.clone();
+                result.combine(&b, op);
+                let model: Vec<usize> = (0..len)
+                    .filter(|&bit| expect(a_model[bit], b_model[bit]))
+                    .collect();
+                assert_eq!(result.ones().collect::<Vec<_>>(), model);
+                assert_eq!(result.count_ones(), model.len());
+            }
+        }
+    }
+
+    #[test]
+    fn full_has_no_bits_past_its_length() {
+        for len in LENGTHS {
+            let full = Bitfield::full(len);
+            assert_eq!(full.count_ones(), len);
+            assert_eq!(
+                full.ones().collect::<Vec<_>>(),
+                (0..len).collect::<Vec<_>>()
+            );
+        }
+    }
+
+    #[test]
+    fn next_set_skips_long_runs_of_zeros() {
+        let mut bits = Bitfield::new(5000);
+        bits.set(3);
+        bits.set(4097);
+        bits.set(4999);
+        assert_eq!(bits.next_set(0), Some(3));
+        assert_eq!(bits.next_set(4), Some(4097));
+        assert_eq!(bits.next_set(4098), Some(4999));
+        assert_eq!(bits.next_set(5000), None);
+        assert_eq!(Bitfield::new(5000).next_set(0), None);
+    }
+
+    #[test]
+    fn rarest_follows_increments_and_decrements() {
+        let (pieces, max) = (200, 6);
+        let mut availability = Availability::new(pieces, max);
+        let mut counts = vec![0u32; pieces];
+        let mut state = 0x2545f4914f6cdd1d;
+        for _ in 0..20_000 {
+            let piece = next(&mut state) as usize % pieces;
+            if next(&mut state) % 2 == 0 && counts[piece] < max {
+                availability.increment(piece);
+                counts[piece] += 1;
+            } else if counts[piece] > 0 {
+                availability.decrement(piece);
+                counts[piece] -= 1;
+            }
+
+            let (wanted, model) = random(pieces, &mut state);
+            let rarest = (0..pieces)
+                .filter(|&piece| model[piece])
+                .map(|piece| counts[piece])
+                .min();
+            match availability.rarest(&wanted) {
+                Some((piece, count)) => {
+                    assert!(model[piece]);
+                    assert_eq!(count, counts[piece]);
+                    assert_eq!(Some(count), rarest);
+                }
+                None => assert_eq!(rarest, None),
+            }
+        }
+    }
+}
@@ -0,0 +1,243 @@
+use std::io;
+use std::sync::Arc;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+// False positives a content summary is sized for.
+pub const FALSE_POSITIVE_RATE: f64 = 0.01;
+
+// Summaries larger than this (8 MiB of bits) are refused as malformed.
+const MAX_BITS: usize = 64 << 20;
+
+// Geometry for `items` entries at `rate` false positives: m bits and k
+// probes, per the usual m = -n ln p / ln² 2 and k = m/n ln 2.
+fn geometry(items: usize, rate: f64) -> (usize, u32) {
+    let items = items.max(1) as f64;
+    let bits = (-items * rate.ln() / (2f64.ln() * 2f64.ln())).ceil() as usize;
+    let bits = bits.clamp(64, MAX_BITS).next_multiple_of(64);
+    let probes = ((bits as f64 / items) * 2f64.ln()).round() as u32;
+    (bits, probes.clamp(1, 16))
+}
+
+// Content IDs are Merkle roots, already uniformly distributed, so the two
+// halves serve directly as the hashes for double hashing.
+fn probes(id: u128, bits: usize, count: u32) -> impl Iterator<Item = usize> {
+    let (h1, h2) = (id as u64, (id >> 64) as u64 | 1);
+    (0..count as u64).map(move |i| (h1.wrapping_add(i.wrapping_mul(h2)) % bits as u64) as usize)
+}
+
+// Words per block of summary bits. Blocks are shared between a counting
+// filter and the summaries taken from it, and a change copies only the
+// blocks it touches, so taking a summary after an update costs a reference
+// per block rather than a pass over every counter.
+const BLOCK_WORDS: usize = 512;
+
+type Blocks = Vec<Arc<Vec<u64>>>;
+
+fn into_blocks(words: &[u64]) -> Blocks {
+    words
+        .chunks(BLOCK_WORDS)
+        .map(|block| Arc::new(block.to_vec()))
+        .collect()
+}
+
+// The compact summary of a peer's content that goes on the wire: a set
+// membership test that can say "certainly not here" but only "maybe here".
+pub struct Bloom {
+    blocks: Blocks,
+    words: usize,
+    probes: u32,
+}
+
+impl Bloom {
+    pub fn may_contain(&self, id: u128) -> bool {
+        probes(id, self.words * 64, self.probes).all(|bit| {
+            let word = bit / 64;
+            self.blocks[word / BLOCK_WORDS][word % BLOCK_WORDS] & (1 << (bit % 64)) != 0
+        })
+    }
+}
+
+pub async fn write_summary<W: AsyncWrite + Unpin>(writer: &mut W, bloom: &Bloom) -> io::Result<()> {
+    let mut buf = Vec::with_capacity(8 + bloom.words * 8);
+    buf.extend_from_slice(&bloom.probes.to_be_bytes());
+    buf.extend_from_slice(&(bloom.words as u32).to_be_bytes());
+    for word in bloom.blocks.iter().flat_map(|block| block.iter()) {
+        buf.extend_from_slice(&word.to_be_bytes());
+    }
+    writer.write_all(&buf).await?;
+    writer.flush().await
+}
+
+pub async fn read_summary<R: AsyncRead + Unpin>(reader: &mut R) -> io::Result<Bloom> {
+    let probes = reader.read_u32().await?;
+    let len = reader.read_u32().await? as usize;
+    if probes == 0 || probes > 16 || len == 0 || len > MAX_BITS / 64 {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "bad content summary",
+        ));
+    }
+    let mut bytes = vec![0; len * 8];
+    reader.read_exact(&mut bytes).await?;
+    let words: Vec<u64> = bytes
+        .chunks_exact(8)
+        .map(|word| u64::from_be_bytes(word.try_into().unwrap()))
+        .collect();
+    Ok(Bloom {
+        blocks: into_blocks(&words),
+        words: len,
+        probes,
+    })
+}
+
+// A counting Bloom filter, so content can be removed as well as added and
+// the summary follows the catalog without being rebuilt. A counter that
+// saturates stays put, which can only cost a false positive.
+pub struct CountingBloom {
+    counters: Vec<u8>,
+    // The summary bit of each counter, set while it is above zero.
+    bits: Blocks,
+    probes: u32,
+    items: usize,
+    capacity: usize,
+}
+
+impl CountingBloom {
+    pub fn with_capacity(capacity: usize) -> CountingBloom {
+        let (bits, probes) = geometry(capacity, FALSE_POSITIVE_RATE);
+        CountingBloom {
+            counters: vec![0; bits],
+            bits: into_blocks(&vec![0; bits / 64]),
+            probes,
+            items: 0,
+            capacity,
+        }
+    }
+
+    // True once it holds more than it was sized for and the false-positive
+    // rate has drifted above the target.
+    pub fn is_full(&self) -> bool {
+        self.items > self.capacity
+    }
+
+    fn set_bit(&mut self, bit: usize, on: bool) {
+        let word = bit / 64;
+        let block = Arc::make_mut(&mut self.bits[word / BLOCK_WORDS]);
+        if on {
+            block[word % BLOCK_WORDS] |= 1 << (bit % 64);
+        } else {
+            block[word % BLOCK_WORDS] &= !(1 << (bit % 64));
+        }
+    }
+
+    pub fn insert(&mut self, id: u128) {
+        for bit in probes(id, self.counters.len(), self.probes) {
+            if self.counters[bit] == 0 {
+                self.set_bit(bit, true);
+            }
+            self.counters[bit] = self.counters[bit].saturating_add(1);
+        }
+        self.items += 1;
+    }
+
+    // Only for IDs that were inserted; anything else corrupts the counts.
+    pub fn remove(&mut self, id: u128) {
+        for bit in probes(id, self.counters.len(), self.probes) {
+            if self.counters[bit] != u8::MAX {
+                self.counters[bit] -= 1;
+                if self.counters[bit] == 0 {
+                    self.set_bit(bit, false);
+                }
+            }
+        }
+        self.items -= 1;
+    }
+
+    pub fn summary(&self) -> Bloom {
+        Bloom {
+            blocks: self.bits.clone(),
+            words: self.counters.len() / 64,
+            probes: self.probes,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn id(i: u64) -> u128 {
+        xxhash_rust::xxh3::xxh3_128(&i.to_le_bytes())
+    }
+
+    #[test]
+    fn removed_ids_leave_the_summary() {
+        let mut filter = CountingBloom::with_capacity(1000);
+        for i in 0..1000 {
+            filter.insert(id(i));
+        }
+        let before = filter.summary();
+        assert!((0..1000).all(|i| before.may_contain(id(i))));
+        assert!(!filter.is_full());
+
+        for i in 0..500 {
+            filter.remove(id(i));
+        }
+        let after = filter.summary();
+        assert!((500..1000).all(|i| after.may_contain(id(i))));
+        let stale = (0..500).filter(|&i| after.may_contain(id(i))).count();
+        assert!(stale < 25, "{} removed ids still present", stale);
+        // A summary taken earlier does not change under it.
+        assert!((0..1000).all(|i| before.may_contain(id(i))));
+
+        // Removing everything clears every bit.
+        for i in 500..1000 {
+            filter.remove(id(i));
+        }
+        assert!((0..1000).all(|i| !filter.summary().may_contain(id(i))));
+    }
+
+    #[test]
+    fn duplicates_are_counted() {
+        let mut filter = CountingBloom::with_capacity(10);
+        filter.insert(id(1));
+        filter.insert(id(1));
+        filter.remove(id(1));
+        assert!(filter.summary().may_contain(id(1)));
+        filter.remove(id(1));
+        assert!(!filter.summary().may_contain(id(1)));
+    }
+
+    #[test]
+    fn false_positive_rate_holds_at_capacity() {
+        let mut filter = CountingBloom::with_capacity(10_000);
+        for i in 0..10_000 {
+            filter.insert(id(i));
+        }
+        let summary = filter.summary();
+        let false_positives = (10_000..110_000)
+            .filter(|&i| summary.may_contain(id(i)))
+            .count();
+        assert!(false_positives < 2 * 100_000 / 100, "{}", false_positives);
+
+        filter.insert(id(10_000));
+        assert!(filter.is_full());
+    }
+
+    #[tokio::test]
+    async fn summary_survives_the_wire() {
+        let mut filter = CountingBloom::with_capacity(5000);
+        for i in 0..5000 {
+            filter.insert(id(i));
+        }
+        let mut wire = Vec::new();
+        write_summary(&mut wire, &filter.summary()).await.unwrap();
+        let summary = read_summary(&mut wire.as_slice()).await.unwrap();
+        for i in 0..20_000 {
+            assert_eq!(
+                summary.may_contain(id(i)),
+                filter.summary().may_contain(id(i))
+            );
+        }
+    }
+}
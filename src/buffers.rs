@@ -0,0 +1,173 @@
+use std::alloc::{self, Layout};
+use std::cell::RefCell;
+use std::ops::{Deref, DerefMut};
+use std::ptr::NonNull;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
+
+// Buffers come in power-of-two classes from 64 KiB to 1 MiB.
+const MIN_SHIFT: u32 = 16;
+const CLASSES: usize = 5;
+pub const MAX_BUFFER: usize = 1 << (MIN_SHIFT as usize + CLASSES - 1);
+
+// Page-aligned, so a buffer can also take O_DIRECT reads.
+const ALIGN: usize = 4096;
+
+// Free buffers kept per class by each thread, and by the pool for all
+// threads; anything returned beyond that is freed.
+const THREAD_CACHE: usize = 4;
+const SHARED_CACHE: usize = 64;
+
+fn class_size(class: usize) -> usize {
+    1 << (MIN_SHIFT as usize + class)
+}
+
+fn layout(class: usize) -> Layout {
+    Layout::from_size_align(class_size(class), ALIGN).unwrap()
+}
+
+struct Block {
+    ptr: NonNull<u8>,
+    class: usize,
+}
+
+// A block is plain memory owned by whoever holds it, and shared buffers
+// are only read.
+unsafe impl Send for Block {}
+unsafe impl Sync for Block {}
+
+impl Drop for Block {
+    fn drop(&mut self) {
+        unsafe { alloc::dealloc(self.ptr.as_ptr(), layout(self.class)) };
+    }
+}
+
+struct Class {
+    free: Mutex<Vec<Block>>,
+    in_use: AtomicUsize,
+    high_water: AtomicUsize,
+    allocated: AtomicUsize,
+}
+
+static POOL: [Class; CLASSES] = [const {
+    Class {
+        free: Mutex::new(Vec::new()),
+        in_use: AtomicUsize::new(0),
+        high_water: AtomicUsize::new(0),
+        allocated: AtomicUsize::new(0),
+    }
+}; CLASSES];
+
+thread_local! {
+    static CACHE: RefCell<[Vec<Block>; CLASSES]> = const { RefCell::new([const { Vec::new() }; CLASSES]) };
+}
+
+// A pooled buffer of `len` bytes, returned to the pool on drop. Reads and
+// writes borrow one per chunk instead of allocating, so a transfer in steady
+// state allocates nothing; the thread-local caches keep the shared free lists
+// out of the way of busy threads. Contents are whatever the last user left.
+pub struct Buffer {
+    block: Option<Block>,
+    len: usize,
+}
+
+impl Buffer {
+    pub fn take(len: usize) -> Buffer {
+        assert!(len <= MAX_BUFFER, "buffer of {} bytes is not pooled", len);
+        let class =
+            (len.max(1).next_power_of_two().trailing_zeros()).saturating_sub(MIN_SHIFT) as usize;
+        let block = CACHE
+            .try_with(|cache| cache.borrow_mut()[class].pop())
+            .ok()
+            .flatten()
+            .or_else(|| POOL[class].free.lock().unwrap().pop())
+            .unwrap_or_else(|| {
+                POOL[class].allocated.fetch_add(1, Ordering::Relaxed);
+                // Zeroed once, so the contents are always initialized.
+                let ptr = unsafe { alloc::alloc_zeroed(layout(class)) };
+                let ptr =
+                    NonNull::new(ptr).unwrap_or_else(|| alloc::handle_alloc_error(layout(class)));
+                Block { ptr, class }
+            });
+        let in_use = POOL[class].in_use.fetch_add(1, Ordering::Relaxed) + 1;
+        POOL[class].high_water.fetch_max(in_use, Ordering::Relaxed);
+        Buffer {
+            block: Some(block),
+            len,
+        }
+    }
+
+    pub fn truncate(&mut self, len: usize) {
+        self.len = self.len.min(len);
+    }
+}
+
+impl Deref for Buffer {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        let block = self.block.as_ref().unwrap();
+        unsafe { std::slice::from_raw_parts(block.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl DerefMut for Buffer {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        let block = self.block.as_ref().unwrap();
+        unsafe { std::slice::from_raw_parts_mut(block.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl Drop for Buffer {
+    fn drop(&mut self) {
+        let mut block = self.block.take();
+        let class = block.as_ref().unwrap().class;
+        POOL[class].in_use.fetch_sub(1, Ordering::Relaxed);
+        // Fails only while the thread exits and its cache is gone.
+        let _ = CACHE.try_with(|cache| {
+            let list = &mut cache.borrow_mut()[class];
+            if list.len() < THREAD_CACHE {
+                list.extend(block.take());
+            }
+        });
+        if let Some(block) = block {
+            let mut free = POOL[class].free.lock().unwrap();
+            if free.len() < SHARED_CACHE {
+                free.push(block);
+            }
+        }
+    }
+}
+
+pub struct ClassStats {
+    pub size: usize,
+    pub in_use: usize,
+    pub high_water: usize,
+    pub allocated: usize,
+}
+
+pub fn stats() -> Vec<ClassStats> {
+    POOL.iter()
+        .enumerate()
+        .map(|(class, pool)| ClassStats {
+            size: class_size(class),
+            in_use: pool.in_use.load(Ordering::Relaxed),
+            high_water: pool.high_water.load(Ordering::Relaxed),
+            allocated: pool.allocated.load(Ordering::Relaxed),
+        })
+        .collect()
+}
+
+// Printed after a transfer; a steady state shows as an allocation count
+// that stays at the high-water mark however much was moved.
+pub fn report() {
+    for class in stats().iter().filter(|class| class.allocated > 0) {
+        println!(
+            "Buffer pool: {} KiB class, {} allocated, high water {}, {} in use",
+            class.size / 1024,
+            class.allocated,
+            class.high_water,
+            class.in_use
+        );
+    }
+}
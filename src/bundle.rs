@@ -0,0 +1,344 @@
+use crate::arena::{Arena, Span};
+use crate::buffers::{Buffer, MAX_BUFFER};
+use crate::compress::{Decoder, Encoder};
+use crate::config::Config;
+use crate::protocol;
+use std::collections::HashSet;
+use std::ffi::OsStr;
+use std::fs::{self, File};
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::FileExt;
+use std::path::{Component, Path};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt, BufReader};
+use tokio::task::JoinSet;
+
+// Most bytes and files in a bundle. A file bigger than a bundle is
+// streamed on its own instead.
+pub const BUNDLE_BYTES: usize = 4 << 20;
+const BUNDLE_FILES: usize = 1024;
+
+// A count of this value introduces one streamed file in place of a bundle.
+const STREAMED: u32 = u32::MAX;
+// A streamed file goes out one payload per this many bytes, so neither end
+// holds more of it than that.
+const STREAM_PIECE: usize = MAX_BUFFER;
+
+// Bundles being unpacked at once; reading waits while all are busy, so
+// memory stays bounded when the disk is slower than the network.
+const UNPACKERS: usize = 4;
+
+// Many files sent as one unit: the manifest of paths and sizes up front,
+// then every file's contents back to back. Paths are kept in one arena,
+// and a bundle is cleared and filled again rather than dropped, so the
+// files of a stream cost no allocations of their own.
+#[derive(Default)]
+pub struct Bundle {
+    paths: Arena,
+    entries: Vec<(Span, u64)>,
+    data: Vec<u8>,
+}
+
+impl Bundle {
+    pub fn push(&mut self, path: &str, contents: &[u8]) {
+        let path = self.paths.push(path.as_bytes());
+        self.entries.push((path, contents.len() as u64));
+        self.data.extend_from_slice(contents);
+    }
+
+    pub fn clear(&mut self) {
+        self.paths.reset();
+        self.entries.clear();
+        self.data.clear();
+    }
+
+    fn files(&self) -> impl Iterator<Item = (&Path, u64)> {
+        self.entries
+            .iter()
+            .map(|&(path, size)| (Path::new(OsStr::from_bytes(self.paths.bytes(path))), size))
+    }
+
+    // Whether a file of `len` bytes can join, or the bundle must go first.
+    pub fn fits(&self, len: usize) -> bool {
+        self.data.len() + len <= BUNDLE_BYTES && self.entries.len() < BUNDLE_FILES
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+}
+
+// Most paths in one request.
+const MAX_PATHS: usize = 1 << 20;
+
+// A u32 count of paths, then (u16 length, path) for each. A path names a
+// file or a directory, with "" for the whole share.
+pub async fn write_request<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    paths: &[String],
+) -> io::Result<()> {
+    let mut buf = Vec::with_capacity(4 + paths.len() * 32);
+    buf.extend_from_slice(&(paths.len() as u32).to_be_bytes());
+    for path in paths {
+        let len = u16::try_from(path.len())
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "path too long"))?;
+        buf.extend_from_slice(&len.to_be_bytes());
+        buf.extend_from_slice(path.as_bytes());
+    }
+    writer.write_all(&buf).await
+}
+
+// The requested paths, as spans of `arena`.
+pub async fn read_request<R: AsyncRead + Unpin>(
+    reader: &mut R,
+    arena: &mut Arena,
+) -> io::Result<Vec<Span>> {
+    let count = reader.read_u32().await? as usize;
+    if count > MAX_PATHS {
+        return Err(io::Error::new(io::ErrorKind::InvalidData, "too many paths"));
+    }
+    let mut paths = Vec::with_capacity(count);
+    for _ in 0..count {
+        let len = reader.read_u16().await? as usize;
+        let path = arena.read(reader, len).await?;
+        arena
+            .str(path)
+            .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "bad path"))?;
+        paths.push(path);
+    }
+    Ok(paths)
+}
+
+// A u32 file count, then (u16 length, path, u64 size) per file, then the
+// contents as one payload. A count of zero ends the stream.
+pub async fn write_bundle<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    bundle: &Bundle,
+    encoder: &mut Encoder,
+) -> io::Result<()> {
+    let mut manifest = Vec::with_capacity(4 + bundle.entries.len() * 32);
+    manifest.extend_from_slice(&(bundle.entries.len() as u32).to_be_bytes());
+    for &(path, size) in &bundle.entries {
+        manifest.extend_from_slice(&path_header(bundle.paths.bytes(path), size));
+    }
+    writer.write_all(&manifest).await?;
+    encoder.write_payload(writer, &bundle.data).await
+}
+
+pub async fn write_end<W: AsyncWrite + Unpin>(writer: &mut W) -> io::Result<()> {
+    writer.write_u32(0).await
+}
+
+fn path_header(path: &[u8], size: u64) -> Vec<u8> {
+    let mut header = Vec::with_capacity(10 + path.len());
+    header.extend_from_slice(&(path.len() as u16).to_be_bytes());
+    header.extend_from_slice(path);
+    header.extend_from_slice(&size.to_be_bytes());
+    header
+}
+
+// A file too big to bundle: the STREAMED count, (u16 length, path, u64
+// size), then the contents as one payload per piece, read as they are
+// sent. A file that shrinks meanwhile fails the stream rather than arrive
+// short.
+pub async fn write_streamed<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    path: &str,
+    file: &File,
+    size: u64,
+    encoder: &mut Encoder,
+) -> io::Result<()> {
+    writer.write_u32(STREAMED).await?;
+    writer
+        .write_all(&path_header(path.as_bytes(), size))
+        .await?;
+    let mut buf = Buffer::take(STREAM_PIECE);
+    let mut at = 0;
+    while at < size {
+        let len = (size - at).min(STREAM_PIECE as u64) as usize;
+        file.read_exact_at(&mut buf[..len], at)?;
+        encoder.write_payload(writer, &buf[..len]).await?;
+        at += len as u64;
+    }
+    Ok(())
+}
+
+// Paths come from the peer, so each must stay inside the target directory.
+fn is_relative(path: &str) -> bool {
+    !path.is_empty()
+        && Path::new(path)
+            .components()
+            .all(|component| matches!(component, Component::Normal(_)))
+}
+
+pub enum Record<'a> {
+    // The bundle read into was filled.
+    Bundle,
+    // Path and size of a streamed file, whose pieces follow.
+    Streamed(&'a Path, u64),
+    End,
+}
+
+async fn read_path<R: AsyncRead + Unpin>(
+    reader: &mut R,
+    paths: &mut Arena,
+) -> io::Result<(Span, u64)> {
+    let bad = || io::Error::new(io::ErrorKind::InvalidData, "bad bundle manifest");
+    let len = reader.read_u16().await? as usize;
+    let path = paths.read(reader, len).await?;
+    let size = reader.read_u64().await?;
+    if !paths.str(path).is_ok_and(is_relative) {
+        return Err(bad());
+    }
+    Ok((path, size))
+}
+
+// Reads the next record, a bundle's manifest and contents going into
+// `bundle` in place of what it held.
+pub async fn read_record<'a, R: AsyncRead + Unpin>(
+    reader: &mut R,
+    decoder: &mut Decoder,
+    bundle: &'a mut Bundle,
+) -> io::Result<Record<'a>> {
+    bundle.clear();
+    let count = reader.read_u32().await?;
+    if count == 0 {
+        return Ok(Record::End);
+    }
+    if count == STREAMED {
+        let (path, size) = read_path(reader, &mut bundle.paths).await?;
+        let path = Path::new(OsStr::from_bytes(bundle.paths.bytes(path)));
+        return Ok(Record::Streamed(path, size));
+    }
+    if count as usize > BUNDLE_FILES {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "bad bundle manifest",
+        ));
+    }
+    let mut total = 0u64;
+    for _ in 0..count {
+        let (path, size) = read_path(reader, &mut bundle.paths).await?;
+        total += size.min(BUNDLE_BYTES as u64 + 1);
+        bundle.entries.push((path, size));
+    }
+    if total > BUNDLE_BYTES as u64 {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "bundle too large",
+        ));
+    }
+    bundle.data.resize(total as usize, 0);
+    decoder.read_payload(reader, &mut bundle.data).await?;
+    Ok(Record::Bundle)
+}
+
+// Receives a streamed file into `target` a piece at a time.
+async fn read_streamed<R: AsyncRead + Unpin>(
+    reader: &mut R,
+    decoder: &mut Decoder,
+    target: &Path,
+    path: &Path,
+    size: u64,
+) -> io::Result<()> {
+    let full_path = target.join(path);
+    if let Some(parent) = full_path.parent() {
+        fs::create_dir_all(parent)?;
+    }
+    let file = File::create(&full_path)?;
+    let mut buf = Buffer::take(STREAM_PIECE);
+    let mut at = 0;
+    while at < size {
+        let len = (size - at).min(STREAM_PIECE as u64) as usize;
+        decoder.read_payload(reader, &mut buf[..len]).await?;
+        file.write_all_at(&buf[..len], at)?;
+        at += len as u64;
+    }
+    file.set_len(size)
+}
+
+// Creates a bundle's files below `target`: every directory it needs first,
+// each once, then the files back to back.
+fn unpack(target: &Path, bundle: &Bundle) -> io::Result<()> {
+    let dirs: HashSet<&Path> = bundle
+        .files()
+        .filter_map(|(path, _)| path.parent())
+        .collect();
+    for dir in dirs {
+        fs::create_dir_all(target.join(dir))?;
+    }
+    let mut at = 0;
+    for (path, size) in bundle.files() {
+        let end = at + size as usize;
+        fs::write(target.join(path), &bundle.data[at..end])?;
+        at = end;
+    }
+    Ok(())
+}
+
+#[derive(Default)]
+pub struct Fetched {
+    pub files: usize,
+    pub bytes: u64,
+    pub bundles: usize,
+}
+
+// Fetches files and directories of the share, "" being all of it, into
+// `target`. Bundles are unpacked on blocking threads while the next ones
+// arrive, and an unpacked bundle is read into again.
+pub async fn fetch(config: &Config, paths: &[String], target: &Path) -> io::Result<Fetched> {
+    let mut socket = config.transport().connect(&config.connect).await?;
+    let mut offered = protocol::FEATURE_BUNDLE;
+    if config.compress {
+        offered |= protocol::FEATURE_ZSTD;
+    }
+    let features = protocol::client_handshake(&mut socket, offered).await?;
+    if features & protocol::FEATURE_BUNDLE == 0 {
+        return Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "server does not send directories",
+        ));
+    }
+    let mut decoder = if features & protocol::FEATURE_ZSTD != 0 {
+        Decoder::zstd()?
+    } else {
+        Decoder::plain()
+    };
+    write_request(&mut socket, paths).await?;
+
+    let mut reader = BufReader::new(socket);
+    let mut fetched = Fetched::default();
+    let mut unpacking = JoinSet::new();
+    let mut next = Bundle::default();
+    loop {
+        match read_record(&mut reader, &mut decoder, &mut next).await? {
+            Record::Bundle => {}
+            Record::Streamed(path, size) => {
+                read_streamed(&mut reader, &mut decoder, target, path, size).await?;
+                fetched.files += 1;
+                fetched.bytes += size;
+                continue;
+            }
+            Record::End => break,
+        }
+        fetched.files += next.entries.len();
+        fetched.bytes += next.data.len() as u64;
+        fetched.bundles += 1;
+        let spare = if unpacking.len() >= UNPACKERS {
+            unpacking
+                .join_next()
+                .await
+                .unwrap()
+                .map_err(io::Error::other)??
+        } else {
+            Bundle::default()
+        };
+        let bundle = std::mem::replace(&mut next, spare);
+        let target = target.to_path_buf();
+        unpacking.spawn_blocking(move || unpack(&target, &bundle).map(|()| bundle));
+    }
+    while let Some(unpacked) = unpacking.join_next().await {
+        unpacked.map_err(io::Error::other)??;
+    }
+    Ok(fetched)
+}
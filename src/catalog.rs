@@ -0,0 +1,534 @@
+use crate::bloom::{Bloom, CountingBloom};
+use crate::index::{Changed, IndexEntry, ShareIndex};
+use crate::shards::Sharded;
+use crate::tree::Tree;
+use std::cell::RefCell;
+use std::collections::hash_map::Entry;
+use std::collections::HashMap;
+use std::fs;
+use std::io;
+use std::os::unix::fs::MetadataExt;
+use std::path::Path;
+use std::sync::atomic::{AtomicPtr, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, OnceLock};
+use xxhash_rust::xxh3::xxh3_64;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct FileInfo {
+    pub size: u64,
+    pub mtime: i64,
+    pub inode: u64,
+    pub root: u128,
+    pub piece_count: usize,
+}
+
+impl FileInfo {
+    pub fn matches(&self, meta: &fs::Metadata) -> bool {
+        self.size == meta.size()
+            && self.mtime == crate::index::mtime_nanos(meta)
+            && self.inode == meta.ino()
+    }
+}
+
+impl From<IndexEntry<'_>> for FileInfo {
+    fn from(entry: IndexEntry<'_>) -> Self {
+        FileInfo {
+            size: entry.size,
+            mtime: entry.mtime,
+            inode: entry.inode,
+            root: entry.root,
+            piece_count: entry.piece_count(),
+        }
+    }
+}
+
+// A file indexed outside the on-disk index, with its piece hashes kept so
+// the overlay can be written into a new index without reading it again.
+#[derive(Clone)]
+pub struct Indexed {
+    pub info: FileInfo,
+    pub pieces: Arc<[u128]>,
+}
+
+impl Indexed {
+    // Hashes the file at `path`, whose metadata is `meta`.
+    pub fn hash(path: &Path, meta: &fs::Metadata) -> io::Result<Indexed> {
+        let (size, pieces) = crate::index::hash_path(path)?;
+        Ok(Indexed {
+            info: FileInfo {
+                size,
+                mtime: crate::index::mtime_nanos(meta),
+                inode: meta.ino(),
+                root: crate::index::merkle_root(&pieces),
+                piece_count: pieces.len(),
+            },
+            pieces: pieces.into(),
+        })
+    }
+}
+
+// Where each of an index's files is, by a hash of its path and by its
+// Merkle root. Built once per index and shared by every version on it.
+struct Positions {
+    paths: Sharded<u64, u32>,
+    roots: Sharded<u128, u32>,
+}
+
+// The on-disk index plus the changes seen since it was loaded, all found
+// by hash rather than by searching the index. Copies share everything but
+// the shards written since.
+#[derive(Clone)]
+struct Files {
+    base: Arc<ShareIndex>,
+    positions: Arc<Positions>,
+    // An entry of `None` marks a removed file.
+    overlay: Sharded<String, Option<Indexed>>,
+    // Paths in the overlay holding each Merkle root.
+    holders: Sharded<u128, Vec<String>>,
+}
+
+impl Files {
+    fn new(base: Arc<ShareIndex>) -> Files {
+        let mut positions = Positions {
+            paths: Sharded::new(),
+            roots: Sharded::new(),
+        };
+        for (position, entry) in base.entries().enumerate() {
+            positions
+                .paths
+                .insert(xxh3_64(entry.path.as_bytes()), position as u32);
+            positions.roots.entry(entry.root).or_insert(position as u32);
+        }
+        Files {
+            base,
+            positions: Arc::new(positions),
+            overlay: Sharded::new(),
+            holders: Sharded::new(),
+        }
+    }
+
+    fn base_entry(&self, path: &str) -> Option<IndexEntry<'_>> {
+        let position = *self.positions.paths.get(&xxh3_64(path.as_bytes()))?;
+        let entry = self.base.entry(position as usize);
+        if entry.path == path {
+            Some(entry)
+        } else {
+            // Another path with the same 64-bit hash.
+            self.base.lookup(path)
+        }
+    }
+
+    fn lookup(&self, path: &str) -> Option<FileInfo> {
+        match self.overlay.get(path) {
+            Some(indexed) => indexed.as_ref().map(|indexed| indexed.info),
+            None => self.base_entry(path).map(FileInfo::from),
+        }
+    }
+
+    fn pieces(&self, path: &str) -> Option<Indexed> {
+        match self.overlay.get(path) {
+            Some(indexed) => indexed.clone(),
+            None => {
+                let entry = self.base_entry(path)?;
+                let pieces = entry.piece_hashes().collect();
+                Some(Indexed {
+                    info: FileInfo::from(entry),
+                    pieces,
+                })
+            }
+        }
+    }
+
+    // A path holding the file with Merkle root `root`. A copy in the index
+    // behind one changed since is found again after the next rescan.
+    fn find(&self, root: u128) -> Option<String> {
+        if let Some(path) = self.holders.get(&root).and_then(|paths| paths.first()) {
+            return Some(path.clone());
+        }
+        let entry = self.base.entry(*self.positions.roots.get(&root)? as usize);
+        (!self.overlay.contains_key(entry.path)).then(|| entry.path.to_string())
+    }
+
+    // Records a change to `path`, returning what it replaced.
+    fn change(&mut self, path: String, indexed: Option<Indexed>) -> Option<FileInfo> {
+        let previous = self.lookup(&path);
+        if let Some(Some(old)) = self.overlay.get(&path) {
+            if let Entry::Occupied(mut holders) = self.holders.entry(old.info.root) {
+                holders.get_mut().retain(|held| *held != path);
+                if holders.get().is_empty() {
+                    holders.remove();
+                }
+            }
+        }
+        if let Some(indexed) = &indexed {
+            self.holders
+                .entry(indexed.info.root)
+                .or_default()
+                .push(path.clone());
+        }
+        self.overlay.insert(path, indexed);
+        previous
+    }
+
+    // (path, size, root) of every file.
+    fn files(&self) -> Vec<(String, u64, u128)> {
+        let mut files: Vec<_> = self
+            .base
+            .entries()
+            .filter(|entry| !self.overlay.contains_key(entry.path))
+            .map(|entry| (entry.path.to_string(), entry.size, entry.root))
+            .collect();
+        files.extend(self.overlay.iter().filter_map(|(path, indexed)| {
+            let info = indexed.as_ref()?.info;
+            Some((path.clone(), info.size, info.root))
+        }));
+        files
+    }
+
+    // Paths of every file below the directory `prefix`.
+    fn paths_under(&self, prefix: &str) -> Vec<String> {
+        let mut paths: Vec<String> = self
+            .base
+            .entries_under(prefix)
+            .filter(|entry| !self.overlay.contains_key(entry.path))
+            .map(|entry| entry.path.to_string())
+            .collect();
+        paths.extend(
+            self.overlay
+                .iter()
+                .filter(|(path, info)| info.is_some() && path.starts_with(prefix))
+                .map(|(path, _)| path.clone()),
+        );
+        paths
+    }
+}
+
+// One version of the catalog: the files shared, with a summary of their
+// Merkle roots. Never modified once published, so whoever holds a snapshot
+// sees one consistent share for as long as they keep it.
+pub struct Snapshot {
+    pub version: u64,
+    files: Files,
+    // What this peer holds, for a downloader to rule it out without a
+    // connection per file.
+    pub summary: Bloom,
+    // Directory hashes, built when first asked for. Once they have been,
+    // every later version derives its own from them as it is published.
+    tree: OnceLock<Arc<Tree>>,
+}
+
+impl Snapshot {
+    pub fn lookup(&self, path: &str) -> Option<FileInfo> {
+        self.files.lookup(path)
+    }
+
+    pub fn paths_under(&self, prefix: &str) -> Vec<String> {
+        self.files.paths_under(prefix)
+    }
+
+    pub fn tree(&self) -> &Tree {
+        self.tree
+            .get_or_init(|| Arc::new(Tree::build(self.files.files())))
+    }
+
+    // The tree of the version after this one, if this one has a tree: a
+    // copy of it with `changes` applied, so only the directories they touch
+    // are rehashed.
+    fn next_tree<'a>(
+        &self,
+        changes: impl IntoIterator<Item = (&'a str, Option<(u64, u128)>)>,
+    ) -> OnceLock<Arc<Tree>> {
+        let next = OnceLock::new();
+        if let Some(tree) = self.tree.get() {
+            let mut tree = Tree::clone(tree);
+            tree.apply(changes);
+            let _ = next.set(Arc::new(tree));
+        }
+        next
+    }
+}
+
+// Summaries start with room for this many files and double when full.
+const MIN_SUMMARY_CAPACITY: usize = 1024;
+
+fn summarize(files: &[(String, u64, u128)]) -> CountingBloom {
+    let mut contents = CountingBloom::with_capacity((files.len() * 2).max(MIN_SUMMARY_CAPACITY));
+    for (_, _, root) in files {
+        contents.insert(*root);
+    }
+    contents
+}
+
+// The current snapshot, replaced with one atomic swap. A reader counts
+// itself in `readers` only while it goes from loading the pointer to
+// holding its own reference; a writer frees the snapshot it replaced once
+// no reader is in that window. Readers never wait, and a writer waits at
+// most for the few instructions a reader spends there.
+struct Current {
+    snapshot: AtomicPtr<Snapshot>,
+    readers: AtomicUsize,
+}
+
+impl Current {
+    fn new(snapshot: Arc<Snapshot>) -> Current {
+        Current {
+            snapshot: AtomicPtr::new(Arc::into_raw(snapshot).cast_mut()),
+            readers: AtomicUsize::new(0),
+        }
+    }
+
+    fn load(&self) -> Arc<Snapshot> {
+        self.readers.fetch_add(1, Ordering::SeqCst);
+        let ptr = self.snapshot.load(Ordering::SeqCst);
+        // The writer that replaces `ptr` keeps its reference until
+        // `readers` drops back, so it is still alive here.
+        let snapshot = unsafe {
+            Arc::increment_strong_count(ptr);
+            Arc::from_raw(ptr)
+        };
+        self.readers.fetch_sub(1, Ordering::SeqCst);
+        snapshot
+    }
+
+    fn store(&self, snapshot: Arc<Snapshot>) {
+        let old = self
+            .snapshot
+            .swap(Arc::into_raw(snapshot).cast_mut(), Ordering::SeqCst);
+        while self.readers.load(Ordering::SeqCst) != 0 {
+            std::thread::yield_now();
+        }
+        drop(unsafe { Arc::from_raw(old) });
+    }
+}
+
+impl Drop for Current {
+    fn drop(&mut self) {
+        drop(unsafe { Arc::from_raw(*self.snapshot.get_mut()) });
+    }
+}
+
+// Overlays smaller than this are never compacted; beyond it, once they
+// reach a quarter of the index.
+const MIN_COMPACT: usize = 1024;
+
+// The files currently shared, published as a series of immutable
+// snapshots. Writers build each new version beside the current one and
+// swap it in, so a change of many files, or a whole rescan, appears at
+// once, and rebuilding never holds up a reader.
+pub struct Catalog {
+    id: u64,
+    // Version of the snapshot in `current`, stored after each swap.
+    version: AtomicU64,
+    // Readers take it only once per version per thread; see `read`.
+    current: Current,
+    // Counts behind the summary, so it follows updates without a rebuild.
+    // Writers only; its lock also serializes them.
+    contents: Mutex<CountingBloom>,
+}
+
+static NEXT_CATALOG: AtomicU64 = AtomicU64::new(0);
+
+thread_local! {
+    // The snapshot this thread last read and its catalog. A thread that
+    // stops reading keeps its last version alive until it reads again.
+    static LAST_READ: RefCell<Option<(u64, Arc<Snapshot>)>> = const { RefCell::new(None) };
+}
+
+impl Catalog {
+    pub fn new(base: Arc<ShareIndex>) -> Self {
+        let files = Files::new(base);
+        let contents = summarize(&files.files());
+        let snapshot = Snapshot {
+            version: 0,
+            files,
+            summary: contents.summary(),
+            tree: OnceLock::new(),
+        };
+        Catalog {
+            id: NEXT_CATALOG.fetch_add(1, Ordering::Relaxed),
+            version: AtomicU64::new(0),
+            current: Current::new(Arc::new(snapshot)),
+            contents: Mutex::new(contents),
+        }
+    }
+
+    pub fn version(&self) -> u64 {
+        self.version.load(Ordering::Acquire)
+    }
+
+    // The current snapshot, to serve a whole request or connection from.
+    pub fn snapshot(&self) -> Arc<Snapshot> {
+        self.current.load()
+    }
+
+    // Runs `f` on the current snapshot. Each thread keeps the snapshot it
+    // last read, so while the version is unchanged a read is one atomic
+    // load and no shared reference count is bumped, which would bounce a
+    // cache line between every core serving the share.
+    fn read<R>(&self, f: impl FnOnce(&Snapshot) -> R) -> R {
+        let version = self.version();
+        LAST_READ.with(|last| {
+            let fresh = matches!(
+                &*last.borrow(),
+                Some((id, snapshot)) if *id == self.id && snapshot.version == version
+            );
+            if !fresh {
+                *last.borrow_mut() = Some((self.id, self.snapshot()));
+            }
+            f(&last.borrow().as_ref().unwrap().1)
+        })
+    }
+
+    pub fn lookup(&self, path: &str) -> Option<FileInfo> {
+        self.read(|snapshot| snapshot.lookup(path))
+    }
+
+    pub fn paths_under(&self, prefix: &str) -> Vec<String> {
+        self.read(|snapshot| snapshot.paths_under(prefix))
+    }
+
+    pub fn find(&self, root: u128) -> Option<String> {
+        self.read(|snapshot| snapshot.files.find(root))
+    }
+
+    // The file at `path` with its piece hashes.
+    pub fn pieces(&self, path: &str) -> Option<Indexed> {
+        self.read(|snapshot| snapshot.files.pieces(path))
+    }
+
+    // Precompressed copy of a piece from the on-disk index, if one exists.
+    pub fn precompressed(&self, hash: u128) -> Option<Vec<u8>> {
+        self.read(|snapshot| snapshot.files.base.precompressed(hash).map(<[u8]>::to_vec))
+    }
+
+    fn publish(&self, snapshot: Snapshot) {
+        let version = snapshot.version;
+        self.current.store(Arc::new(snapshot));
+        self.version.store(version, Ordering::Release);
+    }
+
+    // Publishes a batch of changes as one new version, so readers see all
+    // of them or none.
+    pub fn apply(&self, changes: &[(String, Option<Indexed>)]) {
+        let mut contents = self.contents.lock().unwrap();
+        let previous = self.snapshot();
+        let mut files = previous.files.clone();
+        for (path, indexed) in changes {
+            if let Some(old) = files.change(path.clone(), indexed.clone()) {
+                contents.remove(old.root);
+            }
+            if let Some(indexed) = indexed {
+                contents.insert(indexed.info.root);
+            }
+        }
+        if contents.is_full() {
+            *contents = summarize(&files.files());
+        }
+        let tree = previous.next_tree(changes.iter().map(|(path, indexed)| {
+            let file = indexed
+                .as_ref()
+                .map(|indexed| (indexed.info.size, indexed.info.root));
+            (path.as_str(), file)
+        }));
+        self.publish(Snapshot {
+            version: previous.version + 1,
+            files,
+            summary: contents.summary(),
+            tree,
+        });
+    }
+
+    // Replaces the base index after a full rescan, returning every file whose
+    // entry differs from what the catalog held before. The difference is
+    // worked out from the previous snapshot, which readers go on using until
+    // the new one is swapped in.
+    pub fn rebase(&self, base: Arc<ShareIndex>) -> Vec<(String, Option<FileInfo>)> {
+        let mut contents = self.contents.lock().unwrap();
+        let previous = self.snapshot();
+        let mut before: HashMap<String, FileInfo> = previous
+            .files
+            .base
+            .entries()
+            .map(|entry| (entry.path.to_string(), FileInfo::from(entry)))
+            .collect();
+        for (path, indexed) in previous.files.overlay.iter() {
+            match indexed {
+                Some(indexed) => before.insert(path.clone(), indexed.info),
+                None => before.remove(path),
+            };
+        }
+
+        // The summary follows the difference, like any update.
+        let mut changes = Vec::new();
+        for entry in base.entries() {
+            let path = entry.path;
+            let info = FileInfo::from(entry);
+            match before.remove(path) {
+                Some(previous) if previous == info => {}
+                previous => {
+                    if let Some(previous) = previous {
+                        contents.remove(previous.root);
+                    }
+                    contents.insert(info.root);
+                    changes.push((path.to_string(), Some(info)));
+                }
+            }
+        }
+        for (path, previous) in before {
+            contents.remove(previous.root);
+            changes.push((path, None));
+        }
+
+        let files = Files::new(base);
+        if contents.is_full() {
+            *contents = summarize(&files.files());
+        }
+        let tree = previous.next_tree(
+            changes
+                .iter()
+                .map(|(path, info)| (path.as_str(), info.map(|info| (info.size, info.root)))),
+        );
+        self.publish(Snapshot {
+            version: previous.version + 1,
+            files,
+            summary: contents.summary(),
+            tree,
+        });
+        changes
+    }
+
+    // Writes the overlay into a new on-disk index for the share at `root`
+    // once it has grown past a quarter of the index, so it is not copied
+    // and searched ever larger. Its piece hashes are written as they are,
+    // so no file is read. Returns whether it did.
+    pub fn compact(&self, root: &Path) -> io::Result<bool> {
+        let contents = self.contents.lock().unwrap();
+        let previous = self.snapshot();
+        let files = &previous.files;
+        if files.overlay.len() < MIN_COMPACT.max(files.base.len() / 4) {
+            return Ok(false);
+        }
+        let changed = files.overlay.iter().filter_map(|(path, indexed)| {
+            let indexed = indexed.as_ref()?;
+            Some(Changed {
+                path,
+                size: indexed.info.size,
+                mtime: indexed.info.mtime,
+                inode: indexed.info.inode,
+                root: indexed.info.root,
+                pieces: &indexed.pieces,
+            })
+        });
+        let base = files
+            .base
+            .compact(root, |path| files.overlay.contains_key(path), changed)?;
+        // The same files, so the summary and the tree stand.
+        self.publish(Snapshot {
+            version: previous.version + 1,
+            files: Files::new(Arc::new(base)),
+            summary: contents.summary(),
+            tree: previous.tree.clone(),
+        });
+        Ok(true)
+    }
+}
@@ -1,28 +1,852 @@
-use tokio::net::TcpStream;
-use tokio::io::AsyncReadExt;
-use std::fs::File;
+use crate::arena::Arena;
+use crate::bitfield::{Availability, Bitfield};
+use crate::bloom;
+use crate::buffers::{self, Buffer, MAX_BUFFER};
+use crate::bundle;
+use crate::compress::Decoder;
+use crate::config::Config;
+use crate::delta;
+use crate::erasure::{self, Codec, ShardRequest};
+use crate::index::PIECE_SIZE;
+use crate::mmap::Mmap;
+use crate::protocol;
+use crate::relay::{self, Fanout};
+use crate::sparse;
+use crate::store::{Ingest, Manifest, Store};
+use crate::stripe;
+use crate::transport::Transport;
+use crate::tree;
+use std::fs::{self, File};
 use std::io::Write;
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::Instant;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt, BufReader};
+use tokio::net::TcpStream;
+use tokio::runtime::Runtime;
+use tokio::sync::mpsc;
+use tokio::task::JoinSet;
+use xxhash_rust::xxh3::Xxh3Default;
 
-pub fn start_client() -> std::io::Result<()> {
-    tokio::runtime::Runtime::new()?.block_on(async {
-        let mut socket = TcpStream::connect("127.0.0.1:8080").await?;
-        println!("Connected to server!");
-
-        let file_size = socket.read_u32().await?;
-        if file_size == 0 {
-            eprintln!("Server reported: File not found.");
+pub fn start_client(config: &Config, runtime: &Runtime) -> std::io::Result<()> {
+    runtime.block_on(async {
+        if config.mirror {
+            return tree::mirror(config, Path::new("received")).await;
+        }
+        if let Some(dir) = &config.dir {
+            let start = Instant::now();
+            let fetched = bundle::fetch(config, &[dir.clone()], Path::new("received")).await?;
+            println!(
+                "Received {} files ({} bytes) in {} bundles in {:?}",
+                fetched.files,
+                fetched.bytes,
+                fetched.bundles,
+                start.elapsed()
+            );
             return Ok(());
         }
+        if !config.sources.is_empty() {
+            return fetch_shards(config).await;
+        }
+        if config.stripes > 1 {
+            return stripe::fetch(config).await;
+        }
+        while sync(config).await? {
+            println!("example.txt changed on the server, syncing again");
+        }
+        buffers::report();
+        Ok(())
+    })
+}
+
+// Fetches example.txt once. With --watch, then follows the server's catalog
+// updates and returns true as soon as example.txt changes.
+async fn sync(config: &Config) -> std::io::Result<bool> {
+    let mut socket = config.transport().connect(&config.connect).await?;
+    println!("Connected to server!");
 
-        println!("Receiving file of size: {} bytes", file_size);
+    let mut offered = protocol::FEATURE_SPARSE;
+    if config.compress {
+        offered |= protocol::FEATURE_ZSTD;
+    }
+    if config.watch {
+        offered |= protocol::FEATURE_WATCH;
+    }
+    if config.store.is_some() {
+        offered |= protocol::FEATURE_PIECES;
+    }
+    let features = protocol::client_handshake(&mut socket, offered).await?;
+    let mut decoder = if features & protocol::FEATURE_ZSTD != 0 {
+        println!("Server accepted zstd compression");
+        Decoder::zstd()?
+    } else {
+        Decoder::plain()
+    };
 
-        let mut buffer = vec![0; file_size as usize];
-        socket.read_exact(&mut buffer).await?;
+    let target = Path::new("received_example.txt");
+    // Mapped, so signing and copying from a large local copy pages it in
+    // rather than reading it whole.
+    let basis = if target.exists() {
+        Mmap::open(&File::open(target)?)?
+    } else {
+        Mmap::empty()
+    };
+    let (block_size, signatures) = if basis.is_empty() {
+        (0, Vec::new())
+    } else {
+        let block_size = delta::block_size_for(basis.len() as u64);
+        (block_size, delta::signatures(&basis, block_size))
+    };
+    if block_size != 0 {
+        println!(
+            "Found local copy, sending {} block signatures",
+            signatures.len()
+        );
+    }
+    delta::write_signatures(&mut socket, block_size, &signatures).await?;
 
-        let mut file = File::create("received_example.txt")?;
-        file.write_all(&buffer)?;
-        println!("File received and saved as 'received_example.txt'.");
+    let mut reader = BufReader::new(socket);
+    let file_size = reader.read_u64().await?;
+    if file_size == 0 {
+        eprintln!("Server reported: File not found.");
+        return Ok(false);
+    }
 
+    println!("Receiving file of size: {} bytes", file_size);
+
+    let mut store = config.store.as_deref().map(Store::open).transpose()?;
+    // With a store, the server may first list the file's pieces so that
+    // only those the store lacks are sent. The feature is only offered with
+    // a store, so there is one.
+    let sparse = features & protocol::FEATURE_SPARSE != 0;
+    let listed = block_size == 0 && features & protocol::FEATURE_PIECES != 0;
+    if listed {
+        let store = store.as_mut().unwrap();
+        if !receive_pieces(target, &mut reader, &mut decoder, file_size, store).await? {
+            receive(
+                target,
+                &mut reader,
+                &mut decoder,
+                file_size,
+                sparse,
+                Some(store),
+            )
+            .await?;
+        }
+    } else if block_size == 0 {
+        receive(
+            target,
+            &mut reader,
+            &mut decoder,
+            file_size,
+            sparse,
+            store.as_mut(),
+        )
+        .await?;
+    } else {
+        receive_delta(
+            target,
+            &mut reader,
+            &mut decoder,
+            &basis,
+            block_size,
+            file_size,
+            store.as_mut(),
+        )
+        .await?;
+    }
+    println!("File received and saved as 'received_example.txt'.");
+
+    if features & protocol::FEATURE_WATCH == 0 {
+        return Ok(false);
+    }
+    println!("Watching the server for changes...");
+    let mut arena = Arena::new();
+    loop {
+        let update = protocol::read_update(&mut reader, &mut arena).await?;
+        match update.file {
+            Some((size, root)) => {
+                println!(
+                    "Updated: {} ({} bytes, root {:032x})",
+                    update.path, size, root
+                )
+            }
+            None => println!("Removed: {}", update.path),
+        }
+        if update.path == "example.txt" && update.file.is_some() {
+            return Ok(true);
+        }
+    }
+}
+
+// Writes next to the target and renames over it, so an interrupted transfer
+// never leaves a half-written file behind. With --store, the file goes into
+// the store and is materialized from there instead.
+// Moves a fully written partial file into place, or with a store, reads it
+// into the store and materializes the target from there.
+fn finish(
+    file: File,
+    partial: &Path,
+    target: &Path,
+    store: Option<&mut Store>,
+) -> std::io::Result<()> {
+    let Some(store) = store else {
+        file.sync_all()?;
+        return fs::rename(partial, target);
+    };
+    let size = file.metadata()?.len();
+    let mut ingest = store.ingest();
+    let mut offset = 0;
+    while offset < size {
+        let mut chunk = Buffer::take((size - offset).min(MAX_BUFFER as u64) as usize);
+        file.read_exact_at(&mut chunk, offset)?;
+        ingest.write(&chunk)?;
+        offset += chunk.len() as u64;
+    }
+    let (manifest, added) = ingest.finish()?;
+    // Out of the way of the partial file materializing writes.
+    fs::remove_file(partial)?;
+    materialize(store, &manifest, added, target)
+}
+
+// Where a full transfer lands: the partial file next to the target, or the
+// store.
+enum Sink<'a> {
+    File(File),
+    Store(Ingest<'a>),
+}
+
+impl<'a> Sink<'a> {
+    fn create(partial: &Path, size: u64, store: Option<&'a mut Store>) -> std::io::Result<Self> {
+        Ok(match store {
+            Some(store) => Sink::Store(store.ingest()),
+            None => {
+                let file = File::create(partial)?;
+                file.set_len(size)?;
+                Sink::File(file)
+            }
+        })
+    }
+
+    // The store takes the file in order, so it ignores `offset`.
+    fn write_at(&mut self, data: &[u8], offset: u64) -> std::io::Result<()> {
+        match self {
+            Sink::File(file) => file.write_all_at(data, offset),
+            Sink::Store(ingest) => ingest.write(data),
+        }
+    }
+}
+
+// Streams a full payload through pooled buffers instead of holding the
+// whole file. Each buffer is a multiple of the compression chunk size, so
+// the payload decodes piece by piece. A sparse transfer
+// sends only the data extents; the file is sized up front, so whatever
+// no extent covers stays a hole.
+async fn receive<R: AsyncRead + Unpin>(
+    target: &Path,
+    reader: &mut R,
+    decoder: &mut Decoder,
+    size: u64,
+    sparse: bool,
+    mut store: Option<&mut Store>,
+) -> std::io::Result<()> {
+    let partial = target.with_extension("txt.part");
+    let mut sink = Sink::create(&partial, size, store.as_deref_mut())?;
+
+    let mut end = 0;
+    loop {
+        let extent = if sparse {
+            match sparse::read_extent(reader, end, size).await? {
+                Some(extent) => extent,
+                None => break,
+            }
+        } else if end < size {
+            0..size
+        } else {
+            break;
+        };
+        if let Sink::Store(ingest) = &mut sink {
+            ingest.hole(extent.start - end)?;
+        }
+        let mut offset = extent.start;
+        while offset < extent.end {
+            let mut chunk = Buffer::take((extent.end - offset).min(MAX_BUFFER as u64) as usize);
+            decoder.read_payload(reader, &mut chunk).await?;
+            sink.write_at(&chunk, offset)?;
+            offset += chunk.len() as u64;
+        }
+        end = extent.end;
+    }
+
+    match sink {
+        Sink::File(file) => {
+            file.sync_all()?;
+            fs::rename(&partial, target)
+        }
+        Sink::Store(mut ingest) => {
+            ingest.hole(size - end)?;
+            let (manifest, added) = ingest.finish()?;
+            materialize(store.unwrap(), &manifest, added, target)
+        }
+    }
+}
+
+// Rebuilds the file from a delta against the local copy, writing it out
+// as it is reconstructed.
+async fn receive_delta<R: AsyncRead + Unpin>(
+    target: &Path,
+    reader: &mut R,
+    decoder: &mut Decoder,
+    basis: &[u8],
+    block_size: u32,
+    size: u64,
+    mut store: Option<&mut Store>,
+) -> std::io::Result<()> {
+    let partial = target.with_extension("txt.part");
+    let mut sink = Sink::create(&partial, size, store.as_deref_mut())?;
+    let mut offset = 0;
+    delta::apply_delta(reader, basis, block_size, size, decoder, |data| {
+        sink.write_at(data, offset)?;
+        offset += data.len() as u64;
         Ok(())
     })
+    .await?;
+
+    match sink {
+        Sink::File(file) => {
+            file.sync_all()?;
+            fs::rename(&partial, target)
+        }
+        Sink::Store(ingest) => {
+            let (manifest, added) = ingest.finish()?;
+            materialize(store.unwrap(), &manifest, added, target)
+        }
+    }
+}
+
+// Receives into the store only the pieces it does not already hold. The
+// server lists the file's piece hashes and is answered with a bit per piece
+// wanted; the rest, and pieces of zeros, come from the store. Returns false
+// if the server had no list to offer, in which case the whole file follows
+// as usual.
+async fn receive_pieces<S: AsyncRead + AsyncWrite + Unpin>(
+    target: &Path,
+    reader: &mut BufReader<S>,
+    decoder: &mut Decoder,
+    size: u64,
+    store: &mut Store,
+) -> std::io::Result<bool> {
+    let count = reader.read_u32().await? as usize;
+    if count == 0 {
+        return Ok(false);
+    }
+    if count as u64 != size.div_ceil(PIECE_SIZE as u64) {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::InvalidData,
+            "piece list does not match the file size",
+        ));
+    }
+    let mut list = vec![0; count * 16];
+    reader.read_exact(&mut list).await?;
+    let hashes: Vec<u128> = list
+        .chunks_exact(16)
+        .map(|hash| u128::from_be_bytes(hash.try_into().unwrap()))
+        .collect();
+
+    let mut bits = vec![0u8; count.div_ceil(8)];
+    for (piece, hash) in hashes.iter().enumerate() {
+        if !store.holds(*hash) {
+            bits[piece / 8] |= 1 << (piece % 8);
+        }
+    }
+    let socket = reader.get_mut();
+    socket.write_all(&bits).await?;
+    socket.flush().await?;
+    let wanted: usize = bits.iter().map(|byte| byte.count_ones() as usize).sum();
+    println!(
+        "Store holds {} of {} pieces, fetching {}",
+        count - wanted,
+        count,
+        wanted
+    );
+
+    let mut ingest = store.ingest();
+    for (piece, hash) in hashes.iter().enumerate() {
+        let len = (size - (piece * PIECE_SIZE) as u64).min(PIECE_SIZE as u64);
+        if bits[piece / 8] & 1 << (piece % 8) == 0 {
+            ingest.held(*hash, len);
+            continue;
+        }
+        let mut chunk = Buffer::take(len as usize);
+        decoder.read_payload(reader, &mut chunk).await?;
+        ingest.write(&chunk)?;
+    }
+    let (manifest, added) = ingest.finish()?;
+    if manifest.pieces != hashes {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::InvalidData,
+            "pieces do not match the hashes listed",
+        ));
+    }
+    materialize(store, &manifest, added, target)?;
+    Ok(true)
+}
+
+fn materialize(
+    store: &mut Store,
+    manifest: &Manifest,
+    added: usize,
+    target: &Path,
+) -> std::io::Result<()> {
+    let reflinked = store.materialize(manifest, target)?;
+    println!(
+        "Stored {:032x}: {} of {} pieces new, {} reflinked into place",
+        manifest.root(),
+        added,
+        manifest.pieces.len(),
+        reflinked
+    );
+    Ok(())
+}
+
+// Messages from the per-source fetch tasks, tagged with the source index.
+enum Arrival {
+    Size(usize, u64, usize),
+    Shard(usize, usize, usize, Buffer),
+    Failed(usize),
+}
+
+struct PieceGroup {
+    // Empty until the group's first shard arrives.
+    shards: Vec<Option<Buffer>>,
+    present: usize,
+}
+
+// Downloads example.txt, or the file with the --root Merkle root, from
+// every --sources server at once. Shard i of each piece group is asked of
+// source i % sources, and a group is rebuilt as soon as any k of its shards
+// are in, so a slow or dead source only costs the shards it was carrying
+// and the download stops without waiting on it.
+// Should a failure leave some group with fewer than k shards still coming,
+// the download fails at once instead of after every other source is done.
+async fn fetch_shards(config: &Config) -> std::io::Result<()> {
+    let (data, parity) = config.erasure;
+    let codec = Codec::new(data, parity)?;
+    let (Ok(data_u8), Ok(parity_u8)) = (u8::try_from(data), u8::try_from(parity)) else {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::InvalidInput,
+            "at most 255 data and 255 parity shards",
+        ));
+    };
+    let total = codec.total_shards();
+    let transport = config.transport();
+    let start = Instant::now();
+    let sources = match config.root {
+        Some(root) => holders(config, root).await?,
+        None => config.sources.clone(),
+    };
+
+    let (arrivals, mut inbox) = mpsc::channel(64);
+    let mut fetches = Vec::new();
+    // Shards per group each source was asked for.
+    let mut carried = vec![0; sources.len()];
+    for (i, source) in sources.iter().enumerate() {
+        let shards: Vec<u8> = (i..total)
+            .step_by(sources.len())
+            .map(|index| index as u8)
+            .collect();
+        if shards.is_empty() {
+            continue;
+        }
+        carried[i] = shards.len();
+        let request = ShardRequest {
+            data: data_u8,
+            parity: parity_u8,
+            shards,
+            root: config.root.unwrap_or(0),
+        };
+        let (transport, source, arrivals) = (transport.clone(), source.clone(), arrivals.clone());
+        fetches.push(tokio::spawn(async move {
+            if let Err(e) = fetch_from(i, &*transport, &source, &request, &arrivals).await {
+                eprintln!("Source {} failed: {}", source, e);
+                let _ = arrivals.send(Arrival::Failed(i)).await;
+            }
+        }));
+    }
+    drop(arrivals);
+
+    let mut file_size = 0;
+    let mut shard_len = 0;
+    let mut groups: Vec<PieceGroup> = Vec::new();
+    let target = Path::new("received_example.txt");
+    let partial = target.with_extension("txt.part");
+    let mut output = None;
+    let mut remaining = 0;
+    let (mut received, mut from_parity) = (0, 0);
+    // Shards each group has received or can still get from live sources,
+    // rarest first; which groups each source has started sending; and which
+    // groups lost shards to a failed source.
+    let mut availability = Availability::new(0, 0);
+    let mut started = Vec::new();
+    let mut done = Bitfield::new(0);
+    let mut lost = Bitfield::new(0);
+    let mut unsettled = fetches.len();
+    let mut joined = vec![false; sources.len()];
+    while let Some(arrival) = inbox.recv().await {
+        match arrival {
+            Arrival::Size(_, 0, _) => {
+                eprintln!("Source reported: File not found.");
+                unsettled -= 1;
+            }
+            Arrival::Size(source, size, len) => {
+                if groups.is_empty() {
+                    println!(
+                        "Receiving file of size: {} bytes in {}+{} shards",
+                        size, data, parity
+                    );
+                    (file_size, shard_len) = (size, len);
+                    let group_count = size.div_ceil((len * data) as u64) as usize;
+                    groups = (0..group_count)
+                        .map(|_| PieceGroup {
+                            shards: Vec::new(),
+                            present: 0,
+                        })
+                        .collect();
+                    // Readable too, as a store reads it back in.
+                    let file = File::options()
+                        .read(true)
+                        .write(true)
+                        .create(true)
+                        .truncate(true)
+                        .open(&partial)?;
+                    file.set_len(size)?;
+                    output = Some(file);
+                    remaining = group_count;
+                    availability = Availability::new(group_count, total as u32);
+                    started = vec![Bitfield::new(group_count); sources.len()];
+                    done = Bitfield::new(group_count);
+                    lost = Bitfield::new(group_count);
+                } else if (size, len) != (file_size, shard_len) {
+                    return Err(std::io::Error::new(
+                        std::io::ErrorKind::InvalidData,
+                        "sources disagree about example.txt",
+                    ));
+                }
+                for group in 0..groups.len() {
+                    for _ in 0..carried[source] {
+                        availability.increment(group);
+                    }
+                }
+                joined[source] = true;
+                unsettled -= 1;
+            }
+            Arrival::Failed(source) if !joined[source] => {
+                // Never counted in, so there is nothing to take back, but
+                // it may have been the last source to settle.
+                unsettled -= 1;
+            }
+            Arrival::Failed(source) => {
+                // A group the source had started on keeps its count, so
+                // this errs towards waiting rather than giving up early.
+                let mut missing = Bitfield::full(groups.len());
+                missing.and_not(&done);
+                missing.and_not(&started[source]);
+                for group in missing.ones() {
+                    for _ in 0..carried[source] {
+                        availability.decrement(group);
+                    }
+                }
+                lost.or(&missing);
+            }
+            Arrival::Shard(source, group, index, bytes) => {
+                let Some(piece) = groups.get_mut(group).filter(|_| index < total) else {
+                    return Err(std::io::Error::new(
+                        std::io::ErrorKind::InvalidData,
+                        "shard out of range",
+                    ));
+                };
+                started[source].set(group);
+                if done.get(group) {
+                    continue;
+                }
+                if piece.shards.is_empty() {
+                    piece.shards = (0..total).map(|_| None).collect();
+                }
+                if piece.shards[index].is_some() {
+                    continue;
+                }
+                received += 1;
+                piece.shards[index] = Some(bytes);
+                piece.present += 1;
+                if piece.present < data {
+                    continue;
+                }
+
+                if piece.shards[..data].iter().any(Option::is_none) {
+                    from_parity += 1;
+                }
+                codec.reconstruct(&mut piece.shards, shard_len)?;
+                // Written out as soon as it is rebuilt, less the padding.
+                let file = output.as_ref().unwrap();
+                for (i, shard) in piece.shards[..data].iter().enumerate() {
+                    let at = ((group * data + i) * shard_len) as u64;
+                    let len = file_size.saturating_sub(at).min(shard_len as u64) as usize;
+                    file.write_all_at(&shard.as_ref().unwrap()[..len], at)?;
+                }
+                piece.shards = Vec::new();
+                done.set(group);
+                remaining -= 1;
+                if remaining == 0 {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        // Every source has connected or failed, so counts only fall from
+        // here on; the rarest unfinished group shows whether all can finish.
+        if unsettled == 0 && !groups.is_empty() {
+            let mut unfinished = Bitfield::full(groups.len());
+            unfinished.and_not(&done);
+            if let Some((group, count)) = availability.rarest(&unfinished) {
+                if (count as usize) < data {
+                    for fetch in &fetches {
+                        fetch.abort();
+                    }
+                    return Err(std::io::Error::new(
+                        std::io::ErrorKind::UnexpectedEof,
+                        format!(
+                            "piece group {} can no longer be rebuilt: {} of {} shards left",
+                            group, count, data
+                        ),
+                    ));
+                }
+            }
+        }
+    }
+    // Shards still in flight are no longer needed.
+    for fetch in fetches {
+        fetch.abort();
+    }
+
+    if groups.is_empty() {
+        return Ok(());
+    }
+    if remaining > 0 {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::UnexpectedEof,
+            format!("{} piece groups could not be rebuilt", remaining),
+        ));
+    }
+    let mut store = config.store.as_deref().map(Store::open).transpose()?;
+    finish(output.unwrap(), &partial, target, store.as_mut())?;
+    println!(
+        "Rebuilt {} piece groups ({} from parity) out of {} shards in {:?}",
+        groups.len(),
+        from_parity,
+        received,
+        start.elapsed()
+    );
+    lost.and(&done);
+    if lost.count_ones() > 0 {
+        println!(
+            "{} piece groups were rebuilt despite shards lost to failed sources",
+            lost.count_ones()
+        );
+    }
+    println!("File received and saved as 'received_example.txt'.");
+    Ok(())
+}
+
+// Asks every source for its content summary and keeps those that may hold
+// `root`, in their original order. A summary costs a source no file reads,
+// and a source that certainly lacks the file never gets a shard connection.
+// Unreachable sources are dropped too, so the shards are spread over the
+// ones that are left.
+async fn holders(config: &Config, root: u128) -> std::io::Result<Vec<String>> {
+    let transport = config.transport();
+    let mut queries = JoinSet::new();
+    for (i, source) in config.sources.iter().enumerate() {
+        let (transport, source) = (transport.clone(), source.clone());
+        queries.spawn(async move {
+            let result = async {
+                let mut socket = transport.connect(&source).await?;
+                let features =
+                    protocol::client_handshake(&mut socket, protocol::FEATURE_SUMMARY).await?;
+                if features & protocol::FEATURE_SUMMARY == 0 {
+                    // An older server cannot be ruled out.
+                    return Ok(true);
+                }
+                Ok(bloom::read_summary(&mut socket).await?.may_contain(root))
+            };
+            (i, result.await)
+        });
+    }
+
+    let mut keep = vec![false; config.sources.len()];
+    while let Some(query) = queries.join_next().await {
+        let (i, result): (usize, std::io::Result<bool>) = query.map_err(std::io::Error::other)?;
+        match result {
+            Ok(may_hold) => keep[i] = may_hold,
+            Err(e) => eprintln!("Source {} failed: {}", config.sources[i], e),
+        }
+    }
+    let holders: Vec<String> = config
+        .sources
+        .iter()
+        .zip(keep)
+        .filter(|(_, keep)| *keep)
+        .map(|(source, _)| source.clone())
+        .collect();
+    println!(
+        "{} of {} sources may hold {:032x}",
+        holders.len(),
+        config.sources.len(),
+        root
+    );
+    if holders.is_empty() {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::NotFound,
+            format!("no source holds {:032x}", root),
+        ));
+    }
+    Ok(holders)
+}
+
+async fn fetch_from(
+    id: usize,
+    transport: &dyn Transport,
+    source: &str,
+    request: &ShardRequest,
+    arrivals: &mpsc::Sender<Arrival>,
+) -> std::io::Result<()> {
+    let mut socket = transport.connect(source).await?;
+    let features = protocol::client_handshake(&mut socket, protocol::FEATURE_ERASURE).await?;
+    if features & protocol::FEATURE_ERASURE == 0 {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::Unsupported,
+            "server does not send erasure-coded shards",
+        ));
+    }
+    erasure::write_request(&mut socket, request).await?;
+
+    let mut reader = BufReader::new(socket);
+    let size = reader.read_u64().await?;
+    if size == 0 {
+        let _ = arrivals.send(Arrival::Size(id, 0, 0)).await;
+        return Ok(());
+    }
+    let shard_len = reader.read_u32().await? as usize;
+    if shard_len == 0 || shard_len > MAX_BUFFER {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::InvalidData,
+            "bad shard length",
+        ));
+    }
+    let groups = size.div_ceil((shard_len * request.data as usize) as u64);
+    if groups > erasure::MAX_GROUPS {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::InvalidData,
+            "file has too many piece groups",
+        ));
+    }
+    // The collector hangs up once every piece group is rebuilt.
+    if arrivals
+        .send(Arrival::Size(id, size, shard_len))
+        .await
+        .is_err()
+    {
+        return Ok(());
+    }
+    for _ in 0..groups * request.shards.len() as u64 {
+        let (group, index, bytes) = erasure::read_shard(&mut reader, shard_len).await?;
+        if arrivals
+            .send(Arrival::Shard(id, group, index, bytes))
+            .await
+            .is_err()
+        {
+            return Ok(());
+        }
+    }
+    Ok(())
+}
+
+pub fn start_relay(config: &Config, runtime: &Runtime) -> std::io::Result<()> {
+    runtime.block_on(async {
+        let listener = config.socket.listen(&config.listen).await?;
+        println!("Relay is listening on {}", config.listen);
+
+        loop {
+            let (socket, _) = listener.accept().await?;
+            config.socket.apply(&socket)?;
+            if let Err(e) = relay_push(socket, config).await {
+                eprintln!("Relay error: {}", e);
+            }
+        }
+    })
+}
+
+// Receives one pushed artifact, forwarding every chunk to this node's
+// children before writing it locally, and reports upstream how many peers
+// of the subtree ended up with a verified copy.
+async fn relay_push(mut socket: TcpStream, config: &Config) -> std::io::Result<()> {
+    let mut arena = Arena::new();
+    let header = relay::read_header(&mut socket, &mut arena).await?;
+    println!(
+        "Receiving {} ({} bytes), relaying to {} peers",
+        header.name,
+        header.size,
+        header.peers.len()
+    );
+    let mut children = Fanout::connect(
+        header.name,
+        header.size,
+        &header.peers,
+        config.fanout,
+        &config.socket,
+    )
+    .await;
+
+    let target = PathBuf::from(format!("received_{}", header.name));
+    let partial = PathBuf::from(format!("received_{}.part", header.name));
+    let mut file = File::create(&partial)?;
+    let mut hasher = Xxh3Default::new();
+    let mut trailer = Vec::with_capacity(16);
+
+    // The stream is the artifact followed by its 16-byte xxh3 digest.
+    let total = header.size + 16;
+    let mut received = 0;
+    while received < total {
+        let mut buf = Buffer::take((total - received).min(relay::RELAY_CHUNK as u64) as usize);
+        let n = socket.read(&mut buf).await?;
+        if n == 0 {
+            return Err(std::io::ErrorKind::UnexpectedEof.into());
+        }
+        buf.truncate(n);
+        // Children share the buffer; it returns to the pool after the last
+        // one has sent it.
+        let buf = Arc::new(buf);
+        children.forward(buf.clone()).await;
+
+        let data = (header.size.saturating_sub(received) as usize).min(n);
+        file.write_all(&buf[..data])?;
+        hasher.update(&buf[..data]);
+        trailer.extend_from_slice(&buf[data..n]);
+        received += n as u64;
+    }
+
+    let verified = trailer[..] == hasher.digest128().to_be_bytes();
+    if verified {
+        file.sync_all()?;
+        fs::rename(&partial, &target)?;
+        println!("Saved {}", target.display());
+    } else {
+        eprintln!("Checksum mismatch for {}, discarding it", header.name);
+        fs::remove_file(&partial)?;
+    }
+
+    let delivered = children.finish().await + verified as u32;
+    buffers::report();
+    socket.write_u32(delivered).await
 }
@@ -0,0 +1,299 @@
+use crate::catalog::Catalog;
+use std::collections::{HashMap, VecDeque};
+use std::fs;
+use std::io;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+use xxhash_rust::xxh3::xxh3_128;
+
+pub const CHUNK_SIZE: usize = 128 * 1024;
+pub const DEFAULT_CACHE_CAPACITY: usize = 256 * 1024 * 1024;
+
+const CHUNK_RAW: u8 = 0;
+const CHUNK_ZSTD: u8 = 1;
+
+const MIN_LEVEL: i32 = 1;
+const MAX_LEVEL: i32 = 12;
+const DEFAULT_LEVEL: i32 = 3;
+
+// Not worth the decompression cost unless it saves at least 1/16th.
+pub fn worth_compressing(raw_len: usize, compressed_len: usize) -> bool {
+    compressed_len < raw_len - raw_len / 16
+}
+
+type CachedChunk = Option<Arc<Vec<u8>>>;
+
+// What an entry costs the cache beyond its data: the key, the map slot and
+// the queue slot. Chunks that did not compress cost only this, so the byte
+// budget evicts them too.
+const ENTRY_OVERHEAD: usize = 64;
+
+fn cost(chunk: &CachedChunk) -> usize {
+    ENTRY_OVERHEAD + chunk.as_ref().map_or(0, |data| data.len())
+}
+
+// Compressed chunks keyed by the hash of their raw content, shared by every
+// connection of a server. Chunks that did not compress are cached as `None`
+// so they are skipped without being retried. Misses fall back to the chunks
+// precompressed in the share index, if any.
+pub struct ChunkCache {
+    inner: Mutex<CacheInner>,
+    catalog: Option<Arc<Catalog>>,
+}
+
+struct CacheInner {
+    entries: HashMap<u128, CachedChunk>,
+    order: VecDeque<u128>,
+    bytes: usize,
+    capacity: usize,
+}
+
+impl ChunkCache {
+    pub fn new(capacity: usize, catalog: Option<Arc<Catalog>>) -> Self {
+        ChunkCache {
+            catalog,
+            inner: Mutex::new(CacheInner {
+                entries: HashMap::new(),
+                order: VecDeque::new(),
+                bytes: 0,
+                capacity,
+            }),
+        }
+    }
+
+    fn get(&self, key: u128) -> Option<CachedChunk> {
+        if let Some(hit) = self.inner.lock().unwrap().entries.get(&key) {
+            return Some(hit.clone());
+        }
+        let packed = Arc::new(self.catalog.as_ref()?.precompressed(key)?);
+        self.insert(key, Some(packed.clone()));
+        Some(Some(packed))
+    }
+
+    fn insert(&self, key: u128, chunk: CachedChunk) {
+        let mut inner = self.inner.lock().unwrap();
+        let size = cost(&chunk);
+        if inner.entries.insert(key, chunk).is_some() {
+            return;
+        }
+        inner.order.push_back(key);
+        inner.bytes += size;
+        while inner.bytes > inner.capacity {
+            let Some(oldest) = inner.order.pop_front() else {
+                break;
+            };
+            if let Some(evicted) = inner.entries.remove(&oldest) {
+                inner.bytes -= cost(&evicted);
+            }
+        }
+    }
+}
+
+// Chunks per adaptation window. Each window ends with a flush, so its
+// wall time includes waiting for the socket to take the bytes, not just
+// copying them into the write buffer.
+const ADAPT_WINDOW: usize = 8;
+
+struct Compression {
+    ctx: zstd::bulk::Compressor<'static>,
+    level: i32,
+    cache: Arc<ChunkCache>,
+    // The current window: when it began, chunks sent and time spent
+    // compressing them.
+    window_start: Instant,
+    window_chunks: usize,
+    window_compress: Duration,
+}
+
+impl Compression {
+    // Lower the level when compressing a window took longer than sending it,
+    // raise it when the link is the bottleneck and the CPU has spare cycles.
+    fn adapt(&mut self, compress: Duration, send: Duration) -> io::Result<()> {
+        let next = if compress > send {
+            self.level - 1
+        } else if compress * 2 < send && cpu_headroom() {
+            self.level + 1
+        } else {
+            self.level
+        }
+        .clamp(MIN_LEVEL, MAX_LEVEL);
+
+        if next != self.level {
+            self.ctx.set_compression_level(next)?;
+            self.level = next;
+        }
+        Ok(())
+    }
+}
+
+fn cpu_headroom() -> bool {
+    let cores = std::thread::available_parallelism().map_or(1, |n| n.get()) as f64;
+    fs::read_to_string("/proc/loadavg")
+        .ok()
+        .and_then(|loadavg| loadavg.split_whitespace().next()?.parse::<f64>().ok())
+        .map_or(true, |load| load < cores)
+}
+
+pub struct Encoder {
+    compression: Option<Compression>,
+    raw_bytes: u64,
+    wire_bytes: u64,
+}
+
+impl Encoder {
+    pub fn plain() -> Self {
+        Encoder {
+            compression: None,
+            raw_bytes: 0,
+            wire_bytes: 0,
+        }
+    }
+
+    pub fn zstd(cache: Arc<ChunkCache>) -> io::Result<Self> {
+        Ok(Encoder {
+            compression: Some(Compression {
+                ctx: zstd::bulk::Compressor::new(DEFAULT_LEVEL)?,
+                level: DEFAULT_LEVEL,
+                cache,
+                window_start: Instant::now(),
+                window_chunks: 0,
+                window_compress: Duration::ZERO,
+            }),
+            raw_bytes: 0,
+            wire_bytes: 0,
+        })
+    }
+
+    pub fn is_compressed(&self) -> bool {
+        self.compression.is_some()
+    }
+
+    pub fn stats(&self) -> (u64, u64) {
+        (self.raw_bytes, self.wire_bytes)
+    }
+
+    pub async fn write_payload<W: AsyncWrite + Unpin>(
+        &mut self,
+        writer: &mut W,
+        data: &[u8],
+    ) -> io::Result<()> {
+        self.raw_bytes += data.len() as u64;
+        let Some(compression) = &mut self.compression else {
+            self.wire_bytes += data.len() as u64;
+            return writer.write_all(data).await;
+        };
+
+        for chunk in data.chunks(CHUNK_SIZE) {
+            if compression.window_chunks == 0 {
+                compression.window_start = Instant::now();
+            }
+            let key = xxh3_128(chunk);
+            let (compressed, compress_time) = match compression.cache.get(key) {
+                Some(cached) => (cached, None),
+                None => {
+                    let start = Instant::now();
+                    let out = compression.ctx.compress(chunk)?;
+                    let cached = worth_compressing(chunk.len(), out.len()).then(|| Arc::new(out));
+                    compression.cache.insert(key, cached.clone());
+                    (cached, Some(start.elapsed()))
+                }
+            };
+
+            let (kind, payload) = match &compressed {
+                Some(out) => (CHUNK_ZSTD, out.as_slice()),
+                None => (CHUNK_RAW, chunk),
+            };
+            let mut header = [0u8; 9];
+            header[0] = kind;
+            header[1..5].copy_from_slice(&(payload.len() as u32).to_be_bytes());
+            header[5..].copy_from_slice(&(chunk.len() as u32).to_be_bytes());
+
+            writer.write_all(&header).await?;
+            writer.write_all(payload).await?;
+            self.wire_bytes += (header.len() + payload.len()) as u64;
+
+            compression.window_chunks += 1;
+            compression.window_compress += compress_time.unwrap_or_default();
+            if compression.window_chunks == ADAPT_WINDOW {
+                writer.flush().await?;
+                let compress = compression.window_compress;
+                let send = compression.window_start.elapsed().saturating_sub(compress);
+                compression.window_chunks = 0;
+                compression.window_compress = Duration::ZERO;
+                // A window served from the cache says nothing about the level.
+                if !compress.is_zero() {
+                    compression.adapt(compress, send)?;
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+pub struct Decoder {
+    decompressor: Option<zstd::bulk::Decompressor<'static>>,
+    scratch: Vec<u8>,
+}
+
+impl Decoder {
+    pub fn plain() -> Self {
+        Decoder {
+            decompressor: None,
+            scratch: Vec::new(),
+        }
+    }
+
+    pub fn zstd() -> io::Result<Self> {
+        Ok(Decoder {
+            decompressor: Some(zstd::bulk::Decompressor::new()?),
+            scratch: Vec::new(),
+        })
+    }
+
+    pub async fn read_payload<R: AsyncRead + Unpin>(
+        &mut self,
+        reader: &mut R,
+        out: &mut [u8],
+    ) -> io::Result<()> {
+        let Some(decompressor) = &mut self.decompressor else {
+            reader.read_exact(out).await?;
+            return Ok(());
+        };
+
+        let mut filled = 0;
+        while filled < out.len() {
+            let kind = reader.read_u8().await?;
+            let stored = reader.read_u32().await? as usize;
+            let raw = reader.read_u32().await? as usize;
+            if raw == 0 || raw > CHUNK_SIZE || stored > raw || filled + raw > out.len() {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "bad chunk header",
+                ));
+            }
+
+            let target = &mut out[filled..filled + raw];
+            match kind {
+                CHUNK_RAW if stored == raw => {
+                    reader.read_exact(target).await?;
+                }
+                CHUNK_ZSTD => {
+                    self.scratch.resize(stored, 0);
+                    reader.read_exact(&mut self.scratch).await?;
+                    if decompressor.decompress_to_buffer(&self.scratch, target)? != raw {
+                        return Err(io::Error::new(
+                            io::ErrorKind::InvalidData,
+                            "chunk decompressed to the wrong size",
+                        ));
+                    }
+                }
+                _ => {
+                    return Err(io::Error::new(io::ErrorKind::InvalidData, "bad chunk kind"));
+                }
+            }
+            filled += raw;
+        }
+        Ok(())
+    }
+}
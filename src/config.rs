@@ -0,0 +1,189 @@
+use crate::index::IndexOptions;
+use crate::sockopt::SocketOptions;
+use crate::transport::{self, Kind, Transport};
+use crate::udp::Impairment;
+use std::num::{NonZeroU32, NonZeroUsize};
+use std::path::PathBuf;
+use std::sync::Arc;
+use std::time::Duration;
+
+// Tuning for the tokio runtime built in main.rs; None keeps tokio's default.
+// The builder panics on zero counts, so those are rejected when parsing.
+#[derive(Clone, Copy, Default)]
+pub struct RuntimeOptions {
+    pub worker_threads: Option<usize>,
+    pub blocking_threads: Option<usize>,
+    // Scheduler ticks between polls of the I/O driver and timers.
+    pub event_interval: Option<u32>,
+    // Scheduler ticks between checks of the global task queue.
+    pub global_queue_interval: Option<u32>,
+    pub stack_size: Option<usize>,
+}
+
+#[derive(Clone)]
+pub struct Config {
+    pub compress: bool,
+    pub share: PathBuf,
+    pub precompress: bool,
+    pub watch: bool,
+    pub index_threads: usize,
+    pub index_io: usize,
+    pub listen: String,
+    pub connect: String,
+    pub peers: Vec<String>,
+    pub fanout: usize,
+    pub sources: Vec<String>,
+    pub store: Option<PathBuf>,
+    pub dir: Option<String>,
+    pub mirror: bool,
+    pub erasure: (usize, usize),
+    pub root: Option<u128>,
+    pub transport: Kind,
+    pub impairment: Impairment,
+    pub background: bool,
+    pub stripes: usize,
+    pub socket: SocketOptions,
+    pub listeners: usize,
+    pub per_core: bool,
+    pub connections: usize,
+    pub runtime: RuntimeOptions,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Config {
+            compress: true,
+            share: PathBuf::from("."),
+            precompress: false,
+            watch: false,
+            index_threads: std::thread::available_parallelism().map_or(1, |n| n.get()),
+            index_io: 4,
+            listen: "127.0.0.1:8080".to_string(),
+            connect: "127.0.0.1:8080".to_string(),
+            peers: Vec::new(),
+            fanout: 4,
+            sources: Vec::new(),
+            store: None,
+            dir: None,
+            mirror: false,
+            erasure: (4, 2),
+            root: None,
+            transport: Kind::Tcp,
+            impairment: Impairment::default(),
+            background: false,
+            stripes: 1,
+            socket: SocketOptions::default(),
+            listeners: 1,
+            per_core: false,
+            connections: 0,
+            runtime: RuntimeOptions::default(),
+        }
+    }
+}
+
+impl Config {
+    pub fn index_options(&self) -> IndexOptions {
+        IndexOptions {
+            precompress: self.precompress,
+            threads: self.index_threads,
+            io_limit: self.index_io,
+        }
+    }
+
+    pub fn transport(&self) -> Arc<dyn Transport> {
+        transport::new(self)
+    }
+
+    pub fn from_args(args: &[String]) -> Result<Config, String> {
+        let mut config = Config::default();
+        let mut args = args.iter();
+        while let Some(arg) = args.next() {
+            let mut value = || {
+                args.next()
+                    .ok_or_else(|| format!("Missing value for {}", arg))
+            };
+            match arg.as_str() {
+                "--no-compress" => config.compress = false,
+                "--share" => config.share = PathBuf::from(value()?),
+                "--precompress" => config.precompress = true,
+                "--watch" => config.watch = true,
+                "--index-threads" => config.index_threads = parse(arg, value()?)?,
+                "--index-io" => config.index_io = parse(arg, value()?)?,
+                "--listen" => config.listen = value()?.clone(),
+                "--connect" => config.connect = value()?.clone(),
+                "--peers" => config.peers = list(value()?),
+                "--sources" => config.sources = list(value()?),
+                "--store" => config.store = Some(PathBuf::from(value()?)),
+                "--dir" => config.dir = Some(value()?.clone()),
+                "--mirror" => config.mirror = true,
+                "--erasure" => {
+                    let value = value()?;
+                    let (data, parity) = value
+                        .split_once('+')
+                        .ok_or_else(|| format!("Invalid value for {}: {}", arg, value))?;
+                    config.erasure = (parse(arg, data)?, parse(arg, parity)?);
+                }
+                "--root" => {
+                    let value = value()?;
+                    let root = u128::from_str_radix(value, 16)
+                        .map_err(|_| format!("Invalid value for {}: {}", arg, value))?;
+                    config.root = Some(root);
+                }
+                "--fanout" => config.fanout = parse(arg, value()?)?,
+                "--nagle" => config.socket.nodelay = false,
+                "--sndbuf" => config.socket.send_buffer = Some(parse(arg, value()?)?),
+                "--rcvbuf" => config.socket.recv_buffer = Some(parse(arg, value()?)?),
+                "--keepalive" => {
+                    let secs: u64 = parse(arg, value()?)?;
+                    config.socket.keepalive = (secs > 0).then(|| Duration::from_secs(secs));
+                }
+                "--busy-poll" => {
+                    config.socket.busy_poll = Some(Duration::from_micros(parse(arg, value()?)?))
+                }
+                "--cork" => config.socket.cork = true,
+                "--listeners" => config.listeners = parse(arg, value()?)?,
+                "--per-core" => config.per_core = true,
+                "--connections" => config.connections = parse(arg, value()?)?,
+                "--worker-threads" => {
+                    config.runtime.worker_threads =
+                        Some(parse::<NonZeroUsize>(arg, value()?)?.get())
+                }
+                "--blocking-threads" => {
+                    config.runtime.blocking_threads =
+                        Some(parse::<NonZeroUsize>(arg, value()?)?.get())
+                }
+                "--event-interval" => {
+                    config.runtime.event_interval = Some(parse::<NonZeroU32>(arg, value()?)?.get())
+                }
+                "--global-queue-interval" => {
+                    config.runtime.global_queue_interval =
+                        Some(parse::<NonZeroU32>(arg, value()?)?.get())
+                }
+                "--stack-size" => config.runtime.stack_size = Some(parse(arg, value()?)?),
+                "--stripes" => config.stripes = parse(arg, value()?)?,
+                "--background" => config.background = true,
+                "--transport" => config.transport = parse(arg, value()?)?,
+                "--impair-loss" => config.impairment.loss_percent = parse(arg, value()?)?,
+                "--impair-delay" => {
+                    config.impairment.delay = Duration::from_millis(parse(arg, value()?)?)
+                }
+                _ => return Err(format!("Unknown option: {}", arg)),
+            }
+        }
+        Ok(config)
+    }
+}
+
+fn parse<T: std::str::FromStr>(option: &str, value: &str) -> Result<T, String> {
+    value
+        .parse()
+        .map_err(|_| format!("Invalid value for {}: {}", option, value))
+}
+
+fn list(value: &str) -> Vec<String> {
+    value
+        .split(',')
+        .filter(|item| !item.is_empty())
+        .map(str::to_string)
+        .collect()
+}
@@ -0,0 +1,509 @@
+use crate::buffers::{Buffer, MAX_BUFFER};
+use crate::compress::{Decoder, Encoder};
+use std::io;
+use std::ops::Range;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+use xxhash_rust::xxh3::xxh3_128;
+
+pub const MIN_BLOCK_SIZE: u32 = 1024;
+pub const MAX_BLOCK_SIZE: u32 = 128 * 1024;
+
+// A signature on the wire: weak checksum then strong hash.
+const SIGNATURE_LEN: usize = 20;
+// Signatures read at a time.
+const SIGNATURE_BATCH: usize = 4096;
+
+const OP_END: u8 = 0;
+const OP_COPY: u8 = 1;
+const OP_LITERAL: u8 = 2;
+
+// Width of the lanes used by `weak_checksum`; the inner loop over one lane
+// has constant weights so it lowers to packed multiply-adds.
+const LANES: usize = 32;
+
+#[derive(Clone, Copy, Debug)]
+pub struct Signature {
+    pub weak: u32,
+    pub strong: u128,
+}
+
+#[derive(Debug, PartialEq)]
+pub enum Op {
+    Copy { block: u32, count: u32 },
+    Literal(Range<usize>),
+}
+
+// rsync's heuristic: blocks of roughly sqrt(len) bytes, so the signature
+// list and the expected literal overhead grow at the same rate.
+pub fn block_size_for(len: u64) -> u32 {
+    let size = ((len as f64).sqrt() as u32) & !7;
+    size.clamp(MIN_BLOCK_SIZE, MAX_BLOCK_SIZE)
+}
+
+pub fn weak_checksum(block: &[u8]) -> u32 {
+    let n = block.len() as u32;
+    let (mut a, mut b) = (0u32, 0u32);
+
+    let mut chunks = block.chunks_exact(LANES);
+    let mut offset = 0u32;
+    for chunk in &mut chunks {
+        let (mut sa, mut sb) = (0u32, 0u32);
+        for (j, &x) in chunk.iter().enumerate() {
+            sa += x as u32;
+            sb += (LANES - j) as u32 * x as u32;
+        }
+        a = a.wrapping_add(sa);
+        b = b
+            .wrapping_add(n.wrapping_sub(offset + LANES as u32).wrapping_mul(sa))
+            .wrapping_add(sb);
+        offset += LANES as u32;
+    }
+    for (j, &x) in chunks.remainder().iter().enumerate() {
+        a = a.wrapping_add(x as u32);
+        b = b.wrapping_add((n - offset - j as u32).wrapping_mul(x as u32));
+    }
+
+    (a & 0xffff) | (b << 16)
+}
+
+pub fn strong_checksum(block: &[u8]) -> u128 {
+    xxh3_128(block)
+}
+
+pub fn signatures(basis: &[u8], block_size: u32) -> Vec<Signature> {
+    basis
+        .chunks_exact(block_size as usize)
+        .map(|block| Signature {
+            weak: weak_checksum(block),
+            strong: strong_checksum(block),
+        })
+        .collect()
+}
+
+struct Rolling {
+    a: u32,
+    b: u32,
+    len: u32,
+}
+
+impl Rolling {
+    fn new(window: &[u8]) -> Self {
+        let sum = weak_checksum(window);
+        Rolling {
+            a: sum & 0xffff,
+            b: sum >> 16,
+            len: window.len() as u32,
+        }
+    }
+
+    fn roll(&mut self, out: u8, input: u8) {
+        self.a = self.a.wrapping_sub(out as u32).wrapping_add(input as u32);
+        self.b = self
+            .b
+            .wrapping_sub(self.len.wrapping_mul(out as u32))
+            .wrapping_add(self.a);
+    }
+
+    fn digest(&self) -> u32 {
+        (self.a & 0xffff) | (self.b << 16)
+    }
+}
+
+// Signatures sorted by weak checksum, with a 64 Kbit presence filter on the
+// low half of the checksum so most rolling positions are rejected with a
+// single bit test instead of a search.
+struct SignatureTable {
+    filter: Vec<u64>,
+    sorted: Vec<(u32, u32)>,
+    strong: Vec<u128>,
+}
+
+impl SignatureTable {
+    fn new(signatures: &[Signature]) -> Self {
+        let mut filter = vec![0u64; 1 << 10];
+        let mut sorted = Vec::with_capacity(signatures.len());
+        for (index, sig) in signatures.iter().enumerate() {
+            let bit = (sig.weak & 0xffff) as usize;
+            filter[bit >> 6] |= 1 << (bit & 63);
+            sorted.push((sig.weak, index as u32));
+        }
+        sorted.sort_unstable();
+        SignatureTable {
+            filter,
+            sorted,
+            strong: signatures.iter().map(|sig| sig.strong).collect(),
+        }
+    }
+
+    fn lookup(&self, weak: u32, window: &[u8], preferred: u32) -> Option<u32> {
+        let bit = (weak & 0xffff) as usize;
+        if self.filter[bit >> 6] & (1 << (bit & 63)) == 0 {
+            return None;
+        }
+        let start = self.sorted.partition_point(|&(w, _)| w < weak);
+        let candidates = self.sorted[start..]
+            .iter()
+            .take_while(|&&(w, _)| w == weak)
+            .map(|&(_, index)| index);
+        let mut strong = None;
+        let mut found = None;
+        for index in candidates {
+            let digest = *strong.get_or_insert_with(|| strong_checksum(window));
+            if self.strong[index as usize] == digest {
+                // Keep runs of consecutive blocks together so they coalesce
+                // into a single copy instruction.
+                if index == preferred {
+                    return Some(index);
+                }
+                found.get_or_insert(index);
+            }
+        }
+        found
+    }
+}
+
+pub fn delta(data: &[u8], block_size: u32, signatures: &[Signature]) -> Vec<Op> {
+    let bs = block_size as usize;
+    let mut ops = Vec::new();
+    if signatures.is_empty() || data.len() < bs {
+        if !data.is_empty() {
+            ops.push(Op::Literal(0..data.len()));
+        }
+        return ops;
+    }
+
+    let table = SignatureTable::new(signatures);
+    let mut literal_start = 0;
+    let mut pos = 0;
+    let mut rolling = Rolling::new(&data[..bs]);
+    let mut next_block = u32::MAX;
+
+    while pos + bs <= data.len() {
+        let window = &data[pos..pos + bs];
+        if let Some(block) = table.lookup(rolling.digest(), window, next_block) {
+            if literal_start < pos {
+                ops.push(Op::Literal(literal_start..pos));
+            }
+            match ops.last_mut() {
+                Some(Op::Copy {
+                    block: first,
+                    count,
+                }) if *first + *count == block => *count += 1,
+                _ => ops.push(Op::Copy { block, count: 1 }),
+            }
+            next_block = block + 1;
+            pos += bs;
+            literal_start = pos;
+            if pos + bs <= data.len() {
+                rolling = Rolling::new(&data[pos..pos + bs]);
+            }
+            continue;
+        }
+
+        if pos + bs == data.len() {
+            break;
+        }
+        rolling.roll(data[pos], data[pos + bs]);
+        pos += 1;
+    }
+
+    if literal_start < data.len() {
+        ops.push(Op::Literal(literal_start..data.len()));
+    }
+    ops
+}
+
+pub async fn write_signatures<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    block_size: u32,
+    signatures: &[Signature],
+) -> io::Result<()> {
+    let mut buf = Vec::with_capacity(8 + signatures.len() * SIGNATURE_LEN);
+    buf.extend_from_slice(&block_size.to_be_bytes());
+    buf.extend_from_slice(&(signatures.len() as u32).to_be_bytes());
+    for sig in signatures {
+        buf.extend_from_slice(&sig.weak.to_be_bytes());
+        buf.extend_from_slice(&sig.strong.to_be_bytes());
+    }
+    writer.write_all(&buf).await
+}
+
+pub async fn read_signatures<R: AsyncRead + Unpin>(
+    reader: &mut R,
+) -> io::Result<(u32, Vec<Signature>)> {
+    let block_size = reader.read_u32().await?;
+    let count = reader.read_u32().await? as usize;
+    if block_size != 0 && !(MIN_BLOCK_SIZE..=MAX_BLOCK_SIZE).contains(&block_size) {
+        return Err(io::Error::new(io::ErrorKind::InvalidData, "bad block size"));
+    }
+
+    if block_size == 0 && count != 0 {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "signatures without a block size",
+        ));
+    }
+
+    // Read a bounded batch at a time, so a bogus count costs the peer the
+    // bytes it claims rather than an allocation of the whole list up front.
+    let mut signatures = Vec::with_capacity(count.min(SIGNATURE_BATCH));
+    let mut raw = vec![0; count.min(SIGNATURE_BATCH) * SIGNATURE_LEN];
+    while signatures.len() < count {
+        let batch = (count - signatures.len()).min(SIGNATURE_BATCH);
+        let raw = &mut raw[..batch * SIGNATURE_LEN];
+        reader.read_exact(raw).await?;
+        signatures.extend(raw.chunks_exact(SIGNATURE_LEN).map(|entry| Signature {
+            weak: u32::from_be_bytes(entry[..4].try_into().unwrap()),
+            strong: u128::from_be_bytes(entry[4..].try_into().unwrap()),
+        }));
+    }
+    Ok((block_size, signatures))
+}
+
+pub async fn write_delta<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    data: &[u8],
+    ops: &[Op],
+    encoder: &mut Encoder,
+) -> io::Result<()> {
+    for op in ops {
+        match op {
+            Op::Copy { block, count } => {
+                writer.write_u8(OP_COPY).await?;
+                writer.write_u32(*block).await?;
+                writer.write_u32(*count).await?;
+            }
+            Op::Literal(range) => {
+                writer.write_u8(OP_LITERAL).await?;
+                writer.write_u32(range.len() as u32).await?;
+                encoder.write_payload(writer, &data[range.clone()]).await?;
+            }
+        }
+    }
+    writer.write_u8(OP_END).await
+}
+
+// Applies a delta stream from `reader` on top of `basis`, handing the
+// reconstructed file to `write` in order: copied runs straight from the
+// basis, literals a pooled buffer at a time. Literals are split at a
+// multiple of the compression chunk, so each part decodes as a payload.
+pub async fn apply_delta<R: AsyncRead + Unpin>(
+    reader: &mut R,
+    basis: &[u8],
+    block_size: u32,
+    expected_len: u64,
+    decoder: &mut Decoder,
+    mut write: impl FnMut(&[u8]) -> io::Result<()>,
+) -> io::Result<()> {
+    let bs = block_size as usize;
+    // The size comes from the peer, so no instruction may write past it.
+    let mut written = 0u64;
+    let mut claim = |len: usize| {
+        written += len as u64;
+        if written > expected_len {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "delta writes past the end of the file",
+            ));
+        }
+        Ok(())
+    };
+    loop {
+        match reader.read_u8().await? {
+            OP_END => break,
+            OP_COPY => {
+                let block = reader.read_u32().await? as usize;
+                let count = reader.read_u32().await? as usize;
+                let range = block * bs..(block + count) * bs;
+                let Some(source) = basis.get(range) else {
+                    return Err(io::Error::new(
+                        io::ErrorKind::InvalidData,
+                        "copy instruction outside of basis file",
+                    ));
+                };
+                claim(source.len())?;
+                write(source)?;
+            }
+            OP_LITERAL => {
+                let mut left = reader.read_u32().await? as usize;
+                claim(left)?;
+                while left > 0 {
+                    let mut chunk = Buffer::take(left.min(MAX_BUFFER));
+                    decoder.read_payload(reader, &mut chunk).await?;
+                    write(&chunk)?;
+                    left -= chunk.len();
+                }
+            }
+            op => {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    format!("unknown delta instruction {}", op),
+                ))
+            }
+        }
+    }
+
+    if written != expected_len {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "reconstructed file has the wrong size",
+        ));
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::compress::ChunkCache;
+    use std::sync::Arc;
+
+    // Pseudo-random bytes, so blocks only match where they were copied.
+    fn noise(len: usize, seed: u64) -> Vec<u8> {
+        let mut state = seed;
+        (0..len)
+            .map(|_| {
+                state = state
+                    .wrapping_mul(6364136223846793005)
+                    .wrapping_add(1442695040888963407);
+                (state >> 56) as u8
+            })
+            .collect()
+    }
+
+    async fn round_trip(basis: &[u8], data: &[u8], mut encoder: Encoder, mut decoder: Decoder) {
+        let block_size = block_size_for(basis.len() as u64);
+        let mut wire = Vec::new();
+        write_signatures(&mut wire, block_size, &signatures(basis, block_size))
+            .await
+            .unwrap();
+        let (block_size, signatures) = read_signatures(&mut wire.as_slice()).await.unwrap();
+
+        let ops = delta(data, block_size, &signatures);
+        let mut wire = Vec::new();
+        write_delta(&mut wire, data, &ops, &mut encoder)
+            .await
+            .unwrap();
+        let mut rebuilt = Vec::new();
+        apply_delta(
+            &mut wire.as_slice(),
+            basis,
+            block_size,
+            data.len() as u64,
+            &mut decoder,
+            |part| {
+                rebuilt.extend_from_slice(part);
+                Ok(())
+            },
+        )
+        .await
+        .unwrap();
+        assert!(rebuilt == data);
+    }
+
+    #[tokio::test]
+    async fn edited_file_round_trips() {
+        let basis = noise(300_000, 1);
+        let mut data = basis.clone();
+        data[5_000] ^= 1;
+        data.splice(90_000..90_000, noise(777, 2));
+        data.drain(200_000..201_234);
+        data.extend(noise(3_000, 3));
+
+        let ops = delta(
+            &data,
+            block_size_for(basis.len() as u64),
+            &signatures(&basis, block_size_for(basis.len() as u64)),
+        );
+        assert!(ops.iter().any(|op| matches!(op, Op::Copy { .. })));
+        let literal: usize = ops
+            .iter()
+            .map(|op| match op {
+                Op::Literal(range) => range.len(),
+                Op::Copy { .. } => 0,
+            })
+            .sum();
+        assert!(literal < data.len() / 10);
+
+        round_trip(&basis, &data, Encoder::plain(), Decoder::plain()).await;
+        let cache = Arc::new(ChunkCache::new(1 << 20, None));
+        round_trip(
+            &basis,
+            &data,
+            Encoder::zstd(cache).unwrap(),
+            Decoder::zstd().unwrap(),
+        )
+        .await;
+    }
+
+    #[tokio::test]
+    async fn unrelated_and_empty_files_round_trip() {
+        round_trip(
+            &noise(50_000, 4),
+            &noise(60_000, 5),
+            Encoder::plain(),
+            Decoder::plain(),
+        )
+        .await;
+        round_trip(&noise(50_000, 6), &[], Encoder::plain(), Decoder::plain()).await;
+        round_trip(&[], &noise(10_000, 7), Encoder::plain(), Decoder::plain()).await;
+    }
+
+    #[tokio::test]
+    async fn signature_count_is_not_trusted() {
+        // Claims four billion signatures and sends one.
+        let mut wire = Vec::new();
+        wire.extend_from_slice(&MIN_BLOCK_SIZE.to_be_bytes());
+        wire.extend_from_slice(&u32::MAX.to_be_bytes());
+        wire.extend_from_slice(&[0; SIGNATURE_LEN]);
+        let err = read_signatures(&mut wire.as_slice()).await.unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::UnexpectedEof);
+
+        let mut wire = Vec::new();
+        wire.extend_from_slice(&0u32.to_be_bytes());
+        wire.extend_from_slice(&1u32.to_be_bytes());
+        let err = read_signatures(&mut wire.as_slice()).await.unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+    }
+
+    #[tokio::test]
+    async fn delta_sizes_are_not_trusted() {
+        let basis = noise(4 * MIN_BLOCK_SIZE as usize, 8);
+        let apply = |wire: Vec<u8>, expected_len: u64| {
+            let basis = basis.clone();
+            async move {
+                apply_delta(
+                    &mut wire.as_slice(),
+                    &basis,
+                    MIN_BLOCK_SIZE,
+                    expected_len,
+                    &mut Decoder::plain(),
+                    |_| Ok(()),
+                )
+                .await
+                .unwrap_err()
+                .kind()
+            }
+        };
+
+        // A size no file could have, then a stream that ends early.
+        assert_eq!(
+            apply(vec![OP_END], u64::MAX).await,
+            io::ErrorKind::InvalidData
+        );
+        // A literal far longer than the announced file.
+        let mut wire = vec![OP_LITERAL];
+        wire.extend_from_slice(&u32::MAX.to_be_bytes());
+        assert_eq!(apply(wire, 100).await, io::ErrorKind::InvalidData);
+        // Copies that add up past it.
+        let mut wire = Vec::new();
+        for _ in 0..2 {
+            wire.push(OP_COPY);
+            wire.extend_from_slice(&0u32.to_be_bytes());
+            wire.extend_from_slice(&3u32.to_be_bytes());
+        }
+        wire.push(OP_END);
+        let len = 5 * MIN_BLOCK_SIZE as u64;
+        assert_eq!(apply(wire, len).await, io::ErrorKind::InvalidData);
+    }
+}
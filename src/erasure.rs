@@ -0,0 +1,482 @@
+use crate::buffers::Buffer;
+use std::fs::File;
+use std::io;
+use std::os::unix::fs::FileExt;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+// Systematic Reed-Solomon over GF(2^8) with the polynomial 0x11d. Shards
+// 0..data are the file bytes themselves; parity shard i is row i of a
+// Cauchy matrix applied to them, so any `data` shards are enough to
+// rebuild the rest.
+
+const fn gf_tables() -> ([u8; 512], [u8; 256]) {
+    let mut exp = [0u8; 512];
+    let mut log = [0u8; 256];
+    let mut x: u16 = 1;
+    let mut i = 0;
+    while i < 255 {
+        exp[i] = x as u8;
+        exp[i + 255] = x as u8;
+        log[x as usize] = i as u8;
+        x <<= 1;
+        if x & 0x100 != 0 {
+            x ^= 0x11d;
+        }
+        i += 1;
+    }
+    (exp, log)
+}
+
+const TABLES: ([u8; 512], [u8; 256]) = gf_tables();
+const EXP: [u8; 512] = TABLES.0;
+const LOG: [u8; 256] = TABLES.1;
+
+fn mul(a: u8, b: u8) -> u8 {
+    if a == 0 || b == 0 {
+        return 0;
+    }
+    EXP[LOG[a as usize] as usize + LOG[b as usize] as usize]
+}
+
+fn inv(a: u8) -> u8 {
+    EXP[255 - LOG[a as usize] as usize]
+}
+
+// dst ^= coef * src, the only kernel encoding and decoding need.
+fn mul_add(coef: u8, src: &[u8], dst: &mut [u8]) {
+    if coef == 0 {
+        return;
+    }
+    // Products of every low and every high nibble; a byte's product is the
+    // XOR of the two lookups, which PSHUFB does 16 or 32 lanes at a time.
+    let mut low = [0u8; 16];
+    let mut high = [0u8; 16];
+    for x in 0..16u8 {
+        low[x as usize] = mul(coef, x);
+        high[x as usize] = mul(coef, x << 4);
+    }
+
+    let mut done = 0;
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("avx2") {
+            done = unsafe { simd::mul_add_avx2(&low, &high, src, dst) };
+        } else if is_x86_feature_detected!("ssse3") {
+            done = unsafe { simd::mul_add_ssse3(&low, &high, src, dst) };
+        }
+    }
+    for (d, &s) in dst[done..].iter_mut().zip(&src[done..]) {
+        *d ^= low[(s & 0x0f) as usize] ^ high[(s >> 4) as usize];
+    }
+}
+
+#[cfg(target_arch = "x86_64")]
+mod simd {
+    use std::arch::x86_64::*;
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn mul_add_avx2(
+        low: &[u8; 16],
+        high: &[u8; 16],
+        src: &[u8],
+        dst: &mut [u8],
+    ) -> usize {
+        let low = _mm256_broadcastsi128_si256(_mm_loadu_si128(low.as_ptr().cast()));
+        let high = _mm256_broadcastsi128_si256(_mm_loadu_si128(high.as_ptr().cast()));
+        let mask = _mm256_set1_epi8(0x0f);
+        let len = src.len().min(dst.len()) / 32 * 32;
+        for i in (0..len).step_by(32) {
+            let s = _mm256_loadu_si256(src.as_ptr().add(i).cast());
+            let lo = _mm256_and_si256(s, mask);
+            let hi = _mm256_and_si256(_mm256_srli_epi64(s, 4), mask);
+            let product =
+                _mm256_xor_si256(_mm256_shuffle_epi8(low, lo), _mm256_shuffle_epi8(high, hi));
+            let d = _mm256_loadu_si256(dst.as_ptr().add(i).cast());
+            _mm256_storeu_si256(dst.as_mut_ptr().add(i).cast(), _mm256_xor_si256(d, product));
+        }
+        len
+    }
+
+    #[target_feature(enable = "ssse3")]
+    pub unsafe fn mul_add_ssse3(
+        low: &[u8; 16],
+        high: &[u8; 16],
+        src: &[u8],
+        dst: &mut [u8],
+    ) -> usize {
+        let low = _mm_loadu_si128(low.as_ptr().cast());
+        let high = _mm_loadu_si128(high.as_ptr().cast());
+        let mask = _mm_set1_epi8(0x0f);
+        let len = src.len().min(dst.len()) / 16 * 16;
+        for i in (0..len).step_by(16) {
+            let s = _mm_loadu_si128(src.as_ptr().add(i).cast());
+            let lo = _mm_and_si128(s, mask);
+            let hi = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+            let product = _mm_xor_si128(_mm_shuffle_epi8(low, lo), _mm_shuffle_epi8(high, hi));
+            let d = _mm_loadu_si128(dst.as_ptr().add(i).cast());
+            _mm_storeu_si128(dst.as_mut_ptr().add(i).cast(), _mm_xor_si128(d, product));
+        }
+        len
+    }
+}
+
+// Inverts a square matrix in place by Gauss-Jordan elimination.
+fn invert(matrix: &mut [u8], n: usize) -> io::Result<()> {
+    let mut inverse = vec![0u8; n * n];
+    for i in 0..n {
+        inverse[i * n + i] = 1;
+    }
+    for col in 0..n {
+        let Some(pivot) = (col..n).find(|&row| matrix[row * n + col] != 0) else {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "singular shard matrix",
+            ));
+        };
+        for k in 0..n {
+            matrix.swap(pivot * n + k, col * n + k);
+            inverse.swap(pivot * n + k, col * n + k);
+        }
+        let scale = inv(matrix[col * n + col]);
+        for k in 0..n {
+            matrix[col * n + k] = mul(matrix[col * n + k], scale);
+            inverse[col * n + k] = mul(inverse[col * n + k], scale);
+        }
+        for row in 0..n {
+            let factor = matrix[row * n + col];
+            if row == col || factor == 0 {
+                continue;
+            }
+            for k in 0..n {
+                matrix[row * n + k] ^= mul(factor, matrix[col * n + k]);
+                inverse[row * n + k] ^= mul(factor, inverse[col * n + k]);
+            }
+        }
+    }
+    matrix.copy_from_slice(&inverse);
+    Ok(())
+}
+
+pub struct Codec {
+    data: usize,
+    parity: usize,
+}
+
+impl Codec {
+    pub fn new(data: usize, parity: usize) -> io::Result<Codec> {
+        if data == 0 || data + parity > 256 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "need 1 to 256 shards with at least one data shard",
+            ));
+        }
+        Ok(Codec { data, parity })
+    }
+
+    pub fn data_shards(&self) -> usize {
+        self.data
+    }
+
+    pub fn total_shards(&self) -> usize {
+        self.data + self.parity
+    }
+
+    // Coefficient of data shard `col` in shard `row` of the generator:
+    // identity on top, Cauchy rows 1 / (x_i + y_j) below. Every square
+    // submatrix of a Cauchy matrix is invertible, which is what makes any
+    // `data` shards sufficient.
+    fn generator(&self, row: usize, col: usize) -> u8 {
+        if row < self.data {
+            return (row == col) as u8;
+        }
+        inv(row as u8 ^ col as u8)
+    }
+
+    // Computes shard `index` of a group from its data shards.
+    pub fn encode_shard(&self, data: &[&[u8]], index: usize, out: &mut [u8]) {
+        if index < self.data {
+            out.copy_from_slice(data[index]);
+            return;
+        }
+        out.fill(0);
+        for (col, shard) in data.iter().enumerate() {
+            mul_add(self.generator(index, col), shard, out);
+        }
+    }
+
+    // Rebuilds every missing data shard from any `data` present shards.
+    pub fn reconstruct(&self, shards: &mut [Option<Buffer>], shard_len: usize) -> io::Result<()> {
+        if shards[..self.data].iter().all(Option::is_some) {
+            return Ok(());
+        }
+        let present: Vec<usize> = (0..shards.len())
+            .filter(|&i| shards[i].is_some())
+            .take(self.data)
+            .collect();
+        if present.len() < self.data {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "not enough shards to rebuild",
+            ));
+        }
+
+        let n = self.data;
+        let mut matrix = vec![0u8; n * n];
+        for (row, &index) in present.iter().enumerate() {
+            for col in 0..n {
+                matrix[row * n + col] = self.generator(index, col);
+            }
+        }
+        invert(&mut matrix, n)?;
+
+        for missing in 0..n {
+            if shards[missing].is_some() {
+                continue;
+            }
+            let mut out = Buffer::take(shard_len);
+            out.fill(0);
+            for (col, &index) in present.iter().enumerate() {
+                mul_add(
+                    matrix[missing * n + col],
+                    shards[index].as_ref().unwrap(),
+                    &mut out,
+                );
+            }
+            shards[missing] = Some(out);
+        }
+        Ok(())
+    }
+}
+
+pub const SHARD_LEN: u32 = 64 * 1024;
+// Most piece groups in one download. The file size comes from the server
+// and the client keeps state for every group, so it is bounded before any
+// of that is allocated: with the default shards, files up to 256 GiB.
+pub const MAX_GROUPS: u64 = 1 << 20;
+
+pub struct ShardRequest {
+    pub data: u8,
+    pub parity: u8,
+    pub shards: Vec<u8>,
+    // Merkle root of the file wanted, or zero for example.txt.
+    pub root: u128,
+}
+
+pub async fn write_request<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    request: &ShardRequest,
+) -> io::Result<()> {
+    let mut buf = vec![request.data, request.parity];
+    buf.extend_from_slice(&(request.shards.len() as u16).to_be_bytes());
+    buf.extend_from_slice(&request.shards);
+    buf.extend_from_slice(&request.root.to_be_bytes());
+    writer.write_all(&buf).await
+}
+
+pub async fn read_request<R: AsyncRead + Unpin>(reader: &mut R) -> io::Result<ShardRequest> {
+    let data = reader.read_u8().await?;
+    let parity = reader.read_u8().await?;
+    let mut shards = vec![0; reader.read_u16().await? as usize];
+    reader.read_exact(&mut shards).await?;
+    if shards
+        .iter()
+        .any(|&index| index as usize >= data as usize + parity as usize)
+    {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "shard index out of range",
+        ));
+    }
+    Ok(ShardRequest {
+        data,
+        parity,
+        shards,
+        root: reader.read_u128().await?,
+    })
+}
+
+// Streams the requested shards of every piece group of the `size` bytes of
+// `file`, group by group, after the shard length. Each group's data shards
+// are read into pooled buffers with positional reads, so only one group is
+// ever held. The last group is zero padded to whole shards.
+pub async fn write_shards<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    codec: &Codec,
+    file: &File,
+    size: u64,
+    shards: &[u8],
+) -> io::Result<()> {
+    let len = SHARD_LEN as usize;
+    let group_len = (len * codec.data_shards()) as u64;
+    let mut data: Vec<Buffer> = (0..codec.data_shards())
+        .map(|_| Buffer::take(len))
+        .collect();
+    let mut out = Buffer::take(len);
+    writer.write_u32(SHARD_LEN).await?;
+    for group in 0..size.div_ceil(group_len) {
+        for (i, shard) in data.iter_mut().enumerate() {
+            let offset = group * group_len + (i * len) as u64;
+            let filled = size.saturating_sub(offset).min(len as u64) as usize;
+            file.read_exact_at(&mut shard[..filled], offset)?;
+            shard[filled..].fill(0);
+        }
+        let data: Vec<&[u8]> = data.iter().map(|shard| &shard[..]).collect();
+        for &index in shards {
+            codec.encode_shard(&data, index as usize, &mut out);
+            writer.write_u32(group as u32).await?;
+            writer.write_u8(index).await?;
+            writer.write_all(&out).await?;
+        }
+    }
+    writer.flush().await
+}
+
+// Reads one (group, shard index, bytes) frame written by write_shards into
+// a pooled buffer, so `shard_len` must be at most MAX_BUFFER.
+pub async fn read_shard<R: AsyncRead + Unpin>(
+    reader: &mut R,
+    shard_len: usize,
+) -> io::Result<(usize, usize, Buffer)> {
+    let group = reader.read_u32().await? as usize;
+    let index = reader.read_u8().await? as usize;
+    let mut bytes = Buffer::take(shard_len);
+    reader.read_exact(&mut bytes).await?;
+    Ok((group, index, bytes))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pooled(bytes: &[u8]) -> Buffer {
+        let mut buffer = Buffer::take(bytes.len());
+        buffer.copy_from_slice(bytes);
+        buffer
+    }
+
+    fn encode(codec: &Codec, data: &[Vec<u8>], shard_len: usize) -> Vec<Vec<u8>> {
+        let data: Vec<&[u8]> = data.iter().map(Vec::as_slice).collect();
+        (0..codec.total_shards())
+            .map(|index| {
+                let mut out = vec![0; shard_len];
+                codec.encode_shard(&data, index, &mut out);
+                out
+            })
+            .collect()
+    }
+
+    // Rebuilds the data from exactly the shards in `keep`.
+    fn rebuild(codec: &Codec, shards: &[Vec<u8>], keep: &[usize], shard_len: usize) {
+        let mut partial: Vec<Option<Buffer>> = shards.iter().map(|_| None).collect();
+        for &index in keep {
+            partial[index] = Some(pooled(&shards[index]));
+        }
+        codec.reconstruct(&mut partial, shard_len).unwrap();
+        for index in 0..codec.data_shards() {
+            assert_eq!(
+                partial[index].as_deref(),
+                Some(&shards[index][..]),
+                "{:?}",
+                keep
+            );
+        }
+    }
+
+    #[test]
+    fn any_k_of_n_rebuild_the_data() {
+        let (data, parity) = (4, 3);
+        let codec = Codec::new(data, parity).unwrap();
+        // Odd length, so the vector kernels leave a scalar tail.
+        let shard_len = 1000 + 7;
+        let originals: Vec<Vec<u8>> = (0..data)
+            .map(|shard| {
+                (0..shard_len)
+                    .map(|i| (i * 31 + shard * 97) as u8)
+                    .collect()
+            })
+            .collect();
+        let shards = encode(&codec, &originals, shard_len);
+
+        let total = codec.total_shards();
+        for mask in 0u32..1 << total {
+            if mask.count_ones() as usize != data {
+                continue;
+            }
+            let keep: Vec<usize> = (0..total).filter(|&i| mask & 1 << i != 0).collect();
+            rebuild(&codec, &shards, &keep, shard_len);
+        }
+    }
+
+    #[test]
+    fn wide_codes_rebuild_from_parity() {
+        let (data, parity) = (20, 12);
+        let codec = Codec::new(data, parity).unwrap();
+        let shard_len = 64;
+        let originals: Vec<Vec<u8>> = (0..data)
+            .map(|shard| (0..shard_len).map(|i| (i ^ shard * 13) as u8).collect())
+            .collect();
+        let shards = encode(&codec, &originals, shard_len);
+
+        // Every parity shard, plus data shards at both ends.
+        let mut keep: Vec<usize> = (data..data + parity).collect();
+        keep.extend((0..4).chain(data - 4..data));
+        rebuild(&codec, &shards, &keep, shard_len);
+        // The last k shards.
+        rebuild(
+            &codec,
+            &shards,
+            &(parity..data + parity).collect::<Vec<_>>(),
+            shard_len,
+        );
+    }
+
+    #[tokio::test]
+    async fn shards_stream_from_a_file() {
+        let path = std::env::temp_dir().join(format!("peernet-shards-{}", std::process::id()));
+        let content: Vec<u8> = (0..3 * SHARD_LEN as usize * 2 + 12345)
+            .map(|i| (i * 7 + i / 1000) as u8)
+            .collect();
+        std::fs::write(&path, &content).unwrap();
+        let file = File::open(&path).unwrap();
+        let codec = Codec::new(3, 2).unwrap();
+        let mut wire = Vec::new();
+        write_shards(&mut wire, &codec, &file, content.len() as u64, &[1, 3, 4])
+            .await
+            .unwrap();
+        std::fs::remove_file(&path).unwrap();
+
+        // Shards 3 and 4 are parity; with shard 1 they rebuild every group.
+        let mut reader = wire.as_slice();
+        let len = reader.read_u32().await.unwrap() as usize;
+        let mut rebuilt = Vec::new();
+        for expected in 0..3 {
+            let mut shards: Vec<Option<Buffer>> = (0..codec.total_shards()).map(|_| None).collect();
+            for _ in 0..3 {
+                let (group, index, bytes) = read_shard(&mut reader, len).await.unwrap();
+                assert_eq!(group, expected);
+                shards[index] = Some(bytes);
+            }
+            codec.reconstruct(&mut shards, len).unwrap();
+            for shard in &shards[..3] {
+                rebuilt.extend_from_slice(shard.as_ref().unwrap());
+            }
+        }
+        assert!(reader.is_empty());
+        assert!(rebuilt[content.len()..].iter().all(|&b| b == 0));
+        rebuilt.truncate(content.len());
+        assert!(rebuilt == content);
+    }
+
+    #[test]
+    fn fewer_than_k_shards_is_an_error() {
+        let codec = Codec::new(3, 2).unwrap();
+        let mut shards = [
+            Some(pooled(&[1; 8])),
+            None,
+            None,
+            Some(pooled(&[2; 8])),
+            None,
+        ];
+        assert!(codec.reconstruct(&mut shards, 8).is_err());
+    }
+}
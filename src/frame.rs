@@ -0,0 +1,97 @@
+use std::io::{self, IoSlice};
+use std::pin::Pin;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::task::{ready, Context, Poll};
+use tokio::io::AsyncWrite;
+
+// Small writes are gathered up to this many bytes before a send.
+const CAPACITY: usize = 64 * 1024;
+
+// Writes handed to sockets by every FrameWriter, and the bytes they carried,
+// for the bench to report writes per MB.
+static WRITE_CALLS: AtomicU64 = AtomicU64::new(0);
+static WRITE_BYTES: AtomicU64 = AtomicU64::new(0);
+
+pub fn write_stats() -> (u64, u64) {
+    (
+        WRITE_CALLS.load(Ordering::Relaxed),
+        WRITE_BYTES.load(Ordering::Relaxed),
+    )
+}
+
+fn count(n: usize) {
+    WRITE_CALLS.fetch_add(1, Ordering::Relaxed);
+    WRITE_BYTES.fetch_add(n as u64, Ordering::Relaxed);
+}
+
+// A write buffer for framed responses. Frame headers and other small writes
+// are gathered, and a payload too big to gather goes out in one writev with
+// everything gathered before it. BufWriter would flush the header on its
+// own first, costing a syscall and often a segment per frame.
+pub struct FrameWriter<W> {
+    inner: W,
+    pending: Vec<u8>,
+}
+
+impl<W: AsyncWrite + Unpin> FrameWriter<W> {
+    pub fn new(inner: W) -> FrameWriter<W> {
+        FrameWriter {
+            inner,
+            pending: Vec::with_capacity(CAPACITY),
+        }
+    }
+
+    fn poll_drain(&mut self, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        while !self.pending.is_empty() {
+            let n = ready!(Pin::new(&mut self.inner).poll_write(cx, &self.pending))?;
+            if n == 0 {
+                return Poll::Ready(Err(io::ErrorKind::WriteZero.into()));
+            }
+            count(n);
+            self.pending.drain(..n);
+        }
+        Poll::Ready(Ok(()))
+    }
+}
+
+impl<W: AsyncWrite + Unpin> AsyncWrite for FrameWriter<W> {
+    fn poll_write(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &[u8],
+    ) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        if this.pending.len() + buf.len() <= CAPACITY {
+            this.pending.extend_from_slice(buf);
+            return Poll::Ready(Ok(buf.len()));
+        }
+        loop {
+            let slices = [IoSlice::new(&this.pending), IoSlice::new(buf)];
+            let n = ready!(Pin::new(&mut this.inner).poll_write_vectored(cx, &slices))?;
+            if n == 0 {
+                return Poll::Ready(Err(io::ErrorKind::WriteZero.into()));
+            }
+            count(n);
+            // Only report progress once some of `buf` went out; a write
+            // that took just gathered bytes goes round again.
+            if n > this.pending.len() {
+                let written = n - this.pending.len();
+                this.pending.clear();
+                return Poll::Ready(Ok(written));
+            }
+            this.pending.drain(..n);
+        }
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        let this = self.get_mut();
+        ready!(this.poll_drain(cx))?;
+        Pin::new(&mut this.inner).poll_flush(cx)
+    }
+
+    fn poll_shutdown(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        let this = self.get_mut();
+        ready!(this.poll_drain(cx))?;
+        Pin::new(&mut this.inner).poll_shutdown(cx)
+    }
+}
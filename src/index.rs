@@ -0,0 +1,970 @@
+use crate::compress::{self, CHUNK_SIZE};
+use crate::mmap::Mmap;
+use crate::pool::{self, Semaphore, Spawner};
+use std::cell::RefCell;
+use std::collections::HashSet;
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, BufWriter, Read, Write};
+use std::ops::Range;
+use std::os::unix::fs::{FileExt, MetadataExt};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::thread;
+use std::time::{Duration, Instant};
+use xxhash_rust::xxh3::xxh3_128;
+
+pub const INDEX_FILE: &str = ".peernet-index";
+pub const PACK_FILE: &str = ".peernet-chunks";
+// Pieces line up with compression chunks, so a piece hash doubles as the
+// key of its precompressed copy.
+pub const PIECE_SIZE: usize = CHUNK_SIZE;
+
+const MAGIC: &[u8; 8] = b"PNIDX\0\0\x01";
+const HEADER_LEN: usize = 64;
+const ENTRY_LEN: usize = 64;
+const HASH_LEN: usize = 16;
+const PACKED_LEN: usize = 32;
+const PRECOMPRESS_LEVEL: i32 = 9;
+// The pack is rewritten with only the pieces files still have once more
+// than half of it is dead, and it is at least this big.
+const MIN_REPACK: u64 = 4 << 20;
+
+// Sidecar layout, all integers little endian:
+//
+//   header    magic, file count, then offset/length pairs for the string
+//             table, the piece hash array and the precompressed table
+//   entries   one 64-byte record per file, sorted by path: path offset and
+//             length, size, mtime (ns), inode, first piece, Merkle root
+//   strings   concatenated relative paths
+//   pieces    xxh3-128 hash of every PIECE_SIZE piece, file after file
+//   packed    (hash, pack offset, stored length, raw length), sorted by hash;
+//             a stored length of zero marks a piece that did not compress
+#[derive(Clone, Copy)]
+struct Layout {
+    files: usize,
+    strings: usize,
+    strings_len: usize,
+    pieces: usize,
+    piece_count: usize,
+    packed: usize,
+    packed_count: usize,
+}
+
+fn u64_at(buf: &[u8], at: usize) -> u64 {
+    u64::from_le_bytes(buf[at..at + 8].try_into().unwrap())
+}
+
+fn u128_at(buf: &[u8], at: usize) -> u128 {
+    u128::from_le_bytes(buf[at..at + 16].try_into().unwrap())
+}
+
+impl Layout {
+    fn parse(buf: &[u8]) -> Option<Layout> {
+        if buf.len() < HEADER_LEN || &buf[..8] != MAGIC {
+            return None;
+        }
+        let field = |at| usize::try_from(u64_at(buf, at)).ok();
+        let layout = Layout {
+            files: field(8)?,
+            strings: field(16)?,
+            strings_len: field(24)?,
+            pieces: field(32)?,
+            piece_count: field(40)?,
+            packed: field(48)?,
+            packed_count: field(56)?,
+        };
+
+        let within = |start: usize, count: usize, size: usize| {
+            count
+                .checked_mul(size)
+                .and_then(|len| start.checked_add(len))
+                .is_some_and(|end| end <= buf.len())
+        };
+        let valid = within(HEADER_LEN, layout.files, ENTRY_LEN)
+            && within(layout.strings, layout.strings_len, 1)
+            && within(layout.pieces, layout.piece_count, HASH_LEN)
+            && within(layout.packed, layout.packed_count, PACKED_LEN);
+        valid.then_some(layout)
+    }
+}
+
+pub struct IndexStats {
+    pub files: usize,
+    pub rehashed: usize,
+    pub precompressed: usize,
+}
+
+pub struct IndexEntry<'a> {
+    pub path: &'a str,
+    pub size: u64,
+    pub mtime: i64,
+    pub inode: u64,
+    pub root: u128,
+    pieces: &'a [u8],
+}
+
+impl IndexEntry<'_> {
+    pub fn piece_count(&self) -> usize {
+        self.pieces.len() / HASH_LEN
+    }
+
+    pub fn piece_hashes(&self) -> impl Iterator<Item = u128> + '_ {
+        self.pieces
+            .chunks_exact(HASH_LEN)
+            .map(|hash| u128_at(hash, 0))
+    }
+
+    pub fn matches(&self, meta: &fs::Metadata) -> bool {
+        self.size == meta.size() && self.mtime == mtime_nanos(meta) && self.inode == meta.ino()
+    }
+}
+
+pub fn mtime_nanos(meta: &fs::Metadata) -> i64 {
+    meta.mtime() * 1_000_000_000 + meta.mtime_nsec()
+}
+
+// Persistent index of a shared directory, memory-mapped from its sidecar
+// file so that loading it does not read the piece hashes.
+pub struct ShareIndex {
+    map: Mmap,
+    layout: Layout,
+    pack: Mmap,
+}
+
+enum Pieces {
+    Previous(usize),
+    Fresh(Vec<u128>),
+}
+
+struct Scanned {
+    path: String,
+    size: u64,
+    mtime: i64,
+    inode: u64,
+    root: u128,
+    pieces: Pieces,
+}
+
+// A file indexed outside `open`, to be written into a compacted index.
+pub struct Changed<'a> {
+    pub path: &'a str,
+    pub size: u64,
+    pub mtime: i64,
+    pub inode: u64,
+    pub root: u128,
+    pub pieces: &'a [u128],
+}
+
+pub struct IndexOptions {
+    pub precompress: bool,
+    pub threads: usize,
+    // Reads in flight at once, so indexing leaves disk bandwidth for serving.
+    pub io_limit: usize,
+}
+
+// Pieces hashed per task; large files are split so that a single file
+// still keeps every core busy.
+const PIECES_PER_TASK: usize = 64;
+
+#[derive(Default)]
+struct Progress {
+    files: AtomicUsize,
+    bytes: AtomicU64,
+    to_hash: AtomicU64,
+    hashed: AtomicU64,
+}
+
+impl Progress {
+    fn report(&self, done: &AtomicBool) {
+        let mut last = Instant::now();
+        while !done.load(Ordering::Acquire) {
+            thread::sleep(Duration::from_millis(100));
+            if last.elapsed() < Duration::from_secs(1) {
+                continue;
+            }
+            last = Instant::now();
+            println!(
+                "Indexing: {} files ({} MiB) found, {} of {} MiB hashed",
+                self.files.load(Ordering::Relaxed),
+                self.bytes.load(Ordering::Relaxed) >> 20,
+                self.hashed.load(Ordering::Relaxed) >> 20,
+                self.to_hash.load(Ordering::Relaxed) >> 20
+            );
+        }
+    }
+}
+
+thread_local! {
+    static PRECOMPRESSOR: RefCell<Option<zstd::bulk::Compressor<'static>>> =
+        const { RefCell::new(None) };
+}
+
+struct Packer {
+    file: BufWriter<File>,
+    offset: u64,
+    added: HashSet<u128>,
+    entries: Vec<(u128, u64, u32, u32)>,
+}
+
+impl Packer {
+    fn open(root: &Path) -> io::Result<Packer> {
+        let file = OpenOptions::new()
+            .create(true)
+            .append(true)
+            .open(root.join(PACK_FILE))?;
+        let offset = file.metadata()?.len();
+        Ok(Packer {
+            file: BufWriter::new(file),
+            offset,
+            added: HashSet::new(),
+            entries: Vec::new(),
+        })
+    }
+
+    // Compresses outside the lock with a per-thread context; only claiming
+    // the hash and appending the result are serialized.
+    fn add(
+        packer: &Mutex<Packer>,
+        previous: Option<&ShareIndex>,
+        hash: u128,
+        piece: &[u8],
+    ) -> io::Result<()> {
+        if previous.is_some_and(|index| index.is_packed(hash))
+            || !packer.lock().unwrap().added.insert(hash)
+        {
+            return Ok(());
+        }
+        let out = PRECOMPRESSOR.with(|ctx| {
+            let mut ctx = ctx.borrow_mut();
+            if ctx.is_none() {
+                *ctx = Some(zstd::bulk::Compressor::new(PRECOMPRESS_LEVEL)?);
+            }
+            ctx.as_mut().unwrap().compress(piece)
+        })?;
+        let mut packer = packer.lock().unwrap();
+        if !compress::worth_compressing(piece.len(), out.len()) {
+            // Recorded all the same, so it is not tried again.
+            packer.entries.push((hash, 0, 0, piece.len() as u32));
+            return Ok(());
+        }
+        packer.file.write_all(&out)?;
+        let offset = packer.offset;
+        packer
+            .entries
+            .push((hash, offset, out.len() as u32, piece.len() as u32));
+        packer.offset += out.len() as u64;
+        Ok(())
+    }
+}
+
+impl ShareIndex {
+    pub fn empty() -> ShareIndex {
+        ShareIndex {
+            map: Mmap::empty(),
+            layout: Layout {
+                files: 0,
+                strings: 0,
+                strings_len: 0,
+                pieces: 0,
+                piece_count: 0,
+                packed: 0,
+                packed_count: 0,
+            },
+            pack: Mmap::empty(),
+        }
+    }
+
+    // Loads the sidecar index of `root`, re-hashes only files whose (path,
+    // size, mtime, inode) key changed, and persists the result if anything
+    // differs from what was on disk. Walking and hashing both run on
+    // `options.threads` work-stealing workers.
+    pub fn open(root: &Path, options: &IndexOptions) -> io::Result<(ShareIndex, IndexStats)> {
+        let previous = Self::load(root)?;
+        let packer = if options.precompress {
+            Some(Mutex::new(Packer::open(root)?))
+        } else {
+            None
+        };
+
+        let progress = Progress::default();
+        let done = AtomicBool::new(false);
+        let (files, fresh) = thread::scope(|scope| {
+            scope.spawn(|| progress.report(&done));
+            let result = (|| {
+                let files = walk(root, options.threads, &progress)?;
+                let fresh = hash_changed(
+                    root,
+                    &files,
+                    previous.as_ref(),
+                    options,
+                    packer.as_ref(),
+                    &progress,
+                )?;
+                if let (Some(packer), Some(previous)) = (&packer, &previous) {
+                    pack_unchanged(root, &files, &fresh, previous, options, packer, &progress);
+                }
+                Ok::<_, io::Error>((files, fresh))
+            })();
+            done.store(true, Ordering::Release);
+            result
+        })?;
+
+        let mut fresh = fresh.into_iter().peekable();
+        let mut scanned = Vec::with_capacity(files.len());
+        for (position, (path, meta)) in files.into_iter().enumerate() {
+            let (root_hash, pieces) = match fresh.next_if(|(file, _)| *file == position) {
+                Some((_, pieces)) => (merkle_root(&pieces), Pieces::Fresh(pieces)),
+                None => {
+                    let index = previous.as_ref().unwrap();
+                    let previous_position = index.position(&path).unwrap();
+                    (
+                        index.entry(previous_position).root,
+                        Pieces::Previous(previous_position),
+                    )
+                }
+            };
+            scanned.push(Scanned {
+                path,
+                size: meta.size(),
+                mtime: mtime_nanos(&meta),
+                inode: meta.ino(),
+                root: root_hash,
+                pieces,
+            });
+        }
+        let rehashed = scanned
+            .iter()
+            .filter(|file| matches!(file.pieces, Pieces::Fresh(_)))
+            .count();
+
+        let packed = match packer {
+            Some(packer) => {
+                let mut packer = packer.into_inner().unwrap();
+                packer.file.flush()?;
+                packer.entries
+            }
+            None => Vec::new(),
+        };
+        let stats = IndexStats {
+            files: scanned.len(),
+            rehashed,
+            precompressed: packed.iter().filter(|record| record.2 > 0).count(),
+        };
+
+        if let Some(index) = previous {
+            if rehashed == 0 && packed.is_empty() && index.len() == scanned.len() {
+                return Ok((index, stats));
+            }
+            write_index(root, &scanned, Some(&index), packed)?;
+        } else {
+            write_index(root, &scanned, None, packed)?;
+        }
+
+        let index = Self::load(root)?.ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::InvalidData,
+                "freshly written index is invalid",
+            )
+        })?;
+        Ok((index, stats))
+    }
+
+    // Writes a new index for `root` from this one, leaving out every path
+    // `overridden` names and adding the `changed` files, and loads it. No
+    // file is read or hashed.
+    pub fn compact<'a>(
+        &self,
+        root: &Path,
+        overridden: impl Fn(&str) -> bool,
+        changed: impl IntoIterator<Item = Changed<'a>>,
+    ) -> io::Result<ShareIndex> {
+        let mut scanned: Vec<Scanned> = (0..self.len())
+            .map(|position| (position, self.entry(position)))
+            .filter(|(_, entry)| !overridden(entry.path))
+            .map(|(position, entry)| Scanned {
+                path: entry.path.to_string(),
+                size: entry.size,
+                mtime: entry.mtime,
+                inode: entry.inode,
+                root: entry.root,
+                pieces: Pieces::Previous(position),
+            })
+            .collect();
+        scanned.extend(changed.into_iter().map(|file| Scanned {
+            path: file.path.to_string(),
+            size: file.size,
+            mtime: file.mtime,
+            inode: file.inode,
+            root: file.root,
+            pieces: Pieces::Fresh(file.pieces.to_vec()),
+        }));
+        scanned.sort_unstable_by(|a, b| a.path.cmp(&b.path));
+        write_index(root, &scanned, Some(self), Vec::new())?;
+        Self::load(root)?.ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::InvalidData,
+                "freshly written index is invalid",
+            )
+        })
+    }
+
+    fn load(root: &Path) -> io::Result<Option<ShareIndex>> {
+        let file = match File::open(root.join(INDEX_FILE)) {
+            Ok(file) => file,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(None),
+            Err(e) => return Err(e),
+        };
+        let map = Mmap::open(&file)?;
+        let Some(layout) = Layout::parse(&map) else {
+            eprintln!("Ignoring corrupt index: {}", INDEX_FILE);
+            return Ok(None);
+        };
+        let pack = match File::open(root.join(PACK_FILE)) {
+            Ok(file) => Mmap::open(&file)?,
+            Err(e) if e.kind() == io::ErrorKind::NotFound => Mmap::empty(),
+            Err(e) => return Err(e),
+        };
+        Ok(Some(ShareIndex { map, layout, pack }))
+    }
+
+    pub fn len(&self) -> usize {
+        self.layout.files
+    }
+
+    pub fn entry(&self, position: usize) -> IndexEntry<'_> {
+        let record = &self.map[HEADER_LEN + position * ENTRY_LEN..][..ENTRY_LEN];
+        let path_start = (u64_at(record, 0) as usize).min(self.layout.strings_len);
+        let path_len = (u64_at(record, 8) as usize).min(self.layout.strings_len - path_start);
+        let path = &self.map[self.layout.strings + path_start..][..path_len];
+
+        let size = u64_at(record, 16);
+        let first_piece = (u64_at(record, 40) as usize).min(self.layout.piece_count);
+        let piece_count =
+            (size.div_ceil(PIECE_SIZE as u64) as usize).min(self.layout.piece_count - first_piece);
+        IndexEntry {
+            path: std::str::from_utf8(path).unwrap_or(""),
+            size,
+            mtime: u64_at(record, 24) as i64,
+            inode: u64_at(record, 32),
+            root: u128_at(record, 48),
+            pieces: &self.map[self.layout.pieces + first_piece * HASH_LEN..]
+                [..piece_count * HASH_LEN],
+        }
+    }
+
+    // First position whose path is not less than `path`.
+    fn lower_bound(&self, path: &str) -> usize {
+        let (mut low, mut high) = (0, self.len());
+        while low < high {
+            let mid = (low + high) / 2;
+            if self.entry(mid).path < path {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        low
+    }
+
+    fn position(&self, path: &str) -> Option<usize> {
+        let position = self.lower_bound(path);
+        (position < self.len() && self.entry(position).path == path).then_some(position)
+    }
+
+    pub fn lookup(&self, path: &str) -> Option<IndexEntry<'_>> {
+        self.position(path).map(|position| self.entry(position))
+    }
+
+    pub fn entries(&self) -> impl Iterator<Item = IndexEntry<'_>> {
+        (0..self.len()).map(|position| self.entry(position))
+    }
+
+    pub fn entries_under<'a>(&'a self, prefix: &'a str) -> impl Iterator<Item = IndexEntry<'a>> {
+        (self.lower_bound(prefix)..self.len())
+            .map(|position| self.entry(position))
+            .take_while(move |entry| entry.path.starts_with(prefix))
+    }
+
+    fn packed_record(&self, position: usize) -> &[u8] {
+        &self.map[self.layout.packed + position * PACKED_LEN..][..PACKED_LEN]
+    }
+
+    fn packed_position(&self, hash: u128) -> Option<usize> {
+        let (mut low, mut high) = (0, self.layout.packed_count);
+        while low < high {
+            let mid = (low + high) / 2;
+            match u128_at(self.packed_record(mid), 0).cmp(&hash) {
+                std::cmp::Ordering::Less => low = mid + 1,
+                std::cmp::Ordering::Greater => high = mid,
+                std::cmp::Ordering::Equal => return Some(mid),
+            }
+        }
+        None
+    }
+
+    // Whether precompressing the piece was tried, worthwhile or not.
+    fn is_packed(&self, hash: u128) -> bool {
+        self.packed_position(hash).is_some()
+    }
+
+    // Precompressed copy of the piece with the given hash, if one was packed.
+    pub fn precompressed(&self, hash: u128) -> Option<&[u8]> {
+        let record = self.packed_record(self.packed_position(hash)?);
+        let offset = usize::try_from(u64_at(record, 16)).ok()?;
+        let len = u32::from_le_bytes(record[24..28].try_into().unwrap()) as usize;
+        if len == 0 {
+            return None;
+        }
+        self.pack.get(offset..offset.checked_add(len)?)
+    }
+}
+
+pub fn is_sidecar(relative: &str) -> bool {
+    relative.starts_with(".peernet-")
+}
+
+fn walk(
+    root: &Path,
+    threads: usize,
+    progress: &Progress,
+) -> io::Result<Vec<(String, fs::Metadata)>> {
+    let found = Mutex::new(Vec::new());
+    let error = Mutex::new(None);
+    pool::run(threads, vec![String::new()], |dir: String, spawner| {
+        if let Err(e) = walk_dir(root, &dir, spawner, &found, progress) {
+            error.lock().unwrap().get_or_insert(e);
+        }
+    });
+    if let Some(e) = error.into_inner().unwrap() {
+        return Err(e);
+    }
+
+    let mut files = found.into_inner().unwrap();
+    files.sort_unstable_by(|a: &(String, fs::Metadata), b| a.0.cmp(&b.0));
+    Ok(files)
+}
+
+fn walk_dir(
+    root: &Path,
+    dir: &str,
+    spawner: &Spawner<String>,
+    found: &Mutex<Vec<(String, fs::Metadata)>>,
+    progress: &Progress,
+) -> io::Result<()> {
+    let mut files = Vec::new();
+    for entry in fs::read_dir(root.join(dir))? {
+        let entry = entry?;
+        let Ok(name) = entry.file_name().into_string() else {
+            continue;
+        };
+        let relative = if dir.is_empty() {
+            name
+        } else {
+            format!("{}/{}", dir, name)
+        };
+        let file_type = entry.file_type()?;
+        if file_type.is_dir() {
+            spawner.spawn(relative);
+        } else if file_type.is_file() && !is_sidecar(&relative) {
+            let meta = entry.metadata()?;
+            progress.files.fetch_add(1, Ordering::Relaxed);
+            progress.bytes.fetch_add(meta.size(), Ordering::Relaxed);
+            files.push((relative, meta));
+        }
+    }
+    found.lock().unwrap().extend(files);
+    Ok(())
+}
+
+// Hashes every file whose key does not match `previous`, returning
+// (position in `files`, piece hashes) sorted by position.
+fn hash_changed(
+    root: &Path,
+    files: &[(String, fs::Metadata)],
+    previous: Option<&ShareIndex>,
+    options: &IndexOptions,
+    packer: Option<&Mutex<Packer>>,
+    progress: &Progress,
+) -> io::Result<Vec<(usize, Vec<u128>)>> {
+    let changed: Vec<usize> = (0..files.len())
+        .filter(|&position| {
+            let (path, meta) = &files[position];
+            !previous
+                .is_some_and(|index| index.lookup(path).is_some_and(|entry| entry.matches(meta)))
+        })
+        .collect();
+
+    let outputs: Vec<Mutex<Vec<u128>>> = changed
+        .iter()
+        .map(|&position| {
+            let size = files[position].1.size();
+            progress.to_hash.fetch_add(size, Ordering::Relaxed);
+            Mutex::new(vec![0; size.div_ceil(PIECE_SIZE as u64) as usize])
+        })
+        .collect();
+    let mut tasks = Vec::new();
+    for (slot, output) in outputs.iter().enumerate() {
+        let pieces = output.lock().unwrap().len();
+        for first in (0..pieces).step_by(PIECES_PER_TASK) {
+            tasks.push((slot, first, PIECES_PER_TASK.min(pieces - first)));
+        }
+    }
+
+    let io = Semaphore::new(options.io_limit);
+    let error = Mutex::new(None);
+    pool::run(options.threads, tasks, |(slot, first, count), _| {
+        let (path, meta) = &files[changed[slot]];
+        let hashed = hash_pieces(
+            &root.join(path),
+            meta.size(),
+            first..first + count,
+            &io,
+            packer.map(|packer| (packer, previous)),
+            progress,
+        );
+        match hashed {
+            Ok(hashes) => {
+                outputs[slot].lock().unwrap()[first..first + count].copy_from_slice(&hashes)
+            }
+            Err(e) => {
+                error.lock().unwrap().get_or_insert(e);
+            }
+        }
+    });
+    if let Some(e) = error.into_inner().unwrap() {
+        return Err(e);
+    }
+
+    Ok(changed
+        .into_iter()
+        .zip(outputs)
+        .map(|(position, output)| (position, output.into_inner().unwrap()))
+        .collect())
+}
+
+// Packs the pieces of unchanged files that precompressing was never tried
+// on, such as all of a share indexed before --precompress was first given.
+// A file that cannot be read is only reported, as the index does not
+// depend on it.
+fn pack_unchanged(
+    root: &Path,
+    files: &[(String, fs::Metadata)],
+    fresh: &[(usize, Vec<u128>)],
+    previous: &ShareIndex,
+    options: &IndexOptions,
+    packer: &Mutex<Packer>,
+    progress: &Progress,
+) {
+    let mut fresh = fresh.iter().map(|(position, _)| *position).peekable();
+    let mut tasks = Vec::new();
+    for (position, (path, meta)) in files.iter().enumerate() {
+        if fresh.next_if_eq(&position).is_some() {
+            continue;
+        }
+        let Some(entry) = previous.lookup(path) else {
+            continue;
+        };
+        let missing: Vec<(usize, u128)> = entry
+            .piece_hashes()
+            .enumerate()
+            .filter(|&(_, hash)| !previous.is_packed(hash))
+            .collect();
+        progress
+            .to_hash
+            .fetch_add(missing.len() as u64 * PIECE_SIZE as u64, Ordering::Relaxed);
+        for pieces in missing.chunks(PIECES_PER_TASK) {
+            tasks.push((path, meta.size(), pieces.to_vec()));
+        }
+    }
+
+    let io = Semaphore::new(options.io_limit);
+    pool::run(options.threads, tasks, |(path, size, pieces), _| {
+        let packed = pack_pieces(
+            &root.join(path),
+            size,
+            &pieces,
+            &io,
+            previous,
+            packer,
+            progress,
+        );
+        if let Err(e) = packed {
+            eprintln!("Cannot precompress {}: {}", path, e);
+        }
+    });
+}
+
+fn pack_pieces(
+    path: &Path,
+    size: u64,
+    pieces: &[(usize, u128)],
+    io: &Semaphore,
+    previous: &ShareIndex,
+    packer: &Mutex<Packer>,
+    progress: &Progress,
+) -> io::Result<()> {
+    let file = File::open(path)?;
+    let mut buf = vec![0; PIECE_SIZE];
+    for &(piece, hash) in pieces {
+        let offset = (piece * PIECE_SIZE) as u64;
+        let len = size.saturating_sub(offset).min(PIECE_SIZE as u64) as usize;
+        let n = {
+            let _permit = io.acquire();
+            read_full_at(&file, &mut buf[..len], offset)?
+        };
+        progress
+            .hashed
+            .fetch_add(PIECE_SIZE as u64, Ordering::Relaxed);
+        // Changed since it was walked; the next open hashes it again.
+        if xxh3_128(&buf[..n]) != hash {
+            return Ok(());
+        }
+        Packer::add(packer, Some(previous), hash, &buf[..n])?;
+    }
+    Ok(())
+}
+
+// Hashes the given pieces of a file of `size` bytes, as seen when it was
+// walked. If the file changed since, its mtime no longer matches the one
+// recorded and the next open hashes it again.
+fn hash_pieces(
+    path: &Path,
+    size: u64,
+    pieces: Range<usize>,
+    io: &Semaphore,
+    packer: Option<(&Mutex<Packer>, Option<&ShareIndex>)>,
+    progress: &Progress,
+) -> io::Result<Vec<u128>> {
+    let file = File::open(path)?;
+    let mut buf = vec![0; PIECE_SIZE];
+    let mut hashes = Vec::with_capacity(pieces.len());
+    for piece in pieces {
+        let offset = (piece * PIECE_SIZE) as u64;
+        let len = (size - offset).min(PIECE_SIZE as u64) as usize;
+        let n = {
+            let _permit = io.acquire();
+            read_full_at(&file, &mut buf[..len], offset)?
+        };
+        let hash = xxh3_128(&buf[..n]);
+        if let Some((packer, previous)) = packer {
+            Packer::add(packer, previous, hash, &buf[..n])?;
+        }
+        progress.hashed.fetch_add(n as u64, Ordering::Relaxed);
+        hashes.push(hash);
+    }
+    Ok(hashes)
+}
+
+fn read_full_at(file: &File, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+    let mut filled = 0;
+    while filled < buf.len() {
+        match file.read_at(&mut buf[filled..], offset + filled as u64) {
+            Ok(0) => break,
+            Ok(n) => filled += n,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+            Err(e) => return Err(e),
+        }
+    }
+    Ok(filled)
+}
+
+fn read_full(file: &mut File, buf: &mut [u8]) -> io::Result<usize> {
+    let mut filled = 0;
+    while filled < buf.len() {
+        match file.read(&mut buf[filled..]) {
+            Ok(0) => break,
+            Ok(n) => filled += n,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+            Err(e) => return Err(e),
+        }
+    }
+    Ok(filled)
+}
+
+// Piece hashes of a single file, as stored in the index.
+pub fn hash_path(path: &Path) -> io::Result<(u64, Vec<u128>)> {
+    let mut file = File::open(path)?;
+    let mut buf = vec![0; PIECE_SIZE];
+    let mut pieces = Vec::new();
+    let mut size = 0;
+    loop {
+        let n = read_full(&mut file, &mut buf)?;
+        if n == 0 {
+            break;
+        }
+        size += n as u64;
+        pieces.push(xxh3_128(&buf[..n]));
+        if n < PIECE_SIZE {
+            break;
+        }
+    }
+    Ok((size, pieces))
+}
+
+pub fn merkle_root(pieces: &[u128]) -> u128 {
+    if pieces.is_empty() {
+        return xxh3_128(&[]);
+    }
+    let mut level = pieces.to_vec();
+    while level.len() > 1 {
+        level = level
+            .chunks(2)
+            .map(|pair| match pair {
+                [left, right] => {
+                    let mut node = [0u8; 32];
+                    node[..16].copy_from_slice(&left.to_le_bytes());
+                    node[16..].copy_from_slice(&right.to_le_bytes());
+                    xxh3_128(&node)
+                }
+                [single] => *single,
+                _ => unreachable!(),
+            })
+            .collect();
+    }
+    level[0]
+}
+
+fn write_index(
+    root: &Path,
+    files: &[Scanned],
+    previous: Option<&ShareIndex>,
+    mut packed: Vec<(u128, u64, u32, u32)>,
+) -> io::Result<()> {
+    // Packed chunks are content-addressed and the pack file is only ever
+    // appended to between rewrites, so every previous record still points
+    // at valid data.
+    if let Some(index) = previous {
+        for position in 0..index.layout.packed_count {
+            let record = index.packed_record(position);
+            packed.push((
+                u128_at(record, 0),
+                u64_at(record, 16),
+                u32::from_le_bytes(record[24..28].try_into().unwrap()),
+                u32::from_le_bytes(record[28..32].try_into().unwrap()),
+            ));
+        }
+    }
+    packed.sort_unstable_by_key(|record| record.0);
+    packed.dedup_by_key(|record| record.0);
+    let repacked = if packed.is_empty() {
+        None
+    } else {
+        let mut live = HashSet::new();
+        for file in files {
+            match &file.pieces {
+                Pieces::Previous(position) => {
+                    live.extend(previous.unwrap().entry(*position).piece_hashes())
+                }
+                Pieces::Fresh(hashes) => live.extend(hashes),
+            }
+        }
+        packed.retain(|record| live.contains(&record.0));
+        repack(root, &mut packed)?
+    };
+
+    let piece_count = |file: &Scanned| file.size.div_ceil(PIECE_SIZE as u64) as usize;
+    let strings_len: usize = files.iter().map(|file| file.path.len()).sum();
+    let total_pieces: usize = files.iter().map(piece_count).sum();
+    let strings = HEADER_LEN + files.len() * ENTRY_LEN;
+    let pieces = strings + strings_len;
+    let packed_offset = pieces + total_pieces * HASH_LEN;
+
+    let temp = root.join(format!("{}.tmp", INDEX_FILE));
+    let mut out = BufWriter::new(File::create(&temp)?);
+    out.write_all(MAGIC)?;
+    for value in [
+        files.len(),
+        strings,
+        strings_len,
+        pieces,
+        total_pieces,
+        packed_offset,
+        packed.len(),
+    ] {
+        out.write_all(&(value as u64).to_le_bytes())?;
+    }
+
+    let (mut path_offset, mut first_piece) = (0usize, 0usize);
+    for file in files {
+        out.write_all(&(path_offset as u64).to_le_bytes())?;
+        out.write_all(&(file.path.len() as u64).to_le_bytes())?;
+        out.write_all(&file.size.to_le_bytes())?;
+        out.write_all(&file.mtime.to_le_bytes())?;
+        out.write_all(&file.inode.to_le_bytes())?;
+        out.write_all(&(first_piece as u64).to_le_bytes())?;
+        out.write_all(&file.root.to_le_bytes())?;
+        path_offset += file.path.len();
+        first_piece += piece_count(file);
+    }
+    for file in files {
+        out.write_all(file.path.as_bytes())?;
+    }
+    for file in files {
+        match &file.pieces {
+            Pieces::Previous(position) => {
+                let entry = previous.unwrap().entry(*position);
+                out.write_all(entry.pieces)?;
+            }
+            Pieces::Fresh(hashes) => {
+                for hash in hashes {
+                    out.write_all(&hash.to_le_bytes())?;
+                }
+            }
+        }
+    }
+    for (hash, offset, stored, raw) in &packed {
+        out.write_all(&hash.to_le_bytes())?;
+        out.write_all(&offset.to_le_bytes())?;
+        out.write_all(&stored.to_le_bytes())?;
+        out.write_all(&raw.to_le_bytes())?;
+    }
+
+    let file = out.into_inner().map_err(|e| e.into_error())?;
+    file.sync_all()?;
+    if let Some(pack) = repacked {
+        // No index at all is safe, at the cost of hashing the share again
+        // after a crash; the old index with the new pack is not.
+        match fs::remove_file(root.join(INDEX_FILE)) {
+            Err(e) if e.kind() != io::ErrorKind::NotFound => return Err(e),
+            _ => {}
+        }
+        fs::rename(pack, root.join(PACK_FILE))?;
+    }
+    fs::rename(&temp, root.join(INDEX_FILE))
+}
+
+// Once most of the pack belongs to pieces no file has any more, copies the
+// `packed` records' data into a new pack and points them at it, returning
+// the new pack's temporary path. The caller moves it into place.
+fn repack(root: &Path, packed: &mut [(u128, u64, u32, u32)]) -> io::Result<Option<PathBuf>> {
+    let size = match fs::metadata(root.join(PACK_FILE)) {
+        Ok(meta) => meta.len(),
+        Err(e) if e.kind() == io::ErrorKind::NotFound => return Ok(None),
+        Err(e) => return Err(e),
+    };
+    let live: u64 = packed.iter().map(|record| record.2 as u64).sum();
+    if size < MIN_REPACK || size - live <= size / 2 {
+        return Ok(None);
+    }
+
+    let old = File::open(root.join(PACK_FILE))?;
+    let temp = root.join(format!("{}.tmp", PACK_FILE));
+    let mut out = BufWriter::new(File::create(&temp)?);
+    let mut buf = Vec::new();
+    let mut offset = 0;
+    for (_, at, stored, _) in packed.iter_mut().filter(|record| record.2 > 0) {
+        buf.resize(*stored as usize, 0);
+        old.read_exact_at(&mut buf, *at)?;
+        out.write_all(&buf)?;
+        *at = offset;
+        offset += *stored as u64;
+    }
+    out.into_inner().map_err(|e| e.into_error())?.sync_all()?;
+    println!(
+        "Rewrote the chunk pack: {} of {} MiB were dead",
+        (size - live) >> 20,
+        size >> 20
+    );
+    Ok(Some(temp))
+}
@@ -0,0 +1,274 @@
+use std::collections::VecDeque;
+use std::future::Future;
+use std::io::{self, IoSlice};
+use std::os::fd::AsRawFd;
+use std::pin::Pin;
+use std::task::{ready, Context, Poll};
+use std::time::{Duration, Instant};
+use tokio::io::{AsyncRead, AsyncWrite, ReadBuf};
+use tokio::net::TcpStream;
+use tokio::time::{self, Sleep};
+
+// Queuing delay a background transfer is allowed to add. RFC 6817 caps this
+// at 100ms; our seeds share hosts with latency-sensitive services, so back
+// off well before that.
+const TARGET: Duration = Duration::from_millis(25);
+
+const GAIN: f64 = 1.0;
+
+// The base delay is the minimum over this many one-minute buckets, so a
+// route change is forgotten after ten minutes.
+const BASE_HISTORY: usize = 10;
+const BASE_BUCKET: Duration = Duration::from_secs(60);
+
+// The current delay is the minimum of the last few samples, to filter out
+// one-off spikes.
+const CURRENT_FILTER: usize = 4;
+
+const MIN_WINDOW_SEGMENTS: usize = 2;
+
+// Delay-based congestion control after LEDBAT: the window grows while the
+// measured delay is near its base and shrinks in proportion to how far
+// queuing pushes it past TARGET. The transfer therefore fills an idle link
+// and yields as soon as other traffic starts queuing behind it.
+pub struct Ledbat {
+    mss: usize,
+    window: usize,
+    max_window: usize,
+    base: VecDeque<(Instant, Duration)>,
+    current: VecDeque<Duration>,
+    // Doubling per RTT until queuing first reaches half the target, as in
+    // LEDBAT++, so a fresh transfer does not take minutes to fill a link.
+    slow_start: bool,
+    last_loss: Option<Instant>,
+}
+
+impl Ledbat {
+    pub fn new(mss: usize, window: usize, max_window: usize) -> Ledbat {
+        Ledbat {
+            mss,
+            window,
+            max_window,
+            base: VecDeque::new(),
+            current: VecDeque::new(),
+            slow_start: true,
+            last_loss: None,
+        }
+    }
+
+    pub fn window(&self) -> usize {
+        self.window
+    }
+
+    pub fn in_slow_start(&self) -> bool {
+        self.slow_start
+    }
+
+    fn min_window(&self) -> usize {
+        MIN_WINDOW_SEGMENTS * self.mss
+    }
+
+    // Feeds one delay sample. One-way delay is best, but RTT works as long
+    // as the reverse path is not the congested one.
+    pub fn on_delay(&mut self, delay: Duration, now: Instant) {
+        match self.base.back_mut() {
+            Some((start, min)) if now.duration_since(*start) < BASE_BUCKET => {
+                *min = (*min).min(delay);
+            }
+            _ => {
+                self.base.push_back((now, delay));
+                if self.base.len() > BASE_HISTORY {
+                    self.base.pop_front();
+                }
+            }
+        }
+        self.current.push_back(delay);
+        if self.current.len() > CURRENT_FILTER {
+            self.current.pop_front();
+        }
+    }
+
+    pub fn queuing_delay(&self) -> Duration {
+        let base = self.base.iter().map(|&(_, min)| min).min();
+        let current = self.current.iter().min();
+        match (base, current) {
+            (Some(base), Some(&current)) => current.saturating_sub(base),
+            _ => Duration::ZERO,
+        }
+    }
+
+    pub fn on_ack(&mut self, acked: usize) {
+        let queuing = self.queuing_delay();
+        if self.slow_start && queuing < TARGET / 2 {
+            self.window = (self.window + acked).min(self.max_window);
+            return;
+        }
+        self.slow_start = false;
+
+        let off_target =
+            ((TARGET.as_secs_f64() - queuing.as_secs_f64()) / TARGET.as_secs_f64()).max(-1.0);
+        // Never grow faster than slow start would.
+        let change = (GAIN * off_target * acked as f64 * self.mss as f64 / self.window as f64)
+            .min(acked as f64);
+        let window = (self.window as f64 + change).max(0.0) as usize;
+        self.window = window.clamp(self.min_window(), self.max_window);
+    }
+
+    // Halves the window, at most once per round trip.
+    pub fn on_loss(&mut self, now: Instant, rtt: Duration) {
+        if self
+            .last_loss
+            .is_some_and(|at| now.duration_since(at) < rtt)
+        {
+            return;
+        }
+        self.last_loss = Some(now);
+        self.slow_start = false;
+        self.window = (self.window / 2).max(self.min_window());
+    }
+
+    pub fn on_timeout(&mut self) {
+        self.slow_start = false;
+        self.window = self.min_window();
+    }
+}
+
+// A TCP stream whose writes are held back by a LEDBAT window. The kernel
+// still runs its own congestion control; this only limits how many bytes
+// may sit unacknowledged in the send queue, using the smoothed RTT from
+// TCP_INFO as the delay signal and the send queue size to count acks.
+pub struct Background {
+    inner: TcpStream,
+    ledbat: Ledbat,
+    written: u64,
+    acked: u64,
+    retransmits: u32,
+    rtt: Duration,
+    sleep: Pin<Box<Sleep>>,
+}
+
+const TCP_MAX_WINDOW: usize = 64 << 20;
+
+impl Background {
+    pub fn new(inner: TcpStream) -> Background {
+        Background {
+            inner,
+            ledbat: Ledbat::new(1448, 10 * 1448, TCP_MAX_WINDOW),
+            written: 0,
+            acked: 0,
+            retransmits: 0,
+            rtt: Duration::from_millis(1),
+            sleep: Box::pin(time::sleep(Duration::ZERO)),
+        }
+    }
+
+    pub fn get_ref(&self) -> &TcpStream {
+        &self.inner
+    }
+
+    // Samples the socket and returns how many bytes are still queued.
+    fn refresh(&mut self) -> io::Result<usize> {
+        let fd = self.inner.as_raw_fd();
+        let mut info: libc::tcp_info = unsafe { std::mem::zeroed() };
+        let mut len = std::mem::size_of::<libc::tcp_info>() as libc::socklen_t;
+        let mut queued: libc::c_int = 0;
+        unsafe {
+            if libc::getsockopt(
+                fd,
+                libc::IPPROTO_TCP,
+                libc::TCP_INFO,
+                (&mut info as *mut libc::tcp_info).cast(),
+                &mut len,
+            ) < 0
+                || libc::ioctl(fd, libc::TIOCOUTQ, &mut queued) < 0
+            {
+                return Err(io::Error::last_os_error());
+            }
+        }
+
+        let now = Instant::now();
+        self.ledbat.mss = (info.tcpi_snd_mss as usize).max(536);
+        if info.tcpi_rtt > 0 {
+            self.rtt = Duration::from_micros(info.tcpi_rtt as u64);
+        }
+        if info.tcpi_total_retrans > self.retransmits {
+            self.retransmits = info.tcpi_total_retrans;
+            self.ledbat.on_loss(now, self.rtt);
+        }
+        let queued = queued.max(0) as usize;
+        let acked = self.written.saturating_sub(queued as u64);
+        if acked > self.acked {
+            self.ledbat.on_delay(self.rtt, now);
+            self.ledbat.on_ack((acked - self.acked) as usize);
+            self.acked = acked;
+        }
+        Ok(queued)
+    }
+}
+
+impl AsyncRead for Background {
+    fn poll_read(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut ReadBuf<'_>,
+    ) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_read(cx, buf)
+    }
+}
+
+impl AsyncWrite for Background {
+    fn poll_write(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &[u8],
+    ) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        loop {
+            let queued = this.refresh()?;
+            let window = this.ledbat.window();
+            if queued < window {
+                let allowed = (window - queued).min(buf.len());
+                let n = ready!(Pin::new(&mut this.inner).poll_write(cx, &buf[..allowed]))?;
+                this.written += n as u64;
+                return Poll::Ready(Ok(n));
+            }
+            // Window full: look again after a fraction of a round trip.
+            let wait = (this.rtt / 4).clamp(Duration::from_micros(200), Duration::from_millis(10));
+            this.sleep.as_mut().reset(time::Instant::now() + wait);
+            ready!(this.sleep.as_mut().poll(cx));
+        }
+    }
+
+    fn poll_write_vectored(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        bufs: &[IoSlice<'_>],
+    ) -> Poll<io::Result<usize>> {
+        let total: usize = bufs.iter().map(|buf| buf.len()).sum();
+        let this = self.get_mut();
+        let queued = this.refresh()?;
+        if queued + total <= this.ledbat.window() {
+            let n = ready!(Pin::new(&mut this.inner).poll_write_vectored(cx, bufs))?;
+            this.written += n as u64;
+            return Poll::Ready(Ok(n));
+        }
+        // Past the window: fall back to the gated write of the first slice.
+        let first = bufs
+            .iter()
+            .find(|buf| !buf.is_empty())
+            .map_or(&[][..], |buf| &**buf);
+        Pin::new(this).poll_write(cx, first)
+    }
+
+    fn is_write_vectored(&self) -> bool {
+        self.inner.is_write_vectored()
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_flush(cx)
+    }
+
+    fn poll_shutdown(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_shutdown(cx)
+    }
+}
@@ -1,30 +1,181 @@
+mod arena;
+mod bench;
+mod bitfield;
+mod bloom;
+mod buffers;
+mod bundle;
+mod catalog;
 mod client;
+mod compress;
+mod config;
+mod cores;
+mod delta;
+mod erasure;
+mod frame;
+mod index;
+mod ledbat;
+mod mmap;
+mod pool;
+mod protocol;
+mod relay;
 mod server;
+mod shards;
+mod sockopt;
+mod sparse;
+mod store;
+mod stripe;
+mod transport;
+mod tree;
+mod udp;
+mod watch;
 
+use config::{Config, RuntimeOptions};
 use std::env;
+use std::io;
+use tokio::runtime::{Builder, Runtime};
+
+const USAGE: &str = "Usage: cargo run -- <server|client|push|relay|bench> [options]
+
+Commands:
+  server                 Serve the share to clients
+  client                 Fetch example.txt from a server
+  push                   Push example.txt from the share down a relay tree
+  relay                  Receive pushed artifacts and forward them on
+  bench                  Measure socket options over loopback and catalog
+                         lookups across threads, or with --connections,
+                         load a server in each runtime mode
+
+Options:
+  --listen <addr>        Address to listen on (server, relay)
+  --listeners <n>        SO_REUSEPORT listeners sharing the address (server, TCP)
+  --per-core             Run one pinned single-threaded runtime per core (server, TCP)
+  --connections <n>      Concurrent connections to load each server mode with (bench)
+  --worker-threads <n>   Runtime worker threads (default: one per core)
+  --blocking-threads <n> Most threads for blocking file work (default: 512)
+  --event-interval <n>   Scheduler ticks between I/O polls (default: 61)
+  --global-queue-interval <n>
+                         Scheduler ticks between global queue checks
+  --stack-size <bytes>   Stack size of runtime threads (default: 2 MiB)
+  --connect <addr>       Server to fetch from (client)
+  --dir <path>           Fetch a directory of the share, or all of it for \"\",
+                         into received/ (client)
+  --mirror               Sync received/ with the whole share, walking directory
+                         hashes to fetch only what changed, and with --watch
+                         again on every change (client)
+  --sources <a,b,...>    Fetch erasure-coded shards from several servers (client)
+  --store <dir>          Keep downloads in a deduplicating piece store and
+                         materialize them from it; pieces it already holds
+                         are not fetched again (client)
+  --stripes <n>          Fetch over up to n parallel connections (client)
+  --erasure <k+m>        Data and parity shards per piece group (default: 4+2)
+  --root <hex>           Merkle root of the file wanted from --sources, served
+                         from whichever path holds it; sources whose content
+                         summary lacks it are skipped (client)
+  --peers <a,b,...>      Relays to push to (push)
+  --fanout <n>           Children per relay node, 1 for a chain (default: 4)
+  --share <dir>          Directory to share (server, default: .)
+  --precompress          Store compressed pieces next to the index (server)
+  --index-threads <n>    Threads used to walk and hash the share (server)
+  --index-io <n>         Reads in flight while indexing (server, default: 4)
+  --watch                Follow catalog updates and re-sync on change (client)
+  --transport <tcp|udp>  Peer transport for server and client (default: tcp)
+  --background           Upload at scavenger priority, yielding to other traffic
+  --impair-loss <pct>    Drop this share of sent UDP datagrams, for testing
+  --impair-delay <ms>    Delay every sent UDP datagram, for testing
+  --nagle                Leave Nagle's algorithm on for peer connections
+  --sndbuf <bytes>       Socket send buffer size (default: kernel autotuning)
+  --rcvbuf <bytes>       Socket receive buffer size (default: kernel autotuning)
+  --keepalive <secs>     Idle time before keepalive probes, 0 for off (default: 60)
+  --busy-poll <us>       Busy-poll the device queue on receive
+  --cork                 Cork responses so headers share a segment with data
+  --no-compress          Do not negotiate zstd compression";
+
+// Builds the runtime a subcommand runs on. Every role in the process
+// shares it, so runtime tuning is a matter of flags. Single-threaded
+// runtimes serve the pinned cores of --per-core.
+pub fn build_runtime(options: &RuntimeOptions, single_threaded: bool) -> io::Result<Runtime> {
+    let mut builder = if single_threaded {
+        Builder::new_current_thread()
+    } else {
+        let mut builder = Builder::new_multi_thread();
+        if let Some(threads) = options.worker_threads {
+            builder.worker_threads(threads);
+        }
+        builder
+    };
+    builder.enable_all();
+    if let Some(threads) = options.blocking_threads {
+        builder.max_blocking_threads(threads);
+    }
+    if let Some(interval) = options.event_interval {
+        builder.event_interval(interval);
+    }
+    if let Some(interval) = options.global_queue_interval {
+        builder.global_queue_interval(interval);
+    }
+    if let Some(size) = options.stack_size {
+        builder.thread_stack_size(size);
+    }
+    builder.build()
+}
 
 fn main() {
     let args: Vec<String> = env::args().collect();
     if args.len() < 2 {
-        eprintln!("Usage: cargo run -- <server|client>");
+        eprintln!("{}", USAGE);
         return;
     }
 
+    let config = match Config::from_args(&args[2..]) {
+        Ok(config) => config,
+        Err(e) => {
+            eprintln!("{}", e);
+            return;
+        }
+    };
+
+    // A per-core server builds a runtime on each core; the main thread
+    // only waits for them.
+    let runtime = match build_runtime(&config.runtime, config.per_core) {
+        Ok(runtime) => runtime,
+        Err(e) => {
+            eprintln!("Cannot start runtime: {}", e);
+            return;
+        }
+    };
+
     match args[1].as_str() {
         "server" => {
             println!("Starting server...");
-            if let Err(e) = server::start_server() {
+            if let Err(e) = server::start_server(&config, &runtime) {
                 eprintln!("Server error: {}", e);
             }
         }
         "client" => {
             println!("Starting client...");
-            if let Err(e) = client::start_client() {
+            if let Err(e) = client::start_client(&config, &runtime) {
                 eprintln!("Client error: {}", e);
             }
         }
+        "push" => {
+            println!("Starting push...");
+            if let Err(e) = server::start_push(&config, &runtime) {
+                eprintln!("Push error: {}", e);
+            }
+        }
+        "relay" => {
+            println!("Starting relay...");
+            if let Err(e) = client::start_relay(&config, &runtime) {
+                eprintln!("Relay error: {}", e);
+            }
+        }
+        "bench" => {
+            if let Err(e) = bench::run(&config, &runtime) {
+                eprintln!("Bench error: {}", e);
+            }
+        }
         _ => {
-            eprintln!("Invalid argument. Use 'server' or 'client'.");
+            eprintln!("Invalid argument. Use 'server', 'client', 'push', 'relay' or 'bench'.");
         }
     }
 }
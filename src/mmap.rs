@@ -0,0 +1,69 @@
+use std::fs::File;
+use std::io;
+use std::ops::Deref;
+use std::os::unix::io::AsRawFd;
+use std::ptr;
+use std::slice;
+
+// Read-only shared mapping of a whole file. Pages are faulted in on first
+// access, so opening a large file costs nothing up front.
+pub struct Mmap {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+// The mapping is read-only and owned, so it can be shared across threads.
+unsafe impl Send for Mmap {}
+unsafe impl Sync for Mmap {}
+
+impl Mmap {
+    pub fn empty() -> Mmap {
+        Mmap {
+            ptr: ptr::null_mut(),
+            len: 0,
+        }
+    }
+
+    pub fn open(file: &File) -> io::Result<Mmap> {
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Ok(Mmap::empty());
+        }
+
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Mmap { ptr, len })
+    }
+}
+
+impl Deref for Mmap {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        if self.len == 0 {
+            return &[];
+        }
+        unsafe { slice::from_raw_parts(self.ptr as *const u8, self.len) }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        if self.len != 0 {
+            unsafe {
+                libc::munmap(self.ptr, self.len);
+            }
+        }
+    }
+}
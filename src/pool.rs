@@ -0,0 +1,108 @@
+use std::collections::VecDeque;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Condvar, Mutex, MutexGuard};
+use std::thread;
+use std::time::Duration;
+
+// Runs `tasks`, and every task they spawn, on `threads` scoped workers.
+// Each worker pops from the back of its own deque and, once that is empty,
+// steals from the front of the others, so a deep directory or a huge file
+// found by one worker is quickly spread over all of them.
+pub fn run<T, F>(threads: usize, tasks: Vec<T>, work: F)
+where
+    T: Send,
+    F: Fn(T, &Spawner<T>) + Sync,
+{
+    let threads = threads.max(1);
+    let queues: Vec<Mutex<VecDeque<T>>> =
+        (0..threads).map(|_| Mutex::new(VecDeque::new())).collect();
+    let pending = AtomicUsize::new(tasks.len());
+    for (i, task) in tasks.into_iter().enumerate() {
+        queues[i % threads].lock().unwrap().push_back(task);
+    }
+
+    thread::scope(|scope| {
+        for id in 0..threads {
+            let spawner = Spawner {
+                queues: &queues,
+                pending: &pending,
+                id,
+            };
+            let work = &work;
+            scope.spawn(move || {
+                while let Some(task) = spawner.next() {
+                    work(task, &spawner);
+                    spawner.pending.fetch_sub(1, Ordering::AcqRel);
+                }
+            });
+        }
+    });
+}
+
+pub struct Spawner<'a, T> {
+    queues: &'a [Mutex<VecDeque<T>>],
+    // Tasks queued or running; a task's children are counted before it
+    // finishes, so zero means all work is done.
+    pending: &'a AtomicUsize,
+    id: usize,
+}
+
+impl<T> Spawner<'_, T> {
+    pub fn spawn(&self, task: T) {
+        self.pending.fetch_add(1, Ordering::AcqRel);
+        self.queues[self.id].lock().unwrap().push_back(task);
+    }
+
+    fn next(&self) -> Option<T> {
+        loop {
+            if let Some(task) = self.queues[self.id].lock().unwrap().pop_back() {
+                return Some(task);
+            }
+            for offset in 1..self.queues.len() {
+                let victim = (self.id + offset) % self.queues.len();
+                if let Some(task) = self.queues[victim].lock().unwrap().pop_front() {
+                    return Some(task);
+                }
+            }
+            if self.pending.load(Ordering::Acquire) == 0 {
+                return None;
+            }
+            thread::sleep(Duration::from_micros(100));
+        }
+    }
+}
+
+// Counting semaphore for blocking threads.
+pub struct Semaphore {
+    permits: Mutex<usize>,
+    released: Condvar,
+}
+
+pub struct Permit<'a> {
+    semaphore: &'a Semaphore,
+}
+
+impl Semaphore {
+    pub fn new(permits: usize) -> Self {
+        Semaphore {
+            permits: Mutex::new(permits.max(1)),
+            released: Condvar::new(),
+        }
+    }
+
+    pub fn acquire(&self) -> Permit<'_> {
+        let mut permits: MutexGuard<usize> = self.permits.lock().unwrap();
+        while *permits == 0 {
+            permits = self.released.wait(permits).unwrap();
+        }
+        *permits -= 1;
+        Permit { semaphore: self }
+    }
+}
+
+impl Drop for Permit<'_> {
+    fn drop(&mut self) {
+        *self.semaphore.permits.lock().unwrap() += 1;
+        self.semaphore.released.notify_one();
+    }
+}
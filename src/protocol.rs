@@ -0,0 +1,131 @@
+use crate::arena::Arena;
+use std::io;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+pub const MAGIC: u32 = 0x5045_4e54; // "PENT"
+
+pub const FEATURE_ZSTD: u32 = 1 << 0;
+// The client stays connected for catalog updates after its transfer.
+pub const FEATURE_WATCH: u32 = 1 << 1;
+// The client asks for erasure-coded shards instead of sending signatures.
+pub const FEATURE_ERASURE: u32 = 1 << 2;
+// The client fetches byte ranges, one request after another, instead.
+pub const FEATURE_RANGES: u32 = 1 << 3;
+// The client only asks for the server's content summary, then hangs up.
+pub const FEATURE_SUMMARY: u32 = 1 << 4;
+// Full transfers send only the data extents of a sparse file; holes are
+// recreated by the client.
+pub const FEATURE_SPARSE: u32 = 1 << 5;
+// The client asks for a directory, sent as bundles of many files.
+pub const FEATURE_BUNDLE: u32 = 1 << 6;
+// The client walks the server's directory hashes to find what changed.
+pub const FEATURE_TREE: u32 = 1 << 7;
+// A full transfer starts with the file's piece hashes, and the client
+// answers with the pieces its store lacks; only those are sent.
+pub const FEATURE_PIECES: u32 = 1 << 8;
+
+// The client offers a feature mask and the server answers with the subset it
+// is willing to use for this transfer.
+pub async fn client_handshake<S: AsyncRead + AsyncWrite + Unpin>(
+    socket: &mut S,
+    offered: u32,
+) -> io::Result<u32> {
+    let mut hello = [0u8; 8];
+    hello[..4].copy_from_slice(&MAGIC.to_be_bytes());
+    hello[4..].copy_from_slice(&offered.to_be_bytes());
+    socket.write_all(&hello).await?;
+
+    let accepted = socket.read_u32().await?;
+    if accepted & !offered != 0 {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "server enabled a feature that was not offered",
+        ));
+    }
+    Ok(accepted)
+}
+
+pub async fn server_handshake<S: AsyncRead + AsyncWrite + Unpin>(
+    socket: &mut S,
+    supported: u32,
+) -> io::Result<u32> {
+    if socket.read_u32().await? != MAGIC {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "peer is not speaking the peernet protocol",
+        ));
+    }
+    let accepted = socket.read_u32().await? & supported;
+    socket.write_u32(accepted).await?;
+    Ok(accepted)
+}
+
+const UPDATE_REMOVED: u8 = 0;
+const UPDATE_PRESENT: u8 = 1;
+
+// A change to the server's catalog, pushed to peers that negotiated
+// FEATURE_WATCH once their transfer has completed.
+#[derive(Clone, Debug)]
+pub struct CatalogUpdate {
+    pub path: String,
+    pub file: Option<(u64, u128)>,
+}
+
+// Not flushed, so a burst of updates can share one send.
+pub async fn write_update<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    update: &CatalogUpdate,
+) -> io::Result<()> {
+    let path = update.path.as_bytes();
+    let len = u16::try_from(path.len())
+        .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "path too long"))?;
+
+    let mut buf = Vec::with_capacity(3 + path.len() + 24);
+    match update.file {
+        Some((size, root)) => {
+            buf.push(UPDATE_PRESENT);
+            buf.extend_from_slice(&len.to_be_bytes());
+            buf.extend_from_slice(path);
+            buf.extend_from_slice(&size.to_be_bytes());
+            buf.extend_from_slice(&root.to_be_bytes());
+        }
+        None => {
+            buf.push(UPDATE_REMOVED);
+            buf.extend_from_slice(&len.to_be_bytes());
+            buf.extend_from_slice(path);
+        }
+    }
+    writer.write_all(&buf).await
+}
+
+// A catalog update as decoded, borrowing its path from the connection's
+// arena until the next frame is read.
+pub struct UpdateRef<'a> {
+    pub path: &'a str,
+    pub file: Option<(u64, u128)>,
+}
+
+pub async fn read_update<'a, R: AsyncRead + Unpin>(
+    reader: &mut R,
+    arena: &'a mut Arena,
+) -> io::Result<UpdateRef<'a>> {
+    arena.reset();
+    let kind = reader.read_u8().await?;
+    let len = reader.read_u16().await? as usize;
+    let path = arena.read(reader, len).await?;
+
+    let file = match kind {
+        UPDATE_PRESENT => Some((reader.read_u64().await?, reader.read_u128().await?)),
+        UPDATE_REMOVED => None,
+        _ => {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "bad update kind",
+            ))
+        }
+    };
+    Ok(UpdateRef {
+        path: arena.str(path)?,
+        file,
+    })
+}
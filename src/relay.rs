@@ -0,0 +1,212 @@
+use crate::arena::{Arena, Span};
+use crate::buffers::Buffer;
+use crate::sockopt::SocketOptions;
+use std::io;
+use std::sync::Arc;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+use tokio::sync::mpsc;
+use tokio::task::JoinHandle;
+
+pub const RELAY_MAGIC: u32 = 0x5045_5259; // "PERY"
+
+// Bytes read and forwarded at a time; this is the per-hop pipeline delay.
+pub const RELAY_CHUNK: usize = 128 * 1024;
+
+// Chunks buffered per child before the slowest child holds up the sender.
+const CHILD_QUEUE: usize = 32;
+
+// A push announces the artifact and the peers that the receiver is
+// responsible for; the receiver splits that list among its own children.
+// A received header borrows its strings from the arena it was read into.
+pub struct Header<'a> {
+    pub name: &'a str,
+    pub size: u64,
+    pub peers: Vec<&'a str>,
+}
+
+fn put_str(buf: &mut Vec<u8>, value: &str) -> io::Result<()> {
+    let len = u16::try_from(value.len())
+        .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "string too long"))?;
+    buf.extend_from_slice(&len.to_be_bytes());
+    buf.extend_from_slice(value.as_bytes());
+    Ok(())
+}
+
+async fn get_str<R: AsyncRead + Unpin>(reader: &mut R, arena: &mut Arena) -> io::Result<Span> {
+    let len = reader.read_u16().await? as usize;
+    let value = arena.read(reader, len).await?;
+    arena.str(value)?;
+    Ok(value)
+}
+
+pub async fn write_header<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    header: &Header<'_>,
+) -> io::Result<()> {
+    let mut buf = Vec::new();
+    buf.extend_from_slice(&RELAY_MAGIC.to_be_bytes());
+    put_str(&mut buf, header.name)?;
+    buf.extend_from_slice(&header.size.to_be_bytes());
+    buf.extend_from_slice(&(header.peers.len() as u32).to_be_bytes());
+    for peer in &header.peers {
+        put_str(&mut buf, peer)?;
+    }
+    writer.write_all(&buf).await
+}
+
+pub async fn read_header<'a, R: AsyncRead + Unpin>(
+    reader: &mut R,
+    arena: &'a mut Arena,
+) -> io::Result<Header<'a>> {
+    arena.reset();
+    if reader.read_u32().await? != RELAY_MAGIC {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "peer is not pushing a relay stream",
+        ));
+    }
+    let name = get_str(reader, arena).await?;
+    let size = reader.read_u64().await?;
+    let count = reader.read_u32().await?;
+    let mut peers = Vec::new();
+    for _ in 0..count {
+        peers.push(get_str(reader, arena).await?);
+    }
+
+    let arena = &*arena;
+    let name = arena.str(name)?;
+    if name.contains('/') || name.starts_with('.') {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "bad artifact name",
+        ));
+    }
+    Ok(Header {
+        name,
+        size,
+        peers: peers
+            .into_iter()
+            .map(|peer| arena.str(peer))
+            .collect::<io::Result<_>>()?,
+    })
+}
+
+// Splits `peers` into at most `fanout` contiguous groups. The first peer of
+// each group is a direct child and relays to the rest, so the tree is
+// log_fanout(n) hops deep; a fanout of 1 builds a chain.
+pub fn split_tree<'a, 'b>(peers: &'a [&'b str], fanout: usize) -> Vec<&'a [&'b str]> {
+    if peers.is_empty() {
+        return Vec::new();
+    }
+    let fanout = fanout.clamp(1, peers.len());
+    let group = peers.len().div_ceil(fanout);
+    peers.chunks(group).collect()
+}
+
+struct Child {
+    chunks: mpsc::Sender<Arc<Buffer>>,
+    task: JoinHandle<io::Result<u32>>,
+}
+
+// The children a node forwards to. Each child is fed by its own task from a
+// bounded queue, so a chunk is passed on as soon as it has been received.
+pub struct Fanout {
+    children: Vec<Child>,
+}
+
+impl Fanout {
+    pub async fn connect(
+        name: &str,
+        size: u64,
+        peers: &[&str],
+        fanout: usize,
+        options: &SocketOptions,
+    ) -> Fanout {
+        let mut children = Vec::new();
+        for group in split_tree(peers, fanout) {
+            if let Some(child) = Self::connect_group(name, size, group, options).await {
+                children.push(child);
+            }
+        }
+        Fanout { children }
+    }
+
+    // Connects to the head of `group`; if it is unreachable the next peer
+    // takes its place so the rest of the subtree is still served.
+    async fn connect_group(
+        name: &str,
+        size: u64,
+        group: &[&str],
+        options: &SocketOptions,
+    ) -> Option<Child> {
+        for (i, &peer) in group.iter().enumerate() {
+            let mut socket = match options.connect(peer).await {
+                Ok(socket) => socket,
+                Err(e) => {
+                    eprintln!("Cannot reach {}: {}", peer, e);
+                    continue;
+                }
+            };
+            let header = Header {
+                name,
+                size,
+                peers: group[i + 1..].to_vec(),
+            };
+            if let Err(e) = write_header(&mut socket, &header).await {
+                eprintln!("Cannot push to {}: {}", peer, e);
+                continue;
+            }
+
+            let (chunks, mut queue) = mpsc::channel::<Arc<Buffer>>(CHILD_QUEUE);
+            let peer = peer.to_string();
+            let task = tokio::spawn(async move {
+                while let Some(chunk) = queue.recv().await {
+                    socket.write_all(&chunk).await?;
+                }
+                let delivered = socket.read_u32().await?;
+                println!("{} reports {} peers delivered", peer, delivered);
+                Ok(delivered)
+            });
+            return Some(Child { chunks, task });
+        }
+        None
+    }
+
+    pub async fn forward(&mut self, chunk: Arc<Buffer>) {
+        let mut i = 0;
+        while i < self.children.len() {
+            if self.children[i].chunks.send(chunk.clone()).await.is_ok() {
+                i += 1;
+                continue;
+            }
+            // The child's task ended early; collect its error and drop it.
+            let child = self.children.swap_remove(i);
+            match child.task.await {
+                Ok(Err(e)) => eprintln!("Relay child failed: {}", e),
+                Err(e) => eprintln!("Relay child failed: {}", e),
+                Ok(Ok(_)) => {}
+            }
+        }
+    }
+
+    // Closes every child stream and returns how many peers below this node
+    // received the artifact.
+    pub async fn finish(self) -> u32 {
+        let (queues, tasks): (Vec<_>, Vec<_>) = self
+            .children
+            .into_iter()
+            .map(|child| (child.chunks, child.task))
+            .unzip();
+        drop(queues);
+
+        let mut delivered = 0;
+        for task in tasks {
+            match task.await {
+                Ok(Ok(count)) => delivered += count,
+                Ok(Err(e)) => eprintln!("Relay child failed: {}", e),
+                Err(e) => eprintln!("Relay child failed: {}", e),
+            }
+        }
+        delivered
+    }
+}
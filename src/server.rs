@@ -1,31 +1,720 @@
-use std::fs;
-use std::path::Path;
-use tokio::io::AsyncWriteExt;
-use tokio::net::TcpListener;
-
-pub fn start_server() -> std::io::Result<()> {
-    tokio::runtime::Runtime::new()?.block_on(async {
-        let listener = TcpListener::bind("127.0.0.1:8080").await?;
-        println!("Server is listening on 127.0.0.1:8080");
-
-        loop {
-            let (mut socket, _) = listener.accept().await?;
-            println!("Client connected!");
-
-            let file_path = Path::new("example.txt");
-            if file_path.exists() {
-                println!("Sending file: example.txt");
-
-                let file_content = fs::read(file_path)?;
-                let file_size = file_content.len() as u32;
-
-                socket.write_u32(file_size).await?;
-                socket.write_all(&file_content).await?;
-                println!("File sent successfully!");
+use crate::arena::Arena;
+use crate::bloom;
+use crate::buffers::{Buffer, MAX_BUFFER};
+use crate::bundle::{self, Bundle};
+use crate::catalog::Catalog;
+use crate::compress::{self, ChunkCache, Encoder};
+use crate::config::Config;
+use crate::cores;
+use crate::delta;
+use crate::erasure::{self, Codec};
+use crate::frame::FrameWriter;
+use crate::index::{ShareIndex, PIECE_SIZE};
+use crate::mmap::Mmap;
+use crate::protocol::{self, CatalogUpdate};
+use crate::relay::{self, Fanout};
+use crate::sparse;
+use crate::stripe;
+use crate::transport::{BoxStream, Kind, Listener};
+use crate::tree;
+use crate::watch::{self, Watcher};
+use std::collections::BTreeSet;
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+use std::path::PathBuf;
+use std::sync::{mpsc, Arc};
+use std::time::Instant;
+use tokio::io::{AsyncReadExt, AsyncWriteExt, BufReader};
+use tokio::runtime::Runtime;
+use tokio::sync::broadcast;
+use tokio::task::JoinSet;
+use xxhash_rust::xxh3::Xxh3Default;
+
+struct Shared {
+    share: PathBuf,
+    supported: u32,
+    cache: Arc<ChunkCache>,
+    catalog: Arc<Catalog>,
+    updates: broadcast::Sender<CatalogUpdate>,
+    cork: bool,
+}
+
+pub fn start_server(config: &Config, runtime: &Runtime) -> std::io::Result<()> {
+    if config.per_core {
+        return start_per_core(config);
+    }
+    runtime.block_on(async {
+        let listeners = config
+            .transport()
+            .bind_many(&config.listen, config.listeners)
+            .await?;
+        println!(
+            "Server is listening on {} ({} listeners)",
+            config.listen,
+            listeners.len()
+        );
+        serve(listeners, config).await
+    })
+}
+
+// The catalog of the share and the feed of changes to it. Built once per
+// process, however many runtimes serve it.
+#[derive(Clone)]
+pub struct Published {
+    catalog: Arc<Catalog>,
+    updates: broadcast::Sender<CatalogUpdate>,
+}
+
+impl Published {
+    // Serves right away from an empty catalog; the initial scan runs on its
+    // own thread and its results are published like any update.
+    pub fn open(config: &Config) -> std::io::Result<Published> {
+        let mut watcher = Watcher::new(&config.share)?;
+        let catalog = Arc::new(Catalog::new(Arc::new(ShareIndex::empty())));
+        let (updates, _) = broadcast::channel(1024);
+        let share = config.share.clone();
+        let options = config.index_options();
+        let (indexed_catalog, indexed_updates) = (catalog.clone(), updates.clone());
+        std::thread::Builder::new()
+            .name("peernet-index".to_string())
+            .spawn(move || {
+                // Watches go in before the scan so nothing changing during
+                // it is missed, but off the main thread, which is already
+                // accepting clients.
+                let watching = watcher.watch_share(options.threads);
+                if let Err(e) = &watching {
+                    eprintln!("Cannot watch share: {}", e);
+                }
+                let start = Instant::now();
+                let (index, stats) = match ShareIndex::open(&share, &options) {
+                    Ok(result) => result,
+                    Err(e) => {
+                        eprintln!("Indexing failed: {}", e);
+                        return;
+                    }
+                };
+                println!(
+                    "Indexed {} files ({} rehashed, {} chunks precompressed) in {:?}",
+                    stats.files,
+                    stats.rehashed,
+                    stats.precompressed,
+                    start.elapsed()
+                );
+                for (path, info) in indexed_catalog.rebase(Arc::new(index)) {
+                    watch::publish(&indexed_updates, path, info);
+                }
+                println!("Published catalog version {}", indexed_catalog.version());
+                if watching.is_err() {
+                    return;
+                }
+                if let Err(e) = watcher.spawn(indexed_catalog, indexed_updates, options) {
+                    eprintln!("Cannot watch share: {}", e);
+                }
+            })?;
+        Ok(Published { catalog, updates })
+    }
+
+    // A catalog that never changes, served without indexing or watching the
+    // share, so nothing runs once the server is dropped.
+    pub fn fixed(catalog: Arc<Catalog>) -> Published {
+        let (updates, _) = broadcast::channel(1);
+        Published { catalog, updates }
+    }
+}
+
+// Thread-per-core mode: one single-threaded runtime pinned to each allowed
+// CPU, each with its own SO_REUSEPORT listener and chunk cache. The kernel
+// spreads connections over the listeners and a connection never leaves the
+// core that accepted it, so the data path shares nothing but the catalog.
+fn start_per_core(config: &Config) -> std::io::Result<()> {
+    let per_core = PerCore::spawn(config, Published::open(config)?)?;
+    println!(
+        "Server is listening on {} (one runtime on each of {} cores)",
+        config.listen,
+        per_core.threads.len()
+    );
+    per_core.wait()
+}
+
+// The pinned runtime threads of a thread-per-core server. Dropping it stops
+// and joins them.
+pub struct PerCore {
+    stop: tokio::sync::watch::Sender<bool>,
+    // Ok once per core when its listener is bound, then an error if its
+    // runtime fails.
+    events: mpsc::Receiver<std::io::Result<()>>,
+    threads: Vec<std::thread::JoinHandle<()>>,
+}
+
+impl PerCore {
+    // Starts a runtime on every allowed core and returns once all of them
+    // are listening on config.listen.
+    pub fn spawn(config: &Config, published: Published) -> std::io::Result<PerCore> {
+        if config.transport != Kind::Tcp {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::Unsupported,
+                "thread-per-core mode needs the TCP transport",
+            ));
+        }
+        let cores = cores::allowed()?;
+        let (stop, stopped) = tokio::sync::watch::channel(false);
+        let (sender, events) = mpsc::channel();
+        let mut per_core = PerCore {
+            stop,
+            events,
+            threads: Vec::new(),
+        };
+        for &cpu in &cores {
+            let (config, published) = (config.clone(), published.clone());
+            let (events, mut stopped) = (sender.clone(), stopped.clone());
+            per_core.threads.push(
+                std::thread::Builder::new()
+                    .name(format!("peernet-core-{}", cpu))
+                    .spawn(move || {
+                        let result = cores::pin(cpu).and_then(|()| {
+                            crate::build_runtime(&config.runtime, true)?.block_on(async {
+                                let listeners =
+                                    config.transport().bind_many(&config.listen, 1).await?;
+                                let _ = events.send(Ok(()));
+                                tokio::select! {
+                                    served = serve_published(listeners, &config, published) => served,
+                                    _ = stopped.changed() => Ok(()),
+                                }
+                            })
+                        });
+                        if let Err(e) = result {
+                            let _ = events.send(Err(e));
+                        }
+                    })?,
+            );
+        }
+        for _ in &cores {
+            per_core.events.recv().unwrap_or(Ok(()))?;
+        }
+        Ok(per_core)
+    }
+
+    // Runtimes only return on error; the first one takes the server down.
+    pub fn wait(&self) -> std::io::Result<()> {
+        self.events.recv().unwrap_or(Ok(()))
+    }
+}
+
+impl Drop for PerCore {
+    fn drop(&mut self) {
+        let _ = self.stop.send(true);
+        for thread in self.threads.drain(..) {
+            let _ = thread.join();
+        }
+    }
+}
+
+pub async fn serve(listeners: Vec<Box<dyn Listener>>, config: &Config) -> std::io::Result<()> {
+    serve_published(listeners, config, Published::open(config)?).await
+}
+
+pub async fn serve_published(
+    listeners: Vec<Box<dyn Listener>>,
+    config: &Config,
+    published: Published,
+) -> std::io::Result<()> {
+    let mut supported = protocol::FEATURE_WATCH
+        | protocol::FEATURE_ERASURE
+        | protocol::FEATURE_RANGES
+        | protocol::FEATURE_SUMMARY
+        | protocol::FEATURE_SPARSE
+        | protocol::FEATURE_BUNDLE
+        | protocol::FEATURE_TREE
+        | protocol::FEATURE_PIECES;
+    if config.compress {
+        supported |= protocol::FEATURE_ZSTD;
+    }
+    let shared = Arc::new(Shared {
+        share: config.share.clone(),
+        supported,
+        cache: Arc::new(ChunkCache::new(
+            compress::DEFAULT_CACHE_CAPACITY,
+            Some(published.catalog.clone()),
+        )),
+        catalog: published.catalog,
+        updates: published.updates,
+        cork: config.socket.cork,
+    });
+
+    // One accept loop per listener, so the worker threads take turns
+    // accepting rather than all new connections passing through one task.
+    let mut accepting = JoinSet::new();
+    for listener in listeners {
+        accepting.spawn(accept_loop(listener, shared.clone()));
+    }
+    match accepting.join_next().await {
+        Some(Ok(result)) => result,
+        Some(Err(e)) => Err(std::io::Error::other(e)),
+        None => Ok(()),
+    }
+}
+
+async fn accept_loop(mut listener: Box<dyn Listener>, shared: Arc<Shared>) -> std::io::Result<()> {
+    loop {
+        let (socket, _) = listener.accept().await?;
+        println!("Client connected!");
+
+        let shared = shared.clone();
+        tokio::spawn(async move {
+            if let Err(e) = serve_client(socket, &shared).await {
+                eprintln!("Connection error: {}", e);
+            }
+        });
+    }
+}
+
+async fn serve_client(mut socket: BoxStream, shared: &Shared) -> std::io::Result<()> {
+    let features = protocol::server_handshake(&mut socket, shared.supported).await?;
+    if features & protocol::FEATURE_SUMMARY != 0 {
+        let snapshot = shared.catalog.snapshot();
+        return bloom::write_summary(&mut socket, &snapshot.summary).await;
+    }
+    if features & protocol::FEATURE_ERASURE != 0 {
+        return serve_shards(socket, shared).await;
+    }
+    // Subscribe before the transfer so no change made during it is lost.
+    let mut updates = (features & protocol::FEATURE_WATCH != 0).then(|| shared.updates.subscribe());
+    if features & protocol::FEATURE_TREE != 0 {
+        return serve_tree(socket, shared, updates).await;
+    }
+    let mut encoder = if features & protocol::FEATURE_ZSTD != 0 {
+        Encoder::zstd(shared.cache.clone())?
+    } else {
+        Encoder::plain()
+    };
+    if features & protocol::FEATURE_RANGES != 0 {
+        return serve_ranges(socket, shared, encoder).await;
+    }
+    if features & protocol::FEATURE_BUNDLE != 0 {
+        return serve_bundles(socket, shared, encoder).await;
+    }
+    let (block_size, signatures) = delta::read_signatures(&mut socket).await?;
+
+    let file_path = shared.share.join("example.txt");
+    if file_path.exists() {
+        println!("Sending file: example.txt");
+        if let Some(info) = shared.catalog.lookup("example.txt") {
+            println!(
+                "Merkle root: {:032x} ({} pieces)",
+                info.root, info.piece_count
+            );
+        }
+
+        let file = File::open(&file_path)?;
+        let file_size = file.metadata()?.len();
+
+        // The piece list goes out ahead of the cork, as the client has to
+        // answer it before anything else is sent.
+        let offered = block_size == 0 && features & protocol::FEATURE_PIECES != 0;
+        let wanted = if offered {
+            socket.write_u64(file_size).await?;
+            offer_pieces(&mut socket, &shared.catalog, &file).await?
+        } else {
+            None
+        };
+
+        if shared.cork {
+            socket.set_cork(true)?;
+        }
+        let mut writer = FrameWriter::new(&mut socket);
+        if !offered {
+            writer.write_u64(file_size).await?;
+        }
+        if let Some((wanted, count)) = wanted {
+            println!(
+                "Sending {} of {} pieces, the rest are in the client's store",
+                wanted.len(),
+                count
+            );
+            for piece in wanted {
+                let offset = (piece * PIECE_SIZE) as u64;
+                let mut chunk = Buffer::take((file_size - offset).min(PIECE_SIZE as u64) as usize);
+                file.read_exact_at(&mut chunk, offset)?;
+                encoder.write_payload(&mut writer, &chunk).await?;
+            }
+        } else if block_size == 0 {
+            // Streamed through pooled buffers, extent by extent. Their size
+            // is a multiple of the compression chunk, so the framing of each
+            // extent is as for one payload.
+            let sparse = features & protocol::FEATURE_SPARSE != 0;
+            let extents = if sparse {
+                sparse::data_extents(&file, file_size, PIECE_SIZE as u64)?
             } else {
-                eprintln!("File not found: example.txt");
-                socket.write_u32(0).await?;
+                vec![0..file_size]
+            };
+            let data: u64 = extents.iter().map(|extent| extent.end - extent.start).sum();
+            if data < file_size {
+                println!(
+                    "Sending {} data extents, {} of {} bytes",
+                    extents.len(),
+                    data,
+                    file_size
+                );
+            }
+            for extent in &extents {
+                if sparse {
+                    sparse::write_extent(&mut writer, extent).await?;
+                }
+                let mut offset = extent.start;
+                while offset < extent.end {
+                    let len = (extent.end - offset).min(MAX_BUFFER as u64) as usize;
+                    let mut chunk = Buffer::take(len);
+                    file.read_exact_at(&mut chunk, offset)?;
+                    encoder.write_payload(&mut writer, &chunk).await?;
+                    offset += len as u64;
+                }
+            }
+            if sparse {
+                sparse::write_end(&mut writer).await?;
+            }
+        } else {
+            // Mapped rather than read, so a large file is paged in as the
+            // delta is searched instead of held whole, and searched off the
+            // runtime's threads.
+            let map = Arc::new(Mmap::open(&file)?);
+            if map.len() as u64 != file_size {
+                return Err(std::io::Error::new(
+                    std::io::ErrorKind::InvalidData,
+                    "example.txt changed while it was being sent",
+                ));
+            }
+            let source = map.clone();
+            let ops =
+                tokio::task::spawn_blocking(move || delta::delta(&source, block_size, &signatures))
+                    .await?;
+            let literal: usize = ops
+                .iter()
+                .map(|op| match op {
+                    delta::Op::Literal(range) => range.len(),
+                    delta::Op::Copy { .. } => 0,
+                })
+                .sum();
+            println!(
+                "Sending delta: {} instructions, {} literal bytes",
+                ops.len(),
+                literal
+            );
+            delta::write_delta(&mut writer, &map, &ops, &mut encoder).await?;
+        }
+        writer.flush().await?;
+        if shared.cork {
+            socket.set_cork(false)?;
+        }
+        if encoder.is_compressed() {
+            let (raw, wire) = encoder.stats();
+            println!("Compressed {} bytes to {} bytes", raw, wire);
+        }
+        println!("File sent successfully!");
+    } else {
+        eprintln!("File not found: example.txt");
+        socket.write_u64(0).await?;
+    }
+
+    let Some(updates) = &mut updates else {
+        return Ok(());
+    };
+    let (mut reader, writer) = tokio::io::split(socket);
+    let mut writer = FrameWriter::new(writer);
+    let mut probe = [0u8; 1];
+    loop {
+        tokio::select! {
+            // Watchers never send after the handshake, so any read
+            // completing means the peer went away.
+            _ = reader.read(&mut probe) => return Ok(()),
+            update = updates.recv() => match update {
+                Ok(update) => {
+                    // A burst of changes, such as a directory being
+                    // unpacked, goes out in one send.
+                    protocol::write_update(&mut writer, &update).await?;
+                    while let Ok(update) = updates.try_recv() {
+                        protocol::write_update(&mut writer, &update).await?;
+                    }
+                    writer.flush().await?;
+                }
+                Err(broadcast::error::RecvError::Lagged(missed)) => {
+                    eprintln!("Peer fell behind, dropped {} catalog updates", missed);
+                }
+                Err(broadcast::error::RecvError::Closed) => return Ok(()),
+            },
+        }
+    }
+}
+
+// Lists the piece hashes of example.txt to a client with a store, then
+// reads back a bit per piece it wants, returning those pieces and how many
+// there are in all. With no hashes for the file as it is on disk now, the
+// list is empty and None tells the caller to send the whole file instead.
+async fn offer_pieces(
+    socket: &mut BoxStream,
+    catalog: &Catalog,
+    file: &File,
+) -> std::io::Result<Option<(Vec<usize>, usize)>> {
+    let meta = file.metadata()?;
+    let Some(indexed) = catalog
+        .pieces("example.txt")
+        .filter(|indexed| indexed.info.matches(&meta) && !indexed.pieces.is_empty())
+    else {
+        socket.write_u32(0).await?;
+        return Ok(None);
+    };
+    let count = indexed.pieces.len();
+    let mut list = Vec::with_capacity(4 + count * 16);
+    list.extend_from_slice(&(count as u32).to_be_bytes());
+    for hash in indexed.pieces.iter() {
+        list.extend_from_slice(&hash.to_be_bytes());
+    }
+    socket.write_all(&list).await?;
+    socket.flush().await?;
+
+    let mut bits = vec![0; count.div_ceil(8)];
+    socket.read_exact(&mut bits).await?;
+    let wanted = (0..count)
+        .filter(|&piece| bits[piece / 8] & 1 << (piece % 8) != 0)
+        .collect();
+    Ok(Some((wanted, count)))
+}
+
+// Serves one source's share of a multi-source download: the shards it was
+// asked for from every piece group of example.txt.
+async fn serve_shards(mut socket: BoxStream, shared: &Shared) -> std::io::Result<()> {
+    let request = erasure::read_request(&mut socket).await?;
+    let codec = Codec::new(request.data as usize, request.parity as usize)?;
+
+    let path = if request.root == 0 {
+        "example.txt".to_string()
+    } else {
+        match shared.catalog.find(request.root) {
+            Some(path) => path,
+            None => {
+                eprintln!("No file with root {:032x}", request.root);
+                return socket.write_u64(0).await;
             }
         }
+    };
+    let file = match File::open(shared.share.join(&path)) {
+        Ok(file) => file,
+        Err(e) if e.kind() == std::io::ErrorKind::NotFound => {
+            eprintln!("File not found: {}", path);
+            return socket.write_u64(0).await;
+        }
+        Err(e) => return Err(e),
+    };
+    let size = file.metadata()?.len();
+    println!(
+        "Sending {} of {} shards per piece group of {}",
+        request.shards.len(),
+        codec.total_shards(),
+        path
+    );
+    let mut writer = FrameWriter::new(&mut socket);
+    writer.write_u64(size).await?;
+    erasure::write_shards(&mut writer, &codec, &file, size, &request.shards).await?;
+    println!("Shards sent successfully!");
+    Ok(())
+}
+
+// Serves the requested files and directories of the share, or all of it
+// for an empty path, as a stream of bundles: many files behind one
+// manifest, so small files cost a share of a large write each rather than
+// a round trip. Files too big for a bundle are streamed between them.
+async fn serve_bundles(
+    mut socket: BoxStream,
+    shared: &Shared,
+    mut encoder: Encoder,
+) -> std::io::Result<()> {
+    let mut arena = Arena::new();
+    let requested = bundle::read_request(&mut socket, &mut arena).await?;
+    // Listed from one snapshot, so a release published meanwhile is sent
+    // whole or not at all.
+    let snapshot = shared.catalog.snapshot();
+    let mut paths = BTreeSet::new();
+    for path in requested {
+        let path = arena.str(path)?.trim_end_matches('/');
+        if path.is_empty() {
+            paths.extend(snapshot.paths_under(""));
+        } else if snapshot.lookup(path).is_some() {
+            paths.insert(path.to_string());
+        } else {
+            paths.extend(snapshot.paths_under(&format!("{}/", path)));
+        }
+    }
+    drop(snapshot);
+    println!("Sending {} files in bundles", paths.len());
+
+    let mut writer = FrameWriter::new(&mut socket);
+    let mut bundle = Bundle::default();
+    for path in paths {
+        let opened = File::open(shared.share.join(&path))
+            .and_then(|file| Ok((file.metadata()?.len(), file)));
+        let (size, file) = match opened {
+            Ok(opened) => opened,
+            // Removed since it was listed; the watcher will catch up.
+            Err(e) => {
+                eprintln!("Not bundling {}: {}", path, e);
+                continue;
+            }
+        };
+        if size > bundle::BUNDLE_BYTES as u64 {
+            bundle::write_streamed(&mut writer, &path, &file, size, &mut encoder).await?;
+            continue;
+        }
+        // Exactly the size checked above, so a file growing meanwhile cannot
+        // push the bundle past what the client accepts.
+        let mut contents = vec![0; size as usize];
+        if let Err(e) = file.read_exact_at(&mut contents, 0) {
+            // Shrunk since it was opened; the watcher will catch up.
+            eprintln!("Not bundling {}: {}", path, e);
+            continue;
+        }
+        if !bundle.fits(contents.len()) {
+            bundle::write_bundle(&mut writer, &bundle, &mut encoder).await?;
+            bundle.clear();
+        }
+        bundle.push(&path, &contents);
+    }
+    if !bundle.is_empty() {
+        bundle::write_bundle(&mut writer, &bundle, &mut encoder).await?;
+    }
+    bundle::write_end(&mut writer).await?;
+    writer.flush().await
+}
+
+// Answers tree walks: the listing of each directory the client asks for,
+// from one snapshot of the tree so a walk sees a consistent share. A
+// level's worth of requests arrives together and is answered in one send.
+// A watching client asks to wait between walks, and is answered once
+// there is a newer snapshot to list the next walk from.
+async fn serve_tree(
+    socket: BoxStream,
+    shared: &Shared,
+    mut updates: Option<broadcast::Receiver<CatalogUpdate>>,
+) -> std::io::Result<()> {
+    let mut snapshot = shared.catalog.snapshot();
+    let (reader, writer) = tokio::io::split(socket);
+    let mut reader = BufReader::new(reader);
+    let mut writer = FrameWriter::new(writer);
+    let mut arena = Arena::new();
+    while let Some(request) = tree::read_request(&mut reader, &mut arena).await? {
+        let dir = match request {
+            tree::Request::Dir(dir) => dir,
+            tree::Request::Wait => {
+                let Some(updates) = &mut updates else {
+                    return Err(std::io::Error::new(
+                        std::io::ErrorKind::InvalidData,
+                        "wait on a connection that is not watching",
+                    ));
+                };
+                // A version is published before its updates are sent, so
+                // an update means the catalog has moved on.
+                let mut probe = [0u8; 1];
+                while shared.catalog.version() == snapshot.version {
+                    tokio::select! {
+                        // Nothing is sent while waiting, so any read
+                        // completing means the peer went away.
+                        _ = reader.read(&mut probe) => return Ok(()),
+                        update = updates.recv() => {
+                            if let Err(broadcast::error::RecvError::Closed) = update {
+                                return Ok(());
+                            }
+                        }
+                    }
+                }
+                snapshot = shared.catalog.snapshot();
+                writer.write_u8(0).await?;
+                writer.flush().await?;
+                continue;
+            }
+        };
+        tree::write_listing(&mut writer, snapshot.tree().dir(dir)).await?;
+        if reader.buffer().is_empty() {
+            writer.flush().await?;
+        }
+    }
+    Ok(())
+}
+
+// Serves one stripe of a striped download: (u64 offset, u32 length)
+// requests for example.txt, each answered with the file size and the range,
+// until the client hangs up.
+async fn serve_ranges(
+    mut socket: BoxStream,
+    shared: &Shared,
+    mut encoder: Encoder,
+) -> std::io::Result<()> {
+    let file = File::open(shared.share.join("example.txt")).ok();
+    println!("Serving byte ranges of example.txt");
+    loop {
+        let offset = match socket.read_u64().await {
+            Ok(offset) => offset,
+            Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => break,
+            Err(e) => return Err(e),
+        };
+        let len = socket.read_u32().await?.min(stripe::STRIPE_CHUNK) as u64;
+        let Some(file) = &file else {
+            socket.write_u64(0).await?;
+            continue;
+        };
+
+        let size = file.metadata()?.len();
+        let mut buf = Buffer::take(size.saturating_sub(offset).min(len) as usize);
+        file.read_exact_at(&mut buf, offset)?;
+        // Corked, the size and the first payload bytes share a segment
+        // even though the buffered writer may flush them separately.
+        if shared.cork {
+            socket.set_cork(true)?;
+        }
+        let mut writer = FrameWriter::new(&mut socket);
+        writer.write_u64(size).await?;
+        encoder.write_payload(&mut writer, &buf).await?;
+        writer.flush().await?;
+        if shared.cork {
+            socket.set_cork(false)?;
+        }
+    }
+    if encoder.is_compressed() {
+        let (raw, wire) = encoder.stats();
+        println!("Compressed {} bytes to {} bytes", raw, wire);
+    }
+    Ok(())
+}
+
+// Pushes example.txt down a relay tree built from --peers. Every relay
+// forwards each chunk as soon as it arrives, so the whole fleet finishes
+// about one transfer time plus one chunk per hop after the push starts.
+pub fn start_push(config: &Config, runtime: &Runtime) -> std::io::Result<()> {
+    runtime.block_on(async {
+        let file = File::open(config.share.join("example.txt"))?;
+        let size = file.metadata()?.len();
+        let start = Instant::now();
+
+        let peers: Vec<&str> = config.peers.iter().map(String::as_str).collect();
+        let mut children =
+            Fanout::connect("example.txt", size, &peers, config.fanout, &config.socket).await;
+        let mut hasher = Xxh3Default::new();
+        let mut offset = 0;
+        while offset < size {
+            let mut chunk = Buffer::take((size - offset).min(relay::RELAY_CHUNK as u64) as usize);
+            file.read_exact_at(&mut chunk, offset)?;
+            hasher.update(&chunk);
+            offset += chunk.len() as u64;
+            children.forward(Arc::new(chunk)).await;
+        }
+        let mut digest = Buffer::take(16);
+        digest.copy_from_slice(&hasher.digest128().to_be_bytes());
+        children.forward(Arc::new(digest)).await;
+
+        let delivered = children.finish().await;
+        println!(
+            "Delivered to {} of {} peers in {:?}",
+            delivered,
+            config.peers.len(),
+            start.elapsed()
+        );
+        Ok(())
     })
 }
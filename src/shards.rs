@@ -0,0 +1,77 @@
+use std::borrow::Borrow;
+use std::collections::HashMap;
+use std::hash::{BuildHasher, Hash};
+use std::sync::Arc;
+use xxhash_rust::xxh3::Xxh3DefaultBuilder;
+
+// Power of two, so a shard is picked with a mask.
+const SHARDS: usize = 64;
+
+type Shard<K, V> = HashMap<K, V, Xxh3DefaultBuilder>;
+
+// A hash map split into shards by key hash, each shared by every copy of
+// the map until one of them writes to it. Copying the map is a reference
+// count per shard, and a write copies only its own shard, so the next
+// catalog version costs the shards a batch touched rather than the whole
+// map. Copies are never written once published, so reading one takes no
+// lock at all.
+pub struct Sharded<K, V> {
+    shards: Vec<Arc<Shard<K, V>>>,
+}
+
+impl<K, V> Clone for Sharded<K, V> {
+    fn clone(&self) -> Self {
+        Sharded {
+            shards: self.shards.clone(),
+        }
+    }
+}
+
+// Bits 32 and up pick the shard: the low bits pick the bucket within it
+// and the top seven are the map's tag, so neither is left the same across
+// a shard.
+fn shard_of<Q: Hash + ?Sized>(key: &Q) -> usize {
+    (Xxh3DefaultBuilder.hash_one(key) >> 32) as usize & (SHARDS - 1)
+}
+
+impl<K: Hash + Eq + Clone, V: Clone> Sharded<K, V> {
+    pub fn new() -> Self {
+        Sharded {
+            shards: (0..SHARDS).map(|_| Arc::new(Shard::default())).collect(),
+        }
+    }
+
+    pub fn get<Q>(&self, key: &Q) -> Option<&V>
+    where
+        K: Borrow<Q>,
+        Q: Hash + Eq + ?Sized,
+    {
+        self.shards[shard_of(key)].get(key)
+    }
+
+    pub fn contains_key<Q>(&self, key: &Q) -> bool
+    where
+        K: Borrow<Q>,
+        Q: Hash + Eq + ?Sized,
+    {
+        self.get(key).is_some()
+    }
+
+    // The entry for `key` to write through, copying its shard first if any
+    // other copy of the map still shares it.
+    pub fn entry(&mut self, key: K) -> std::collections::hash_map::Entry<'_, K, V> {
+        Arc::make_mut(&mut self.shards[shard_of(&key)]).entry(key)
+    }
+
+    pub fn insert(&mut self, key: K, value: V) -> Option<V> {
+        Arc::make_mut(&mut self.shards[shard_of(&key)]).insert(key, value)
+    }
+
+    pub fn len(&self) -> usize {
+        self.shards.iter().map(|shard| shard.len()).sum()
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (&K, &V)> {
+        self.shards.iter().flat_map(|shard| shard.iter())
+    }
+}
@@ -0,0 +1,186 @@
+use std::io;
+use std::net::SocketAddr;
+use std::os::fd::{AsRawFd, RawFd};
+use std::time::Duration;
+use tokio::net::{TcpListener, TcpSocket, TcpStream, UdpSocket};
+
+// Options applied to every peer socket. Buffer sizes are set before connect
+// or listen, since the window scale is fixed at the handshake; note that an
+// explicit size also turns off the kernel's buffer autotuning.
+#[derive(Clone, Copy)]
+pub struct SocketOptions {
+    pub nodelay: bool,
+    pub send_buffer: Option<usize>,
+    pub recv_buffer: Option<usize>,
+    // Idle time before the first probe; dead peers are dropped after four
+    // more unanswered probes.
+    pub keepalive: Option<Duration>,
+    // Spin on the device queue this long before sleeping in a blocking
+    // receive. Trades CPU for latency; raising it needs CAP_NET_ADMIN.
+    pub busy_poll: Option<Duration>,
+    // Hold back partial segments while a response is written, so headers
+    // leave in the same segment as their payload.
+    pub cork: bool,
+}
+
+impl Default for SocketOptions {
+    fn default() -> Self {
+        // The protocol is request/response, so Nagle only adds latency.
+        SocketOptions {
+            nodelay: true,
+            send_buffer: None,
+            recv_buffer: None,
+            keepalive: Some(Duration::from_secs(60)),
+            busy_poll: None,
+            cork: false,
+        }
+    }
+}
+
+fn set(fd: RawFd, level: libc::c_int, name: libc::c_int, value: libc::c_int) -> io::Result<()> {
+    let rc = unsafe {
+        libc::setsockopt(
+            fd,
+            level,
+            name,
+            (&value as *const libc::c_int).cast(),
+            std::mem::size_of::<libc::c_int>() as libc::socklen_t,
+        )
+    };
+    if rc < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn clamp(value: usize) -> libc::c_int {
+    value.min(libc::c_int::MAX as usize) as libc::c_int
+}
+
+impl SocketOptions {
+    // Applied before a socket connects or listens.
+    fn apply_buffers(&self, fd: RawFd) -> io::Result<()> {
+        if let Some(size) = self.send_buffer {
+            set(fd, libc::SOL_SOCKET, libc::SO_SNDBUF, clamp(size))?;
+        }
+        if let Some(size) = self.recv_buffer {
+            set(fd, libc::SOL_SOCKET, libc::SO_RCVBUF, clamp(size))?;
+        }
+        Ok(())
+    }
+
+    fn apply_busy_poll(&self, fd: RawFd) -> io::Result<()> {
+        match self.busy_poll {
+            Some(busy_poll) => set(
+                fd,
+                libc::SOL_SOCKET,
+                libc::SO_BUSY_POLL,
+                clamp(busy_poll.as_micros() as usize),
+            ),
+            None => Ok(()),
+        }
+    }
+
+    // Options for a connected TCP socket.
+    pub fn apply(&self, socket: &TcpStream) -> io::Result<()> {
+        let fd = socket.as_raw_fd();
+        socket.set_nodelay(self.nodelay)?;
+        self.apply_busy_poll(fd)?;
+        if let Some(idle) = self.keepalive {
+            let idle = idle.as_secs().max(1);
+            set(fd, libc::SOL_SOCKET, libc::SO_KEEPALIVE, 1)?;
+            set(
+                fd,
+                libc::IPPROTO_TCP,
+                libc::TCP_KEEPIDLE,
+                clamp(idle as usize),
+            )?;
+            set(
+                fd,
+                libc::IPPROTO_TCP,
+                libc::TCP_KEEPINTVL,
+                clamp((idle as usize / 4).max(1)),
+            )?;
+            set(fd, libc::IPPROTO_TCP, libc::TCP_KEEPCNT, 4)?;
+        }
+        Ok(())
+    }
+
+    pub fn apply_udp(&self, socket: &UdpSocket) -> io::Result<()> {
+        self.apply_buffers(socket.as_raw_fd())?;
+        self.apply_busy_poll(socket.as_raw_fd())
+    }
+
+    fn socket_for(&self, addr: &SocketAddr) -> io::Result<TcpSocket> {
+        let socket = if addr.is_ipv4() {
+            TcpSocket::new_v4()?
+        } else {
+            TcpSocket::new_v6()?
+        };
+        self.apply_buffers(socket.as_raw_fd())?;
+        Ok(socket)
+    }
+
+    pub async fn connect(&self, addr: &str) -> io::Result<TcpStream> {
+        let mut last_error = None;
+        for addr in tokio::net::lookup_host(addr).await? {
+            match self.socket_for(&addr)?.connect(addr).await {
+                Ok(socket) => {
+                    self.apply(&socket)?;
+                    return Ok(socket);
+                }
+                Err(e) => last_error = Some(e),
+            }
+        }
+        Err(last_error.unwrap_or_else(|| {
+            io::Error::new(io::ErrorKind::InvalidInput, "no address to connect to")
+        }))
+    }
+
+    // Accepted sockets inherit the buffer sizes; call apply() on each for
+    // the rest.
+    pub async fn listen(&self, addr: &str) -> io::Result<TcpListener> {
+        let addr = resolve(addr).await?;
+        self.bind(addr, false)
+    }
+
+    // Opens `count` listeners on the same port with SO_REUSEPORT. The
+    // kernel hashes each new connection to one of them, so accepts are
+    // spread over whichever threads poll them instead of queuing on one
+    // socket.
+    pub async fn listen_many(&self, addr: &str, count: usize) -> io::Result<Vec<TcpListener>> {
+        let mut addr = resolve(addr).await?;
+        let mut listeners = Vec::with_capacity(count);
+        for _ in 0..count.max(1) {
+            let listener = self.bind(addr, true)?;
+            // With port 0 the rest must join the port the first one got.
+            addr = listener.local_addr()?;
+            listeners.push(listener);
+        }
+        Ok(listeners)
+    }
+
+    fn bind(&self, addr: SocketAddr, reuse_port: bool) -> io::Result<TcpListener> {
+        let socket = self.socket_for(&addr)?;
+        socket.set_reuseaddr(true)?;
+        socket.set_reuseport(reuse_port)?;
+        socket.bind(addr)?;
+        socket.listen(1024)
+    }
+}
+
+async fn resolve(addr: &str) -> io::Result<SocketAddr> {
+    tokio::net::lookup_host(addr)
+        .await?
+        .next()
+        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "no address to listen on"))
+}
+
+pub fn set_cork(socket: &TcpStream, corked: bool) -> io::Result<()> {
+    set(
+        socket.as_raw_fd(),
+        libc::IPPROTO_TCP,
+        libc::TCP_CORK,
+        corked as libc::c_int,
+    )
+}
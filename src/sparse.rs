@@ -0,0 +1,162 @@
+use std::fs::File;
+use std::io;
+use std::ops::Range;
+use std::os::unix::io::AsRawFd;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+fn seek(file: &File, offset: u64, whence: i32) -> io::Result<Option<u64>> {
+    let at = unsafe { libc::lseek(file.as_raw_fd(), offset as libc::off_t, whence) };
+    if at >= 0 {
+        return Ok(Some(at as u64));
+    }
+    let e = io::Error::last_os_error();
+    match e.raw_os_error() {
+        // No data at or after `offset`.
+        Some(libc::ENXIO) => Ok(None),
+        _ => Err(e),
+    }
+}
+
+// The ranges of `file` that hold data, found with SEEK_DATA/SEEK_HOLE and
+// widened to whole multiples of `granularity`, so the pieces on either side
+// of a hole keep the same boundaries as in a dense read. Everything else is
+// a hole. Filesystems without hole reporting present one extent covering
+// the whole file.
+pub fn data_extents(file: &File, size: u64, granularity: u64) -> io::Result<Vec<Range<u64>>> {
+    let mut extents: Vec<Range<u64>> = Vec::new();
+    let mut at = 0;
+    while at < size {
+        let Some(start) = seek(file, at, libc::SEEK_DATA)? else {
+            break;
+        };
+        let end = seek(file, start, libc::SEEK_HOLE)?
+            .unwrap_or(size)
+            .min(size);
+        let start = start / granularity * granularity;
+        let end = end.next_multiple_of(granularity).min(size);
+        match extents.last_mut() {
+            Some(last) if last.end >= start => last.end = last.end.max(end),
+            _ => extents.push(start..end),
+        }
+        at = end;
+    }
+    Ok(extents)
+}
+
+// Each extent goes out as (u64 offset, u64 length) ahead of its data; a
+// zero length ends the file.
+pub async fn write_extent<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    extent: &Range<u64>,
+) -> io::Result<()> {
+    let mut header = [0u8; 16];
+    header[..8].copy_from_slice(&extent.start.to_be_bytes());
+    header[8..].copy_from_slice(&(extent.end - extent.start).to_be_bytes());
+    writer.write_all(&header).await
+}
+
+pub async fn write_end<W: AsyncWrite + Unpin>(writer: &mut W) -> io::Result<()> {
+    writer.write_all(&[0u8; 16]).await
+}
+
+// Reads the next extent of a file of `size` bytes whose data so far ends
+// at `after`, or None at the end. Extents must come in order and fit.
+pub async fn read_extent<R: AsyncRead + Unpin>(
+    reader: &mut R,
+    after: u64,
+    size: u64,
+) -> io::Result<Option<Range<u64>>> {
+    let offset = reader.read_u64().await?;
+    let len = reader.read_u64().await?;
+    if len == 0 {
+        return Ok(None);
+    }
+    match offset.checked_add(len) {
+        Some(end) if offset >= after && end <= size => Ok(Some(offset..end)),
+        _ => Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "extent out of order or past the end of the file",
+        )),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::os::unix::fs::FileExt;
+
+    const GRANULARITY: u64 = 64 * 1024;
+
+    #[test]
+    fn extents_cover_the_data_in_whole_pieces() {
+        let path = std::env::temp_dir().join(format!("peernet-sparse-{}", std::process::id()));
+        let file = File::options()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(&path)
+            .unwrap();
+        let size = 64 << 20;
+        file.set_len(size).unwrap();
+        let written = [
+            (3 << 20) + 100..(3 << 20) + 5000,
+            (40 << 20) - 10..(40 << 20) + 10,
+            size - 1..size,
+        ];
+        for range in &written {
+            file.write_all_at(&vec![7; (range.end - range.start) as usize], range.start)
+                .unwrap();
+        }
+        let extents = data_extents(&file, size, GRANULARITY).unwrap();
+        std::fs::remove_file(&path).unwrap();
+
+        for range in &written {
+            assert!(
+                extents
+                    .iter()
+                    .any(|extent| extent.start <= range.start && range.end <= extent.end),
+                "{:?} not covered by {:?}",
+                range,
+                extents
+            );
+        }
+        for pair in extents.windows(2) {
+            assert!(pair[0].end < pair[1].start, "{:?}", extents);
+        }
+        for extent in &extents {
+            assert_eq!(extent.start % GRANULARITY, 0);
+            assert!(extent.end % GRANULARITY == 0 || extent.end == size);
+        }
+        // Where the filesystem reports holes, they stay out.
+        let data: u64 = extents.iter().map(|extent| extent.end - extent.start).sum();
+        if extents.len() > 1 {
+            assert!(data <= 8 * GRANULARITY, "{:?}", extents);
+        }
+    }
+
+    #[tokio::test]
+    async fn extents_read_back_in_order() {
+        let mut wire = Vec::new();
+        write_extent(&mut wire, &(0..10)).await.unwrap();
+        write_extent(&mut wire, &(100..250)).await.unwrap();
+        write_end(&mut wire).await.unwrap();
+        let mut reader = wire.as_slice();
+        assert_eq!(read_extent(&mut reader, 0, 300).await.unwrap(), Some(0..10));
+        assert_eq!(
+            read_extent(&mut reader, 10, 300).await.unwrap(),
+            Some(100..250)
+        );
+        assert_eq!(read_extent(&mut reader, 250, 300).await.unwrap(), None);
+
+        // Overlapping the previous extent, or running past the end.
+        for (extent, after) in [(5..20, 10), (290..310, 0)] {
+            let mut wire = Vec::new();
+            write_extent(&mut wire, &extent).await.unwrap();
+            let err = read_extent(&mut wire.as_slice(), after, 300)
+                .await
+                .unwrap_err();
+            assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+        }
+    }
+}
@@ -0,0 +1,447 @@
+use crate::index::{self, PIECE_SIZE};
+use std::collections::HashMap;
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, Write};
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+use std::sync::OnceLock;
+use xxhash_rust::xxh3::xxh3_128;
+
+// Pieces are appended to the current segment until it reaches this size.
+const SEGMENT_SIZE: u64 = 256 * 1024 * 1024;
+// Pieces start on a filesystem block, so each can be reflinked on its own.
+const ALIGN: u64 = 4096;
+const INDEX: &str = "index";
+const SEGMENTS: &str = "segments";
+
+// Index log layout, one record per stored piece, little endian like the
+// share index: xxh3-128 hash, segment, length, offset in the segment.
+const RECORD_LEN: usize = 32;
+
+#[derive(Clone, Copy)]
+struct Location {
+    segment: u32,
+    len: u32,
+    offset: u64,
+}
+
+// A content-addressed piece store. Downloaded files are split into the
+// share index's pieces, so the same piece in two files, or in two versions
+// of one, is kept once, and a file's piece hashes give the Merkle root the
+// server advertises. Pieces are packed into large append-only segments;
+// the index is a log of where each one went, replayed on open.
+pub struct Store {
+    dir: PathBuf,
+    pieces: HashMap<u128, Location>,
+    segments: HashMap<u32, File>,
+    current: u32,
+    end: u64,
+    // Index records for pieces not yet synced to their segment.
+    pending: Vec<u8>,
+    index: File,
+}
+
+// A file as the store holds it: its size and the hash of every piece.
+pub struct Manifest {
+    pub size: u64,
+    pub pieces: Vec<u128>,
+}
+
+impl Manifest {
+    pub fn root(&self) -> u128 {
+        index::merkle_root(&self.pieces)
+    }
+}
+
+// Hash of a whole piece of zeros. Such pieces are never stored: they are
+// left as holes when a file is materialized.
+fn zero_piece() -> u128 {
+    static HASH: OnceLock<u128> = OnceLock::new();
+    *HASH.get_or_init(|| xxh3_128(&[0; PIECE_SIZE]))
+}
+
+fn segment_path(dir: &Path, segment: u32) -> PathBuf {
+    dir.join(SEGMENTS).join(format!("{:08}.seg", segment))
+}
+
+impl Store {
+    pub fn open(dir: &Path) -> io::Result<Store> {
+        fs::create_dir_all(dir.join(SEGMENTS))?;
+        let mut index = OpenOptions::new()
+            .read(true)
+            .append(true)
+            .create(true)
+            .open(dir.join(INDEX))?;
+        let log = fs::read(dir.join(INDEX))?;
+        let mut pieces = HashMap::new();
+        let mut current = 0;
+        // A record torn by a crash is dropped along with its piece.
+        let whole = log.len() / RECORD_LEN * RECORD_LEN;
+        for record in log[..whole].chunks_exact(RECORD_LEN) {
+            let location = Location {
+                segment: u32::from_le_bytes(record[16..20].try_into().unwrap()),
+                len: u32::from_le_bytes(record[20..24].try_into().unwrap()),
+                offset: u64::from_le_bytes(record[24..32].try_into().unwrap()),
+            };
+            current = current.max(location.segment);
+            pieces.insert(
+                u128::from_le_bytes(record[..16].try_into().unwrap()),
+                location,
+            );
+        }
+        if whole != log.len() {
+            index.set_len(whole as u64)?;
+        }
+        index.flush()?;
+
+        let end = match fs::metadata(segment_path(dir, current)) {
+            Ok(meta) => meta.len(),
+            Err(e) if e.kind() == io::ErrorKind::NotFound => 0,
+            Err(e) => return Err(e),
+        };
+        Ok(Store {
+            dir: dir.to_path_buf(),
+            pieces,
+            segments: HashMap::new(),
+            current,
+            end,
+            pending: Vec::new(),
+            index,
+        })
+    }
+
+    fn segment(&mut self, segment: u32) -> io::Result<&File> {
+        if !self.segments.contains_key(&segment) {
+            let file = OpenOptions::new()
+                .read(true)
+                .write(true)
+                .create(true)
+                .truncate(false)
+                .open(segment_path(&self.dir, segment))?;
+            self.segments.insert(segment, file);
+        }
+        Ok(&self.segments[&segment])
+    }
+
+    // Whether a piece can be materialized without being fetched. Pieces of
+    // zeros always can.
+    pub fn holds(&self, hash: u128) -> bool {
+        hash == zero_piece() || self.pieces.contains_key(&hash)
+    }
+
+    // Stores one piece unless it is already held. Returns its hash and
+    // whether it was new.
+    pub fn put(&mut self, piece: &[u8]) -> io::Result<(u128, bool)> {
+        let hash = xxh3_128(piece);
+        if self.holds(hash) {
+            return Ok((hash, false));
+        }
+        let mut offset = self.end.next_multiple_of(ALIGN);
+        if offset + piece.len() as u64 > SEGMENT_SIZE && offset > 0 {
+            self.current += 1;
+            offset = 0;
+        }
+        let segment = self.current;
+        self.segment(segment)?.write_all_at(piece, offset)?;
+        self.end = offset + piece.len() as u64;
+
+        let location = Location {
+            segment,
+            len: piece.len() as u32,
+            offset,
+        };
+        self.pending.extend_from_slice(&hash.to_le_bytes());
+        self.pending.extend_from_slice(&segment.to_le_bytes());
+        self.pending.extend_from_slice(&location.len.to_le_bytes());
+        self.pending.extend_from_slice(&offset.to_le_bytes());
+        self.pieces.insert(hash, location);
+        Ok((hash, true))
+    }
+
+    // Makes every stored piece durable: segments first, so no index record
+    // ever points at data that did not reach the disk.
+    pub fn sync(&mut self) -> io::Result<()> {
+        if self.pending.is_empty() {
+            return Ok(());
+        }
+        for file in self.segments.values() {
+            file.sync_data()?;
+        }
+        self.index.write_all(&self.pending)?;
+        self.index.sync_data()?;
+        self.pending.clear();
+        Ok(())
+    }
+
+    pub fn ingest(&mut self) -> Ingest<'_> {
+        Ingest {
+            store: self,
+            partial: Vec::with_capacity(PIECE_SIZE),
+            manifest: Manifest {
+                size: 0,
+                pieces: Vec::new(),
+            },
+            added: 0,
+        }
+    }
+
+    // Writes the file next to `target` and renames it over, like a direct
+    // download. Each piece is reflinked out of its segment where the
+    // filesystem shares blocks between files, and copied in the kernel
+    // otherwise. Returns how many pieces were reflinked.
+    pub fn materialize(&mut self, manifest: &Manifest, target: &Path) -> io::Result<usize> {
+        let partial = target.with_extension("txt.part");
+        let file = File::create(&partial)?;
+        let mut reflinks = true;
+        let mut reflinked = 0;
+        let mut at = 0;
+        for hash in &manifest.pieces {
+            if *hash == zero_piece() {
+                at += PIECE_SIZE as u64;
+                continue;
+            }
+            let location = *self.pieces.get(hash).ok_or_else(|| {
+                io::Error::new(io::ErrorKind::NotFound, "piece missing from the store")
+            })?;
+            let segment = self.segment(location.segment)?;
+            // Once the filesystem refuses, it refuses for every piece.
+            if reflinks && reflink(segment, &file, location, at)? {
+                reflinked += 1;
+            } else {
+                reflinks = false;
+                copy_range(segment, &file, location, at)?;
+            }
+            at += location.len as u64;
+        }
+        file.set_len(manifest.size)?;
+        file.sync_all()?;
+        fs::rename(&partial, target)?;
+        Ok(reflinked)
+    }
+}
+
+// Splits a stream into pieces as it arrives and stores each one.
+pub struct Ingest<'a> {
+    store: &'a mut Store,
+    partial: Vec<u8>,
+    manifest: Manifest,
+    added: usize,
+}
+
+impl Ingest<'_> {
+    pub fn write(&mut self, mut data: &[u8]) -> io::Result<()> {
+        self.manifest.size += data.len() as u64;
+        while !data.is_empty() {
+            if self.partial.is_empty() && data.len() >= PIECE_SIZE {
+                self.store_piece(&data[..PIECE_SIZE])?;
+                data = &data[PIECE_SIZE..];
+                continue;
+            }
+            let take = (PIECE_SIZE - self.partial.len()).min(data.len());
+            self.partial.extend_from_slice(&data[..take]);
+            data = &data[take..];
+            if self.partial.len() == PIECE_SIZE {
+                self.store_partial()?;
+            }
+        }
+        Ok(())
+    }
+
+    // A run of zeros, such as a hole in a sparse file. Whole pieces of it
+    // are recorded without being hashed or stored.
+    pub fn hole(&mut self, mut len: u64) -> io::Result<()> {
+        self.manifest.size += len;
+        while len > 0 {
+            if self.partial.is_empty() && len >= PIECE_SIZE as u64 {
+                self.manifest.pieces.push(zero_piece());
+                len -= PIECE_SIZE as u64;
+                continue;
+            }
+            let take = ((PIECE_SIZE - self.partial.len()) as u64).min(len);
+            self.partial.resize(self.partial.len() + take as usize, 0);
+            len -= take;
+            if self.partial.len() == PIECE_SIZE {
+                self.store_partial()?;
+            }
+        }
+        Ok(())
+    }
+
+    // A whole piece the store already holds, recorded without its bytes.
+    // Only between pieces: whatever was written so far must end on one.
+    pub fn held(&mut self, hash: u128, len: u64) {
+        debug_assert!(self.partial.is_empty(), "held piece inside a piece");
+        self.manifest.size += len;
+        self.manifest.pieces.push(hash);
+    }
+
+    fn store_partial(&mut self) -> io::Result<()> {
+        let mut piece = std::mem::take(&mut self.partial);
+        self.store_piece(&piece)?;
+        piece.clear();
+        self.partial = piece;
+        Ok(())
+    }
+
+    fn store_piece(&mut self, piece: &[u8]) -> io::Result<()> {
+        let (hash, new) = self.store.put(piece)?;
+        self.manifest.pieces.push(hash);
+        self.added += new as usize;
+        Ok(())
+    }
+
+    // Stores the last short piece, syncs, and returns the manifest with
+    // how many of its pieces the store did not already hold.
+    pub fn finish(mut self) -> io::Result<(Manifest, usize)> {
+        if !self.partial.is_empty() {
+            self.store_partial()?;
+        }
+        self.store.sync()?;
+        Ok((self.manifest, self.added))
+    }
+}
+
+fn reflink(segment: &File, file: &File, location: Location, at: u64) -> io::Result<bool> {
+    let range = libc::file_clone_range {
+        src_fd: segment.as_raw_fd() as i64,
+        src_offset: location.offset,
+        src_length: location.len as u64,
+        dest_offset: at,
+    };
+    if unsafe { libc::ioctl(file.as_raw_fd(), libc::FICLONERANGE, &range) } == 0 {
+        return Ok(true);
+    }
+    let e = io::Error::last_os_error();
+    match e.raw_os_error() {
+        // No shared blocks on this filesystem, across these two files, or
+        // for a range that does not end on a block boundary.
+        Some(libc::EOPNOTSUPP | libc::EXDEV | libc::EINVAL | libc::ENOTTY) => Ok(false),
+        _ => Err(e),
+    }
+}
+
+fn copy_range(segment: &File, file: &File, location: Location, at: u64) -> io::Result<()> {
+    let (mut from, mut to) = (location.offset as i64, at as i64);
+    let mut left = location.len as usize;
+    while left > 0 {
+        let n = unsafe {
+            libc::copy_file_range(
+                segment.as_raw_fd(),
+                &mut from,
+                file.as_raw_fd(),
+                &mut to,
+                left,
+                0,
+            )
+        };
+        if n < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        if n == 0 {
+            return Err(io::ErrorKind::UnexpectedEof.into());
+        }
+        left -= n as usize;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn temp_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("peernet-{}-{}", name, std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    fn piece(seed: u8) -> Vec<u8> {
+        (0..PIECE_SIZE)
+            .map(|i| (i as u8).wrapping_mul(seed) ^ seed)
+            .collect()
+    }
+
+    fn ingest(store: &mut Store, data: &[u8]) -> (Manifest, usize) {
+        let mut ingest = store.ingest();
+        // Uneven writes, so pieces are assembled across them.
+        for part in data.chunks(PIECE_SIZE / 3 + 5) {
+            ingest.write(part).unwrap();
+        }
+        ingest.finish().unwrap()
+    }
+
+    #[test]
+    fn shared_pieces_are_stored_once_and_materialize() {
+        let dir = temp_dir("store");
+        let mut store = Store::open(&dir.join("store")).unwrap();
+
+        let first: Vec<u8> = [piece(1), piece(2), piece(3), vec![9; 1000]].concat();
+        let (manifest, added) = ingest(&mut store, &first);
+        assert_eq!(
+            (manifest.size, manifest.pieces.len(), added),
+            (first.len() as u64, 4, 4)
+        );
+        assert_eq!(manifest.root(), index::merkle_root(&manifest.pieces));
+
+        // A second version sharing two pieces, with a run of zeros.
+        let second: Vec<u8> = [piece(1), vec![0; PIECE_SIZE], piece(4), piece(3)].concat();
+        let (manifest, added) = ingest(&mut store, &second);
+        assert_eq!(added, 1);
+        let target = dir.join("second.txt");
+        store.materialize(&manifest, &target).unwrap();
+        assert!(fs::read(&target).unwrap() == second);
+
+        // Everything survives a reopen.
+        drop(store);
+        let mut store = Store::open(&dir.join("store")).unwrap();
+        assert!(manifest.pieces.iter().all(|&hash| store.holds(hash)));
+        let (_, added) = ingest(&mut store, &first);
+        assert_eq!(added, 0);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn held_pieces_and_holes_need_no_bytes() {
+        let dir = temp_dir("held");
+        let mut store = Store::open(&dir.join("store")).unwrap();
+        let (stored, _) = ingest(&mut store, &piece(5));
+
+        let mut ingest = store.ingest();
+        ingest.held(stored.pieces[0], PIECE_SIZE as u64);
+        ingest.hole(PIECE_SIZE as u64 + 10).unwrap();
+        ingest.write(&[7; 20]).unwrap();
+        let (manifest, added) = ingest.finish().unwrap();
+        assert_eq!(added, 1);
+        assert_eq!(manifest.size, 2 * PIECE_SIZE as u64 + 30);
+
+        let target = dir.join("file.txt");
+        store.materialize(&manifest, &target).unwrap();
+        let expected = [piece(5), vec![0; PIECE_SIZE + 10], vec![7; 20]].concat();
+        assert!(fs::read(&target).unwrap() == expected);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn torn_index_record_is_dropped() {
+        let dir = temp_dir("torn");
+        let mut store = Store::open(&dir.join("store")).unwrap();
+        let (manifest, _) = ingest(&mut store, &[piece(6), piece(7)].concat());
+        drop(store);
+
+        let index = dir.join("store").join(INDEX);
+        let len = fs::metadata(&index).unwrap().len();
+        OpenOptions::new()
+            .write(true)
+            .open(&index)
+            .unwrap()
+            .set_len(len - 3)
+            .unwrap();
+        let store = Store::open(&dir.join("store")).unwrap();
+        assert!(store.holds(manifest.pieces[0]));
+        assert!(!store.holds(manifest.pieces[1]));
+        assert_eq!(fs::metadata(&index).unwrap().len(), len - RECORD_LEN as u64);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,215 @@
+use crate::buffers::{self, Buffer};
+use crate::compress::Decoder;
+use crate::config::Config;
+use crate::protocol;
+use crate::transport::{BoxStream, Transport};
+use std::fs::{self, File};
+use std::io;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+use tokio::io::{AsyncReadExt, AsyncWriteExt, BufReader};
+use tokio::task::JoinSet;
+use tokio::time;
+
+// Bytes fetched per range request. Small enough that throughput can be
+// measured every probe interval even on slow links.
+pub const STRIPE_CHUNK: u32 = 1024 * 1024;
+
+const PROBE_INTERVAL: Duration = Duration::from_millis(500);
+
+// An extra stripe has to raise throughput by this much to be kept growing.
+const MIN_GAIN: f64 = 1.1;
+
+// One connection of a striped download, fetching ranges one at a time.
+pub struct Stripe {
+    socket: BufReader<BoxStream>,
+    decoder: Decoder,
+}
+
+impl Stripe {
+    pub async fn open(transport: &dyn Transport, config: &Config) -> io::Result<Stripe> {
+        let mut socket = transport.connect(&config.connect).await?;
+        let mut offered = protocol::FEATURE_RANGES;
+        if config.compress {
+            offered |= protocol::FEATURE_ZSTD;
+        }
+        let features = protocol::client_handshake(&mut socket, offered).await?;
+        if features & protocol::FEATURE_RANGES == 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::Unsupported,
+                "server does not serve byte ranges",
+            ));
+        }
+        let decoder = if features & protocol::FEATURE_ZSTD != 0 {
+            Decoder::zstd()?
+        } else {
+            Decoder::plain()
+        };
+        Ok(Stripe {
+            socket: BufReader::new(socket),
+            decoder,
+        })
+    }
+
+    // Fetches up to out.len() bytes at `offset`. Returns the file size, 0 if
+    // the server does not have the file, and how many bytes were read.
+    pub async fn fetch(&mut self, offset: u64, out: &mut [u8]) -> io::Result<(u64, usize)> {
+        // One write, so the request is one segment even with Nagle on.
+        let mut request = [0u8; 12];
+        request[..8].copy_from_slice(&offset.to_be_bytes());
+        request[8..].copy_from_slice(&(out.len() as u32).to_be_bytes());
+        self.socket.get_mut().write_all(&request).await?;
+
+        let size = self.socket.read_u64().await?;
+        let n = (size.saturating_sub(offset)).min(out.len() as u64) as usize;
+        self.decoder
+            .read_payload(&mut self.socket, &mut out[..n])
+            .await?;
+        Ok((size, n))
+    }
+}
+
+struct Session {
+    file: File,
+    size: u64,
+    chunks: u64,
+    next: AtomicU64,
+    // Chunks whose stripe failed, handed out again before new ones.
+    retry: Mutex<Vec<u64>>,
+    received: AtomicU64,
+}
+
+impl Session {
+    fn take(&self) -> Option<u64> {
+        if let Some(chunk) = self.retry.lock().unwrap().pop() {
+            return Some(chunk);
+        }
+        let chunk = self.next.fetch_add(1, Ordering::Relaxed);
+        (chunk < self.chunks).then_some(chunk)
+    }
+}
+
+async fn run_stripe(mut stripe: Stripe, session: Arc<Session>) -> io::Result<()> {
+    let mut buf = Buffer::take(STRIPE_CHUNK as usize);
+    while let Some(chunk) = session.take() {
+        let offset = chunk * STRIPE_CHUNK as u64;
+        let n = match stripe.fetch(offset, &mut buf).await {
+            Ok((size, n)) if size == session.size => n,
+            Ok(_) => {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "file changed during the transfer",
+                ))
+            }
+            Err(e) => {
+                session.retry.lock().unwrap().push(chunk);
+                return Err(e);
+            }
+        };
+        session.file.write_all_at(&buf[..n], offset)?;
+        session.received.fetch_add(n as u64, Ordering::Relaxed);
+    }
+    Ok(())
+}
+
+// Downloads example.txt over several connections, each fetching 1 MiB
+// ranges and writing them at their offset. Starts with one stripe and adds
+// another every probe interval while that still raises throughput, up to
+// --stripes, so a single flow that cannot fill a long fat or lossy path is
+// helped without opening connections that buy nothing.
+pub async fn fetch(config: &Config) -> io::Result<()> {
+    let transport = config.transport();
+    let start = Instant::now();
+
+    let mut first = Stripe::open(&*transport, config).await?;
+    println!("Connected to server!");
+    let mut buf = Buffer::take(STRIPE_CHUNK as usize);
+    let (size, n) = first.fetch(0, &mut buf).await?;
+    if size == 0 {
+        eprintln!("Server reported: File not found.");
+        return Ok(());
+    }
+    println!("Receiving file of size: {} bytes", size);
+
+    let target = Path::new("received_example.txt");
+    let partial = target.with_extension("txt.part");
+    let file = File::create(&partial)?;
+    file.set_len(size)?;
+    file.write_all_at(&buf[..n], 0)?;
+    drop(buf);
+    let session = Arc::new(Session {
+        file,
+        size,
+        chunks: size.div_ceil(STRIPE_CHUNK as u64),
+        next: AtomicU64::new(1),
+        retry: Mutex::new(Vec::new()),
+        received: AtomicU64::new(n as u64),
+    });
+
+    let mut stripes = JoinSet::new();
+    stripes.spawn(run_stripe(first, session.clone()));
+    let mut count = 1;
+    let mut growing = config.stripes > 1;
+    let mut best_rate = 0.0;
+    let mut last = (Instant::now(), session.received.load(Ordering::Relaxed));
+    let mut probe = time::interval(PROBE_INTERVAL);
+    probe.tick().await;
+    loop {
+        tokio::select! {
+            finished = stripes.join_next() => match finished {
+                Some(Ok(Ok(()))) => {}
+                Some(Ok(Err(e))) => eprintln!("Stripe failed: {}", e),
+                Some(Err(e)) => eprintln!("Stripe failed: {}", e),
+                None => break,
+            },
+            _ = probe.tick(), if growing => {
+                let now = Instant::now();
+                let received = session.received.load(Ordering::Relaxed);
+                let rate = (received - last.1) as f64 / now.duration_since(last.0).as_secs_f64();
+                last = (now, received);
+                if rate < best_rate * MIN_GAIN {
+                    println!("Settled on {} stripes", count);
+                    growing = false;
+                    continue;
+                }
+                best_rate = rate;
+                if count == config.stripes {
+                    growing = false;
+                    continue;
+                }
+                match Stripe::open(&*transport, config).await {
+                    Ok(stripe) => {
+                        stripes.spawn(run_stripe(stripe, session.clone()));
+                        count += 1;
+                    }
+                    Err(e) => {
+                        eprintln!("Cannot open another stripe: {}", e);
+                        growing = false;
+                    }
+                }
+            }
+        }
+    }
+
+    let received = session.received.load(Ordering::Relaxed);
+    if received < size {
+        return Err(io::Error::new(
+            io::ErrorKind::UnexpectedEof,
+            format!("stripes ended with {} of {} bytes", received, size),
+        ));
+    }
+    session.file.sync_all()?;
+    fs::rename(&partial, target)?;
+    println!(
+        "Received {} bytes over {} stripes in {:?}",
+        size,
+        count,
+        start.elapsed()
+    );
+    println!("File received and saved as 'received_example.txt'.");
+    buffers::report();
+    Ok(())
+}
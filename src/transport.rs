@@ -0,0 +1,167 @@
+use crate::config::Config;
+use crate::ledbat::Background;
+use crate::sockopt::{self, SocketOptions};
+use crate::udp;
+use std::future::Future;
+use std::io;
+use std::net::SocketAddr;
+use std::pin::Pin;
+use std::str::FromStr;
+use std::sync::Arc;
+use tokio::io::{AsyncRead, AsyncWrite, DuplexStream};
+use tokio::net::{TcpListener, TcpStream};
+
+// A reliable, ordered byte stream to a peer. The peer protocol only needs
+// reads and writes, so TCP and the UDP transport are interchangeable.
+pub trait Stream: AsyncRead + AsyncWrite + Unpin + Send {
+    // Holds back partial segments until uncorked. Only TCP has this.
+    fn set_cork(&self, _corked: bool) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+impl Stream for TcpStream {
+    fn set_cork(&self, corked: bool) -> io::Result<()> {
+        sockopt::set_cork(self, corked)
+    }
+}
+
+impl Stream for Background {
+    fn set_cork(&self, corked: bool) -> io::Result<()> {
+        sockopt::set_cork(self.get_ref(), corked)
+    }
+}
+
+impl Stream for DuplexStream {}
+
+pub type BoxStream = Box<dyn Stream>;
+
+pub type BoxFuture<'a, T> = Pin<Box<dyn Future<Output = T> + Send + 'a>>;
+
+pub trait Transport: Send + Sync {
+    fn connect<'a>(&'a self, addr: &'a str) -> BoxFuture<'a, io::Result<BoxStream>>;
+    fn bind<'a>(&'a self, addr: &'a str) -> BoxFuture<'a, io::Result<Box<dyn Listener>>>;
+
+    // Listeners sharing one address, each to be accepted from by its own
+    // task. Transports that cannot share a port bind just one.
+    fn bind_many<'a>(
+        &'a self,
+        addr: &'a str,
+        _count: usize,
+    ) -> BoxFuture<'a, io::Result<Vec<Box<dyn Listener>>>> {
+        Box::pin(async move { Ok(vec![self.bind(addr).await?]) })
+    }
+}
+
+pub trait Listener: Send {
+    fn accept(&mut self) -> BoxFuture<'_, io::Result<(BoxStream, SocketAddr)>>;
+    fn local_addr(&self) -> io::Result<SocketAddr>;
+}
+
+#[derive(Clone, Copy, PartialEq)]
+pub enum Kind {
+    Tcp,
+    Udp,
+}
+
+impl FromStr for Kind {
+    type Err = ();
+
+    fn from_str(value: &str) -> Result<Kind, ()> {
+        match value {
+            "tcp" => Ok(Kind::Tcp),
+            "udp" => Ok(Kind::Udp),
+            _ => Err(()),
+        }
+    }
+}
+
+// With --background, uploads yield to other traffic on the path (see
+// ledbat.rs).
+pub fn new(config: &Config) -> Arc<dyn Transport> {
+    match config.transport {
+        Kind::Tcp => Arc::new(Tcp {
+            options: config.socket,
+            background: config.background,
+        }),
+        Kind::Udp => Arc::new(udp::Udp::new(
+            config.impairment,
+            config.background,
+            config.socket,
+        )),
+    }
+}
+
+pub struct Tcp {
+    options: SocketOptions,
+    background: bool,
+}
+
+fn tcp_stream(socket: TcpStream, background: bool) -> BoxStream {
+    if background {
+        Box::new(Background::new(socket))
+    } else {
+        Box::new(socket)
+    }
+}
+
+impl Transport for Tcp {
+    fn connect<'a>(&'a self, addr: &'a str) -> BoxFuture<'a, io::Result<BoxStream>> {
+        Box::pin(async move {
+            Ok(tcp_stream(
+                self.options.connect(addr).await?,
+                self.background,
+            ))
+        })
+    }
+
+    fn bind<'a>(&'a self, addr: &'a str) -> BoxFuture<'a, io::Result<Box<dyn Listener>>> {
+        Box::pin(async move {
+            Ok(Box::new(TcpAcceptor {
+                listener: self.options.listen(addr).await?,
+                options: self.options,
+                background: self.background,
+            }) as Box<dyn Listener>)
+        })
+    }
+
+    fn bind_many<'a>(
+        &'a self,
+        addr: &'a str,
+        count: usize,
+    ) -> BoxFuture<'a, io::Result<Vec<Box<dyn Listener>>>> {
+        Box::pin(async move {
+            let listeners = self.options.listen_many(addr, count).await?;
+            Ok(listeners
+                .into_iter()
+                .map(|listener| {
+                    Box::new(TcpAcceptor {
+                        listener,
+                        options: self.options,
+                        background: self.background,
+                    }) as Box<dyn Listener>
+                })
+                .collect())
+        })
+    }
+}
+
+struct TcpAcceptor {
+    listener: TcpListener,
+    options: SocketOptions,
+    background: bool,
+}
+
+impl Listener for TcpAcceptor {
+    fn accept(&mut self) -> BoxFuture<'_, io::Result<(BoxStream, SocketAddr)>> {
+        Box::pin(async move {
+            let (socket, addr) = self.listener.accept().await?;
+            self.options.apply(&socket)?;
+            Ok((tcp_stream(socket, self.background), addr))
+        })
+    }
+
+    fn local_addr(&self) -> io::Result<SocketAddr> {
+        self.listener.local_addr()
+    }
+}
@@ -0,0 +1,589 @@
+use crate::arena::{Arena, Span};
+use crate::bundle;
+use crate::config::Config;
+use crate::index::ShareIndex;
+use crate::protocol;
+use std::cmp::Reverse;
+use std::collections::{BTreeSet, HashMap};
+use std::fs;
+use std::io;
+use std::path::Path;
+use std::sync::Arc;
+use std::time::Instant;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt, BufReader};
+use xxhash_rust::xxh3::xxh3_128;
+
+#[derive(Clone)]
+pub struct Child {
+    pub name: String,
+    pub dir: bool,
+    pub size: u64,
+    // The file's Merkle root, or the directory's hash.
+    pub hash: u128,
+}
+
+// A directory and its hash over its children, sorted by name. Equal hashes
+// mean equal subtrees, so a sync walks down only where they differ.
+#[derive(Clone, Default)]
+pub struct Dir {
+    pub hash: u128,
+    pub children: Vec<Child>,
+}
+
+impl Dir {
+    // Puts `child` in its place by name, replacing one of the same name.
+    fn upsert(&mut self, child: Child) {
+        match self
+            .children
+            .binary_search_by(|ours| ours.name.cmp(&child.name))
+        {
+            Ok(i) => self.children[i] = child,
+            Err(i) => self.children.insert(i, child),
+        }
+    }
+
+    // Removes the child `name` if it is a directory, for `dir`, or a file.
+    fn remove(&mut self, name: &str, dir: bool) {
+        if let Ok(i) = self
+            .children
+            .binary_search_by(|ours| ours.name.as_str().cmp(name))
+        {
+            if self.children[i].dir == dir {
+                self.children.remove(i);
+            }
+        }
+    }
+}
+
+// Directory hashes for a whole tree of files, keyed by directory path with
+// "" for the root. Paths and directories are shared between clones, so a
+// changed copy allocates only for the directories that changed.
+#[derive(Clone)]
+pub struct Tree {
+    dirs: HashMap<Arc<str>, Arc<Dir>>,
+}
+
+fn split(path: &str) -> (&str, &str) {
+    path.rsplit_once('/').unwrap_or(("", path))
+}
+
+fn depth(path: &str) -> usize {
+    if path.is_empty() {
+        0
+    } else {
+        path.matches('/').count() + 1
+    }
+}
+
+// The hash of a directory over its sorted children, little endian like the
+// Merkle nodes of the index.
+fn hash_children(children: &[Child]) -> u128 {
+    let mut buf = Vec::with_capacity(children.len() * 48);
+    for child in children {
+        buf.extend_from_slice(&(child.name.len() as u16).to_le_bytes());
+        buf.extend_from_slice(child.name.as_bytes());
+        buf.push(child.dir as u8);
+        buf.extend_from_slice(&child.size.to_le_bytes());
+        buf.extend_from_slice(&child.hash.to_le_bytes());
+    }
+    xxh3_128(&buf)
+}
+
+impl Tree {
+    // Builds the tree bottom-up from (path, size, root) of every file. Only
+    // index records are read, never file contents.
+    pub fn build(files: impl IntoIterator<Item = (String, u64, u128)>) -> Tree {
+        let mut pending: HashMap<String, Vec<Child>> = HashMap::new();
+        pending.insert(String::new(), Vec::new());
+        for (path, size, root) in files {
+            let (parent, name) = split(&path);
+            let mut ancestor = parent;
+            while !pending.contains_key(ancestor) {
+                pending.insert(ancestor.to_string(), Vec::new());
+                ancestor = split(ancestor).0;
+            }
+            pending.get_mut(parent).unwrap().push(Child {
+                name: name.to_string(),
+                dir: false,
+                size,
+                hash: root,
+            });
+        }
+
+        // Deepest first, so every directory is finished before its parent.
+        let mut order: Vec<String> = pending.keys().cloned().collect();
+        order.sort_by_key(|path| std::cmp::Reverse(depth(path)));
+        let mut dirs = HashMap::with_capacity(order.len());
+        for path in order {
+            let mut children = pending.remove(&path).unwrap();
+            children.sort_unstable_by(|a, b| a.name.cmp(&b.name));
+            let hash = hash_children(&children);
+            if !path.is_empty() {
+                let (parent, name) = split(&path);
+                pending.get_mut(parent).unwrap().push(Child {
+                    name: name.to_string(),
+                    dir: true,
+                    size: 0,
+                    hash,
+                });
+            }
+            dirs.insert(Arc::from(path), Arc::new(Dir { hash, children }));
+        }
+        Tree { dirs }
+    }
+
+    // Applies changed files, None for one removed, and rehashes only the
+    // directories they are in and those above. The result is the tree
+    // build() would make of the files as they now are.
+    pub fn apply<'a>(&mut self, changes: impl IntoIterator<Item = (&'a str, Option<(u64, u128)>)>) {
+        let mut dirty = BTreeSet::new();
+        for (path, file) in changes {
+            let (parent, name) = split(path);
+            match file {
+                Some((size, hash)) => {
+                    let mut ancestor = parent;
+                    while !self.dirs.contains_key(ancestor) {
+                        self.dirs.insert(Arc::from(ancestor), Arc::default());
+                        ancestor = split(ancestor).0;
+                    }
+                    Arc::make_mut(self.dirs.get_mut(parent).unwrap()).upsert(Child {
+                        name: name.to_string(),
+                        dir: false,
+                        size,
+                        hash,
+                    });
+                }
+                None => match self.dirs.get_mut(parent) {
+                    Some(dir) => Arc::make_mut(dir).remove(name, false),
+                    None => continue,
+                },
+            }
+            dirty.insert((Reverse(depth(parent)), parent.to_string()));
+        }
+
+        // Deepest first, so every directory is rehashed before its parent.
+        // One left empty goes, as build() would never have made it.
+        while let Some((_, path)) = dirty.pop_first() {
+            let dir = Arc::make_mut(self.dirs.get_mut(path.as_str()).unwrap());
+            let hash = if dir.children.is_empty() && !path.is_empty() {
+                self.dirs.remove(path.as_str());
+                None
+            } else {
+                dir.hash = hash_children(&dir.children);
+                Some(dir.hash)
+            };
+            if path.is_empty() {
+                continue;
+            }
+            let (parent, name) = split(&path);
+            let parent_dir = Arc::make_mut(self.dirs.get_mut(parent).unwrap());
+            match hash {
+                Some(hash) => parent_dir.upsert(Child {
+                    name: name.to_string(),
+                    dir: true,
+                    size: 0,
+                    hash,
+                }),
+                None => parent_dir.remove(name, true),
+            }
+            dirty.insert((Reverse(depth(parent)), parent.to_string()));
+        }
+    }
+
+    pub fn dir(&self, path: &str) -> Option<&Dir> {
+        self.dirs.get(path).map(|dir| &**dir)
+    }
+
+    // Every file at or below `path`, which is a file or a directory.
+    pub fn files_under(&self, path: &str) -> Vec<String> {
+        let Some(dir) = self.dir(path) else {
+            return vec![path.to_string()];
+        };
+        let mut files = Vec::new();
+        let mut pending = vec![(path.to_string(), dir)];
+        while let Some((path, dir)) = pending.pop() {
+            for child in &dir.children {
+                let child_path = join(&path, &child.name);
+                match self.dir(&child_path) {
+                    Some(dir) if child.dir => pending.push((child_path, dir)),
+                    _ => files.push(child_path),
+                }
+            }
+        }
+        files
+    }
+}
+
+pub async fn write_request<W: AsyncWrite + Unpin>(writer: &mut W, dir: &str) -> io::Result<()> {
+    writer.write_u16(dir.len() as u16).await?;
+    writer.write_all(dir.as_bytes()).await
+}
+
+// In place of a path length, asks a watching server to answer with one
+// byte once its catalog has moved on from the version the walk was listed
+// from, and to list the next walk from the new one.
+const WAIT: u16 = u16::MAX;
+
+pub async fn write_wait<W: AsyncWrite + Unpin>(writer: &mut W) -> io::Result<()> {
+    writer.write_u16(WAIT).await
+}
+
+pub enum Request<'a> {
+    Dir(&'a str),
+    Wait,
+}
+
+// None once the client hangs up. A path borrows from `arena` until the
+// next request is read.
+pub async fn read_request<'a, R: AsyncRead + Unpin>(
+    reader: &mut R,
+    arena: &'a mut Arena,
+) -> io::Result<Option<Request<'a>>> {
+    arena.reset();
+    let len = match reader.read_u16().await {
+        Ok(WAIT) => return Ok(Some(Request::Wait)),
+        Ok(len) => len as usize,
+        Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => return Ok(None),
+        Err(e) => return Err(e),
+    };
+    let dir = arena.read(reader, len).await?;
+    arena
+        .str(dir)
+        .map(|dir| Some(Request::Dir(dir)))
+        .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "bad path"))
+}
+
+// The directory's hash and a u32 child count, then (u16 length, name, u8
+// is-directory, u64 size, u128 hash) per child. A directory the tree does
+// not have is sent as empty.
+pub async fn write_listing<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    dir: Option<&Dir>,
+) -> io::Result<()> {
+    let empty = Dir::default();
+    let dir = dir.unwrap_or(&empty);
+    let mut buf = Vec::with_capacity(20 + dir.children.len() * 48);
+    buf.extend_from_slice(&dir.hash.to_be_bytes());
+    buf.extend_from_slice(&(dir.children.len() as u32).to_be_bytes());
+    for child in &dir.children {
+        buf.extend_from_slice(&(child.name.len() as u16).to_be_bytes());
+        buf.extend_from_slice(child.name.as_bytes());
+        buf.push(child.dir as u8);
+        buf.extend_from_slice(&child.size.to_be_bytes());
+        buf.extend_from_slice(&child.hash.to_be_bytes());
+    }
+    writer.write_all(&buf).await
+}
+
+struct Listed {
+    name: Span,
+    dir: bool,
+    size: u64,
+    hash: u128,
+}
+
+// A child of a received listing, borrowing its name from the listing.
+pub struct ListedRef<'a> {
+    pub name: &'a str,
+    pub dir: bool,
+    pub size: u64,
+    pub hash: u128,
+}
+
+// A directory listing as received. Names go into one arena and the listing
+// is read into again for every directory of a walk, so listing a tree
+// allocates only when a directory is bigger than any before it.
+#[derive(Default)]
+pub struct Listing {
+    pub hash: u128,
+    names: Arena,
+    children: Vec<Listed>,
+}
+
+impl Listing {
+    pub async fn read<R: AsyncRead + Unpin>(&mut self, reader: &mut R) -> io::Result<()> {
+        self.names.reset();
+        self.children.clear();
+        self.hash = reader.read_u128().await?;
+        let count = reader.read_u32().await? as usize;
+        for _ in 0..count {
+            let len = reader.read_u16().await? as usize;
+            let name = self.names.read(reader, len).await?;
+            if !self.names.str(name).is_ok_and(|name| {
+                !name.is_empty() && !name.contains('/') && name != "." && name != ".."
+            }) {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "bad name in listing",
+                ));
+            }
+            self.children.push(Listed {
+                name,
+                dir: reader.read_u8().await? != 0,
+                size: reader.read_u64().await?,
+                hash: reader.read_u128().await?,
+            });
+        }
+        Ok(())
+    }
+
+    pub fn children(&self) -> impl Iterator<Item = io::Result<ListedRef<'_>>> {
+        self.children.iter().map(|child| {
+            Ok(ListedRef {
+                name: self.names.str(child.name)?,
+                dir: child.dir,
+                size: child.size,
+                hash: child.hash,
+            })
+        })
+    }
+
+    // Children are sorted by name, and byte order is string order.
+    pub fn contains(&self, name: &str) -> bool {
+        self.children
+            .binary_search_by(|child| self.names.bytes(child.name).cmp(name.as_bytes()))
+            .is_ok()
+    }
+}
+
+fn join(dir: &str, name: &str) -> String {
+    if dir.is_empty() {
+        name.to_string()
+    } else {
+        format!("{}/{}", dir, name)
+    }
+}
+
+// What one walk found: the files to fetch with their size and Merkle root
+// as listed, and the paths, files or directories, the server no longer has.
+struct Pass {
+    listed: usize,
+    fetch: Vec<String>,
+    fetched: Vec<(u64, u128)>,
+    remove: Vec<String>,
+}
+
+// Walks the server's tree against `local` top-down, a level at a time with
+// one round trip per level, listing only directories whose hashes differ.
+// A directory missing here is listed too, so every file to fetch comes with
+// its hash.
+async fn walk<S: AsyncRead + AsyncWrite + Unpin>(
+    socket: &mut BufReader<S>,
+    local: &Tree,
+    remote: &mut Listing,
+) -> io::Result<Pass> {
+    let mut pass = Pass {
+        listed: 0,
+        fetch: Vec::new(),
+        fetched: Vec::new(),
+        remove: Vec::new(),
+    };
+    let mut level = vec![String::new()];
+    while !level.is_empty() {
+        let mut requests = Vec::new();
+        for dir in &level {
+            write_request(&mut requests, dir).await?;
+        }
+        socket.get_mut().write_all(&requests).await?;
+
+        let mut next = Vec::new();
+        for dir in level {
+            remote.read(socket).await?;
+            pass.listed += 1;
+            let here = local.dir(&dir);
+            if here.is_some_and(|here| here.hash == remote.hash) {
+                continue;
+            }
+            let ours = here.map_or(&[][..], |here| &here.children[..]);
+            for child in remote.children() {
+                let child = child?;
+                let path = join(&dir, child.name);
+                match ours.binary_search_by(|ours| ours.name.as_str().cmp(child.name)) {
+                    Ok(i) if ours[i].dir == child.dir && ours[i].hash == child.hash => continue,
+                    Ok(i) if ours[i].dir != child.dir => pass.remove.push(path.clone()),
+                    _ => {}
+                }
+                if child.dir {
+                    next.push(path);
+                } else {
+                    pass.fetch.push(path);
+                    pass.fetched.push((child.size, child.hash));
+                }
+            }
+            for child in ours {
+                if !remote.contains(&child.name) {
+                    pass.remove.push(join(&dir, &child.name));
+                }
+            }
+        }
+        level = next;
+    }
+    Ok(pass)
+}
+
+// Makes `target` a replica of the server's whole share: walks both trees,
+// removes whatever the server no longer has and fetches changed files as
+// bundles. The replica is hashed through its own index once, so unchanged
+// files are not read again either. With --watch the connection stays open
+// and a new walk starts whenever the server publishes a new version; the
+// local tree then follows what each pass fetched and removed, so nothing
+// local is rescanned.
+pub async fn mirror(config: &Config, target: &Path) -> io::Result<()> {
+    fs::create_dir_all(target)?;
+    let (index, _) = ShareIndex::open(target, &config.index_options())?;
+    let mut local = Tree::build(
+        index
+            .entries()
+            .map(|entry| (entry.path.to_string(), entry.size, entry.root)),
+    );
+    drop(index);
+
+    let mut socket = config.transport().connect(&config.connect).await?;
+    let mut offered = protocol::FEATURE_TREE;
+    if config.watch {
+        offered |= protocol::FEATURE_WATCH;
+    }
+    let features = protocol::client_handshake(&mut socket, offered).await?;
+    if features & protocol::FEATURE_TREE == 0 {
+        return Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "server does not send directory hashes",
+        ));
+    }
+    let mut socket = BufReader::new(socket);
+    let mut remote = Listing::default();
+    loop {
+        let start = Instant::now();
+        let pass = walk(&mut socket, &local, &mut remote).await?;
+
+        let mut changes = Vec::new();
+        for path in &pass.remove {
+            changes.extend(local.files_under(path).into_iter().map(|path| (path, None)));
+            let path = target.join(path);
+            let removed = match fs::symlink_metadata(&path) {
+                Ok(meta) if meta.is_dir() => fs::remove_dir_all(&path),
+                Ok(_) => fs::remove_file(&path),
+                Err(e) => Err(e),
+            };
+            match removed {
+                Err(e) if e.kind() != io::ErrorKind::NotFound => return Err(e),
+                _ => {}
+            }
+        }
+        let fetched = if pass.fetch.is_empty() {
+            0
+        } else {
+            bundle::fetch(config, &pass.fetch, target).await?.files
+        };
+        changes.extend(
+            pass.fetch
+                .into_iter()
+                .zip(pass.fetched)
+                .map(|(path, file)| (path, Some(file))),
+        );
+        local.apply(changes.iter().map(|(path, file)| (path.as_str(), *file)));
+        println!(
+            "Listed {} directories; fetched {} files, removed {} paths in {:?}",
+            pass.listed,
+            fetched,
+            pass.remove.len(),
+            start.elapsed()
+        );
+
+        if features & protocol::FEATURE_WATCH == 0 {
+            return Ok(());
+        }
+        println!("Waiting for the share to change...");
+        write_wait(socket.get_mut()).await?;
+        socket.read_u8().await?;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn file(path: &str, size: u64) -> (String, u64, u128) {
+        (
+            path.to_string(),
+            size,
+            xxh3_128(path.as_bytes()) ^ size as u128,
+        )
+    }
+
+    // Every directory of `a` and `b`, with its hash and children.
+    fn assert_same(a: &Tree, b: &Tree) {
+        let mut dirs: Vec<&Arc<str>> = a.dirs.keys().collect();
+        dirs.sort();
+        let mut theirs: Vec<&Arc<str>> = b.dirs.keys().collect();
+        theirs.sort();
+        assert_eq!(dirs, theirs);
+        for dir in dirs {
+            let (ours, theirs) = (a.dir(dir).unwrap(), b.dir(dir).unwrap());
+            assert_eq!(ours.hash, theirs.hash, "hash of {:?}", dir);
+            let names = |dir: &Dir| -> Vec<(String, bool)> {
+                dir.children
+                    .iter()
+                    .map(|c| (c.name.clone(), c.dir))
+                    .collect()
+            };
+            assert_eq!(names(ours), names(theirs), "children of {:?}", dir);
+        }
+    }
+
+    #[test]
+    fn applied_changes_match_a_rebuild() {
+        let before = vec![
+            file("top", 1),
+            file("a/one", 2),
+            file("a/b/two", 3),
+            file("a/b/c/three", 4),
+            file("d/four", 5),
+            file("gone/x/five", 6),
+        ];
+        let mut tree = Tree::build(before);
+        let changes = [
+            ("a/one", Some((7, 70))),
+            ("a/b/c/three", None),
+            ("gone/x/five", None),
+            ("new/deep/er/six", Some((8, 80))),
+            ("d/seven", Some((9, 90))),
+        ];
+        tree.apply(changes.iter().map(|&(path, file)| (path, file)));
+
+        let after = Tree::build(vec![
+            file("top", 1),
+            ("a/one".to_string(), 7, 70),
+            file("a/b/two", 3),
+            file("d/four", 5),
+            ("new/deep/er/six".to_string(), 8, 80),
+            ("d/seven".to_string(), 9, 90),
+        ]);
+        assert_same(&tree, &after);
+    }
+
+    #[test]
+    fn a_file_and_a_directory_trade_places() {
+        let mut tree = Tree::build(vec![file("x", 1), file("y/inner", 2)]);
+        tree.apply([
+            ("x", None),
+            ("x/inner", Some((3, 30))),
+            ("y", Some((4, 40))),
+            ("y/inner", None),
+        ]);
+        let after = Tree::build(vec![
+            ("x/inner".to_string(), 3, 30),
+            ("y".to_string(), 4, 40),
+        ]);
+        assert_same(&tree, &after);
+        assert_eq!(tree.files_under("x"), vec!["x/inner".to_string()]);
+        assert_eq!(tree.files_under("y"), vec!["y".to_string()]);
+    }
+
+    #[test]
+    fn removing_everything_leaves_an_empty_root() {
+        let mut tree = Tree::build(vec![file("a/b/c", 1), file("d", 2)]);
+        tree.apply([("a/b/c", None), ("d", None)]);
+        assert_same(&tree, &Tree::build(Vec::new()));
+    }
+}
@@ -0,0 +1,911 @@
+use crate::ledbat::Ledbat;
+use crate::sockopt::SocketOptions;
+use crate::transport::{BoxFuture, BoxStream, Listener, Transport};
+use std::collections::{BTreeMap, BTreeSet, HashMap, VecDeque};
+use std::io;
+use std::net::SocketAddr;
+use std::sync::Arc;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+use tokio::io::{AsyncReadExt, AsyncWriteExt, DuplexStream};
+use tokio::net::UdpSocket;
+use tokio::sync::mpsc;
+use tokio::time;
+
+// A reliable byte stream over UDP. Every datagram carries one segment of at
+// most MSS bytes, numbered consecutively. The receiver acknowledges the next
+// segment it expects plus up to MAX_SACK ranges it holds beyond that, and
+// echoes the sender's timestamp so every ack is an RTT sample. The sender
+// declares a segment lost once a segment sent after it has been acked and a
+// reordering window has passed (RACK), falls back to a retransmission
+// timeout, runs a Reno-style window (or LEDBAT for background transfers)
+// and paces packets over the RTT instead of bursting a whole window.
+
+const MAGIC: u32 = 0x5045_5544; // "PEUD"
+
+const SYN: u8 = 0;
+const SYN_ACK: u8 = 1;
+const DATA: u8 = 2;
+const ACK: u8 = 3;
+const RESET: u8 = 4;
+
+const FLAG_FIN: u8 = 1;
+
+// kind, flags, u64 segment, u32 timestamp
+const DATA_HEADER: usize = 14;
+
+// Payload per datagram; keeps packets under the IPv6 minimum MTU.
+const MSS: usize = 1200;
+
+// Segments the receiver holds ahead of the application; also caps the
+// congestion window.
+const WINDOW: u64 = 4096;
+
+const MAX_SACK: usize = 16;
+const INITIAL_CWND: usize = 10 * MSS;
+const INITIAL_RTT: Duration = Duration::from_millis(100);
+const MIN_RTO: Duration = Duration::from_millis(200);
+const MAX_RTO: Duration = Duration::from_secs(10);
+const DELAYED_ACK: Duration = Duration::from_millis(2);
+const KEEPALIVE: Duration = Duration::from_secs(1);
+const IDLE_TIMEOUT: Duration = Duration::from_secs(15);
+// Time a closed connection keeps answering retransmitted FINs.
+const LINGER: Duration = Duration::from_secs(1);
+const SYN_RETRIES: u32 = 8;
+
+// Bytes buffered between the application and the connection task.
+const APP_BUFFER: usize = 256 * 1024;
+// Datagrams queued for a connection task before further ones are dropped.
+const INBOX: usize = 1024;
+
+// Loss and delay added to every datagram this process sends, for exercising
+// the transport over loopback.
+#[derive(Clone, Copy, Default)]
+pub struct Impairment {
+    pub loss_percent: f64,
+    pub delay: Duration,
+}
+
+struct Link {
+    socket: Arc<UdpSocket>,
+    peer: SocketAddr,
+    impairment: Impairment,
+    rng: u64,
+}
+
+impl Link {
+    fn new(socket: Arc<UdpSocket>, peer: SocketAddr, impairment: Impairment) -> Link {
+        let seed = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map_or(0, |t| t.as_nanos() as u64);
+        Link {
+            socket,
+            peer,
+            impairment,
+            rng: seed | 1,
+        }
+    }
+
+    fn chance(&mut self) -> f64 {
+        // xorshift64; only needs to look random to the loss shim.
+        self.rng ^= self.rng << 13;
+        self.rng ^= self.rng >> 7;
+        self.rng ^= self.rng << 17;
+        (self.rng >> 11) as f64 / (1u64 << 53) as f64
+    }
+
+    async fn send(&mut self, packet: Vec<u8>) {
+        if self.impairment.loss_percent > 0.0
+            && self.chance() * 100.0 < self.impairment.loss_percent
+        {
+            return;
+        }
+        // Send errors are treated like loss; the retransmission logic
+        // already has to cope with that.
+        if self.impairment.delay.is_zero() {
+            let _ = self.socket.send_to(&packet, self.peer).await;
+            return;
+        }
+        let (socket, peer, delay) = (self.socket.clone(), self.peer, self.impairment.delay);
+        tokio::spawn(async move {
+            time::sleep(delay).await;
+            let _ = socket.send_to(&packet, peer).await;
+        });
+    }
+}
+
+fn handshake_packet(kind: u8) -> Vec<u8> {
+    let mut packet = vec![kind];
+    packet.extend_from_slice(&MAGIC.to_be_bytes());
+    packet
+}
+
+fn is_handshake(packet: &[u8], kind: u8) -> bool {
+    packet.len() == 5 && packet[0] == kind && packet[1..5] == MAGIC.to_be_bytes()
+}
+
+fn u32_at(packet: &[u8], at: usize) -> Option<u32> {
+    Some(u32::from_be_bytes(packet.get(at..at + 4)?.try_into().ok()?))
+}
+
+fn u64_at(packet: &[u8], at: usize) -> Option<u64> {
+    Some(u64::from_be_bytes(packet.get(at..at + 8)?.try_into().ok()?))
+}
+
+struct Segment {
+    data: Vec<u8>,
+    fin: bool,
+    sent_at: Instant,
+    lost: bool,
+}
+
+impl Segment {
+    // What the segment counts for in flight. A FIN carries no data but
+    // still has to be acked, and only counting it keeps the retransmission
+    // timer armed while it is the last thing outstanding.
+    fn charge(&self) -> usize {
+        self.data.len().max(1)
+    }
+}
+
+struct Connection {
+    link: Link,
+    epoch: Instant,
+
+    // Sending side.
+    pending: VecDeque<u8>,
+    app_eof: bool,
+    fin_sent: bool,
+    fin_acked: bool,
+    next_seq: u64,
+    unacked: BTreeMap<u64, Segment>,
+    retransmit: BTreeSet<u64>,
+    cum_acked: u64,
+    largest_acked: Option<u64>,
+    peer_window: u64,
+    inflight: usize,
+    cwnd: usize,
+    ssthresh: usize,
+    // Replaces the Reno window for background transfers.
+    background: Option<Ledbat>,
+    recovery_end: u64,
+    srtt: Duration,
+    rttvar: Duration,
+    rto: Duration,
+    backoff: u32,
+    has_rtt: bool,
+    // Send time of the most recently sent segment known to be delivered.
+    rack_sent: Option<Instant>,
+    rack_deadline: Option<Instant>,
+    rto_armed: Instant,
+    pacing_next: Instant,
+    last_sent: Instant,
+
+    // Receiving side.
+    recv_next: u64,
+    out_of_order: BTreeMap<u64, (Vec<u8>, bool)>,
+    deliver: VecDeque<Vec<u8>>,
+    deliver_offset: usize,
+    peer_fin: bool,
+    app_write_closed: bool,
+    echo: u32,
+    ack_pending: u32,
+    ack_deadline: Option<Instant>,
+    advertised: u64,
+    last_recv: Instant,
+}
+
+enum Wake {
+    Packet(Option<Vec<u8>>),
+    Read(io::Result<usize>),
+    Written(io::Result<usize>),
+    Timer,
+}
+
+impl Connection {
+    fn new(link: Link, rtt: Option<Duration>, background: bool) -> Connection {
+        let now = Instant::now();
+        let mut connection = Connection {
+            link,
+            epoch: now,
+            pending: VecDeque::new(),
+            app_eof: false,
+            fin_sent: false,
+            fin_acked: false,
+            next_seq: 0,
+            unacked: BTreeMap::new(),
+            retransmit: BTreeSet::new(),
+            cum_acked: 0,
+            largest_acked: None,
+            peer_window: WINDOW,
+            inflight: 0,
+            cwnd: INITIAL_CWND,
+            ssthresh: usize::MAX,
+            background: background.then(|| Ledbat::new(MSS, INITIAL_CWND, WINDOW as usize * MSS)),
+            recovery_end: 0,
+            srtt: INITIAL_RTT,
+            rttvar: INITIAL_RTT / 2,
+            rto: MIN_RTO.max(INITIAL_RTT * 3),
+            backoff: 0,
+            has_rtt: false,
+            rack_sent: None,
+            rack_deadline: None,
+            rto_armed: now,
+            pacing_next: now,
+            last_sent: now,
+            recv_next: 0,
+            out_of_order: BTreeMap::new(),
+            deliver: VecDeque::new(),
+            deliver_offset: 0,
+            peer_fin: false,
+            app_write_closed: false,
+            echo: 0,
+            ack_pending: 0,
+            ack_deadline: None,
+            advertised: WINDOW,
+            last_recv: now,
+        };
+        if let Some(rtt) = rtt {
+            connection.on_rtt(rtt);
+        }
+        connection
+    }
+
+    fn micros(&self, at: Instant) -> u32 {
+        at.duration_since(self.epoch).as_micros() as u32
+    }
+
+    async fn run(mut self, mut inbox: mpsc::Receiver<Vec<u8>>, app: DuplexStream) {
+        let (mut reader, mut writer) = tokio::io::split(app);
+        let mut buf = vec![0u8; 64 * 1024];
+        let mut linger_until = None;
+        loop {
+            let now = Instant::now();
+            if now.duration_since(self.last_recv) > IDLE_TIMEOUT {
+                return;
+            }
+            self.detect_losses(now);
+            self.send_ready(now).await;
+            if self.ack_pending >= 2 || self.ack_deadline.is_some_and(|at| at <= now) {
+                self.send_ack().await;
+            } else if now.duration_since(self.last_sent) >= KEEPALIVE {
+                // Keeps an idle peer from timing out and repeats window
+                // updates whose ack may have been lost.
+                self.send_ack().await;
+            }
+            if self.peer_fin && self.deliver.is_empty() && !self.app_write_closed {
+                let _ = writer.shutdown().await;
+                self.app_write_closed = true;
+            }
+            if self.app_eof && self.fin_acked && self.app_write_closed {
+                let until = *linger_until.get_or_insert(now + LINGER);
+                if now >= until {
+                    return;
+                }
+            }
+
+            let wake = self.next_timer(now, linger_until);
+            let can_read = !self.app_eof && self.pending.len() < APP_BUFFER;
+            let front = self
+                .deliver
+                .front()
+                .map(|data| &data[self.deliver_offset..]);
+            let event = tokio::select! {
+                packet = inbox.recv() => Wake::Packet(packet),
+                read = reader.read(&mut buf), if can_read => Wake::Read(read),
+                written = writer.write(front.unwrap_or(&[])), if front.is_some() => Wake::Written(written),
+                _ = time::sleep_until(time::Instant::from_std(wake)) => Wake::Timer,
+            };
+
+            match event {
+                Wake::Packet(None) => return,
+                Wake::Packet(Some(packet)) => {
+                    if !self.on_packet(&packet, Instant::now()).await {
+                        return;
+                    }
+                }
+                Wake::Read(Ok(0)) | Wake::Read(Err(_)) => self.app_eof = true,
+                Wake::Read(Ok(n)) => self.pending.extend(&buf[..n]),
+                Wake::Written(Ok(n)) if n > 0 => {
+                    self.deliver_offset += n;
+                    if self.deliver_offset == self.deliver[0].len() {
+                        self.deliver.pop_front();
+                        self.deliver_offset = 0;
+                        // Reopen a window we had nearly closed.
+                        if self.advertised < WINDOW / 4 && self.window() >= WINDOW / 4 {
+                            self.send_ack().await;
+                        }
+                    }
+                }
+                Wake::Written(_) => {
+                    // The application went away with data still arriving.
+                    self.link.send(vec![RESET]).await;
+                    return;
+                }
+                Wake::Timer => {}
+            }
+        }
+    }
+
+    fn window(&self) -> u64 {
+        WINDOW.saturating_sub((self.out_of_order.len() + self.deliver.len()) as u64)
+    }
+
+    fn next_timer(&self, now: Instant, linger_until: Option<Instant>) -> Instant {
+        let mut wake = (self.last_sent + KEEPALIVE).min(self.last_recv + IDLE_TIMEOUT);
+        if self.has_sendable() {
+            wake = wake.min(self.pacing_next.max(now + Duration::from_micros(100)));
+        }
+        if self.inflight > 0 {
+            wake = wake.min(self.rto_armed + self.rto * (1 << self.backoff.min(6)));
+        }
+        for at in [self.ack_deadline, self.rack_deadline, linger_until]
+            .into_iter()
+            .flatten()
+        {
+            wake = wake.min(at);
+        }
+        wake
+    }
+
+    // Returns false once the peer reset the connection.
+    async fn on_packet(&mut self, packet: &[u8], now: Instant) -> bool {
+        self.last_recv = now;
+        match packet.first() {
+            Some(&SYN) if is_handshake(packet, SYN) => {
+                // Our SYN_ACK was lost.
+                self.link.send(handshake_packet(SYN_ACK)).await;
+            }
+            Some(&DATA) => self.on_data(packet, now).await,
+            Some(&ACK) => self.on_ack(packet, now),
+            Some(&RESET) => return false,
+            _ => {}
+        }
+        true
+    }
+
+    async fn on_data(&mut self, packet: &[u8], now: Instant) {
+        let (Some(&flags), Some(seq), Some(ts)) =
+            (packet.get(1), u64_at(packet, 2), u32_at(packet, 10))
+        else {
+            return;
+        };
+        self.echo = ts;
+        if seq < self.recv_next || seq >= self.recv_next + WINDOW {
+            // A duplicate means our ack was lost; answer right away.
+            self.send_ack().await;
+            return;
+        }
+        let in_order = seq == self.recv_next;
+        self.out_of_order
+            .entry(seq)
+            .or_insert_with(|| (packet[DATA_HEADER..].to_vec(), flags & FLAG_FIN != 0));
+        while let Some((data, fin)) = self.out_of_order.remove(&self.recv_next) {
+            self.recv_next += 1;
+            if fin {
+                self.peer_fin = true;
+            } else if !data.is_empty() {
+                self.deliver.push_back(data);
+            }
+        }
+
+        if in_order {
+            self.ack_pending += 1;
+            self.ack_deadline.get_or_insert(now + DELAYED_ACK);
+        } else {
+            // Gaps are reported immediately so the sender can repair them.
+            self.send_ack().await;
+        }
+    }
+
+    async fn send_ack(&mut self) {
+        let window = self.window();
+        let mut packet = vec![ACK];
+        packet.extend_from_slice(&self.recv_next.to_be_bytes());
+        packet.extend_from_slice(&(window as u32).to_be_bytes());
+        packet.extend_from_slice(&self.echo.to_be_bytes());
+
+        let mut ranges: Vec<(u64, u64)> = Vec::new();
+        for &seq in self.out_of_order.keys() {
+            if let Some((_, end)) = ranges.last_mut().filter(|(_, end)| *end == seq) {
+                *end += 1;
+            } else if ranges.len() == MAX_SACK {
+                break;
+            } else {
+                ranges.push((seq, seq + 1));
+            }
+        }
+        packet.push(ranges.len() as u8);
+        for (start, end) in ranges {
+            packet.extend_from_slice(&start.to_be_bytes());
+            packet.extend_from_slice(&end.to_be_bytes());
+        }
+
+        self.link.send(packet).await;
+        self.advertised = window;
+        self.ack_pending = 0;
+        self.ack_deadline = None;
+        self.last_sent = Instant::now();
+    }
+
+    fn on_ack(&mut self, packet: &[u8], now: Instant) {
+        let (Some(cum), Some(window), Some(echo), Some(&count)) = (
+            u64_at(packet, 1),
+            u32_at(packet, 9),
+            u32_at(packet, 13),
+            packet.get(17),
+        ) else {
+            return;
+        };
+        // Acks can arrive out of order; an older one acknowledges nothing new.
+        let mut ranges = vec![(self.cum_acked, cum.max(self.cum_acked))];
+        for i in 0..count as usize {
+            let at = 18 + i * 16;
+            let (Some(start), Some(end)) = (u64_at(packet, at), u64_at(packet, at + 8)) else {
+                return;
+            };
+            ranges.push((start, end.max(start)));
+        }
+        self.peer_window = window as u64;
+        self.cum_acked = self.cum_acked.max(cum);
+
+        let mut acked = 0;
+        for (start, end) in ranges {
+            let seqs: Vec<u64> = self
+                .unacked
+                .range(start..end)
+                .map(|(&seq, _)| seq)
+                .collect();
+            for seq in seqs {
+                let segment = self.unacked.remove(&seq).unwrap();
+                if segment.lost {
+                    self.retransmit.remove(&seq);
+                } else {
+                    self.inflight -= segment.charge();
+                }
+                acked += segment.charge();
+                self.fin_acked |= segment.fin;
+                self.rack_sent = self.rack_sent.max(Some(segment.sent_at));
+                self.largest_acked = self.largest_acked.max(Some(seq));
+            }
+        }
+        if acked == 0 {
+            return;
+        }
+
+        let sample = Duration::from_micros(self.micros(now).wrapping_sub(echo) as u64);
+        if sample < MAX_RTO {
+            self.on_rtt(sample);
+            if let Some(ledbat) = &mut self.background {
+                ledbat.on_delay(sample, now);
+            }
+        }
+        self.backoff = 0;
+        self.rto_armed = now;
+        if let Some(ledbat) = &mut self.background {
+            ledbat.on_ack(acked);
+            self.cwnd = ledbat.window();
+            return;
+        }
+        if self.cum_acked < self.recovery_end {
+            return;
+        }
+        if self.cwnd < self.ssthresh {
+            self.cwnd += acked;
+        } else {
+            self.cwnd += (MSS * acked / self.cwnd).max(1);
+        }
+        self.cwnd = self.cwnd.min(WINDOW as usize * MSS);
+    }
+
+    fn on_rtt(&mut self, sample: Duration) {
+        if self.has_rtt {
+            let delta = self.srtt.abs_diff(sample);
+            self.rttvar = (self.rttvar * 3 + delta) / 4;
+            self.srtt = (self.srtt * 7 + sample) / 8;
+        } else {
+            self.srtt = sample;
+            self.rttvar = sample / 2;
+            self.has_rtt = true;
+        }
+        self.rto =
+            (self.srtt + (self.rttvar * 4).max(Duration::from_millis(1))).clamp(MIN_RTO, MAX_RTO);
+    }
+
+    fn detect_losses(&mut self, now: Instant) {
+        self.rack_deadline = None;
+        let mut lost = Vec::new();
+        if let (Some(rack_sent), Some(largest)) = (self.rack_sent, self.largest_acked) {
+            // The ack for a segment that arrives in order may be delayed,
+            // while a gap is acked at once; allow for that and a timer tick.
+            let reorder = self.srtt + (self.srtt / 4).max(DELAYED_ACK + Duration::from_millis(1));
+            for (&seq, segment) in self.unacked.range(..largest) {
+                if segment.lost || segment.sent_at >= rack_sent {
+                    continue;
+                }
+                let deadline = segment.sent_at + reorder;
+                if deadline <= now {
+                    lost.push(seq);
+                } else {
+                    self.rack_deadline =
+                        Some(self.rack_deadline.map_or(deadline, |d| d.min(deadline)));
+                }
+            }
+        }
+        if !lost.is_empty() {
+            if let Some(ledbat) = &mut self.background {
+                ledbat.on_loss(now, self.srtt);
+                self.cwnd = ledbat.window();
+            } else if lost[0] >= self.recovery_end {
+                self.ssthresh = (self.cwnd / 2).max(2 * MSS);
+                self.cwnd = self.ssthresh;
+                self.recovery_end = self.next_seq;
+            }
+            for seq in lost {
+                self.mark_lost(seq);
+            }
+        }
+
+        if self.inflight > 0 && now >= self.rto_armed + self.rto * (1 << self.backoff.min(6)) {
+            // Nothing came back for a whole timeout: assume everything
+            // outstanding is gone and restart from a small window.
+            let outstanding: Vec<u64> = self
+                .unacked
+                .iter()
+                .filter(|(_, segment)| !segment.lost)
+                .map(|(&seq, _)| seq)
+                .collect();
+            for seq in outstanding {
+                self.mark_lost(seq);
+            }
+            self.ssthresh = (self.cwnd / 2).max(2 * MSS);
+            self.cwnd = 2 * MSS;
+            self.recovery_end = self.next_seq;
+            if let Some(ledbat) = &mut self.background {
+                ledbat.on_timeout();
+            }
+            self.backoff += 1;
+            self.rto_armed = now;
+        }
+    }
+
+    fn mark_lost(&mut self, seq: u64) {
+        let segment = self.unacked.get_mut(&seq).unwrap();
+        segment.lost = true;
+        self.inflight -= segment.charge();
+        self.retransmit.insert(seq);
+    }
+
+    fn has_sendable(&self) -> bool {
+        if self.inflight + MSS > self.cwnd && self.inflight > 0 {
+            return false;
+        }
+        !self.retransmit.is_empty()
+            || (self.next_seq < self.cum_acked + self.peer_window
+                && (!self.pending.is_empty() || (self.app_eof && !self.fin_sent)))
+    }
+
+    async fn send_ready(&mut self, now: Instant) {
+        // Timer granularity is about a millisecond, so send whatever is due
+        // within the next one.
+        let horizon = now + Duration::from_millis(1);
+        while self.pacing_next <= horizon && self.has_sendable() {
+            let seq = match self.retransmit.pop_first() {
+                Some(seq) => seq,
+                None => {
+                    let len = self.pending.len().min(MSS);
+                    let data: Vec<u8> = self.pending.drain(..len).collect();
+                    let fin = data.is_empty();
+                    self.fin_sent |= fin;
+                    let seq = self.next_seq;
+                    self.next_seq += 1;
+                    self.unacked.insert(
+                        seq,
+                        Segment {
+                            data,
+                            fin,
+                            sent_at: now,
+                            lost: false,
+                        },
+                    );
+                    seq
+                }
+            };
+
+            if self.inflight == 0 {
+                self.rto_armed = now;
+            }
+            let ts = self.micros(now);
+            let segment = self.unacked.get_mut(&seq).unwrap();
+            segment.sent_at = now;
+            segment.lost = false;
+            self.inflight += segment.charge();
+
+            let mut packet = Vec::with_capacity(DATA_HEADER + segment.data.len());
+            packet.push(DATA);
+            packet.push(if segment.fin { FLAG_FIN } else { 0 });
+            packet.extend_from_slice(&seq.to_be_bytes());
+            packet.extend_from_slice(&ts.to_be_bytes());
+            packet.extend_from_slice(&segment.data);
+
+            // Spread the window over one RTT, faster while probing.
+            let probing = match &self.background {
+                Some(ledbat) => ledbat.in_slow_start(),
+                None => self.cwnd < self.ssthresh,
+            };
+            let gain = if probing { 2.0 } else { 1.25 };
+            let rate = self.cwnd as f64 * gain / self.srtt.as_secs_f64().max(1e-6);
+            let interval = Duration::from_secs_f64(packet.len() as f64 / rate);
+            self.pacing_next = self.pacing_next.max(now) + interval;
+
+            self.link.send(packet).await;
+            self.last_sent = now;
+        }
+    }
+}
+
+pub struct Udp {
+    impairment: Impairment,
+    background: bool,
+    options: SocketOptions,
+}
+
+impl Udp {
+    pub fn new(impairment: Impairment, background: bool, options: SocketOptions) -> Udp {
+        Udp {
+            impairment,
+            background,
+            options,
+        }
+    }
+}
+
+impl Transport for Udp {
+    fn connect<'a>(&'a self, addr: &'a str) -> BoxFuture<'a, io::Result<BoxStream>> {
+        Box::pin(connect(addr, self))
+    }
+
+    fn bind<'a>(&'a self, addr: &'a str) -> BoxFuture<'a, io::Result<Box<dyn Listener>>> {
+        Box::pin(async move {
+            let socket = UdpSocket::bind(addr).await?;
+            self.options.apply_udp(&socket)?;
+            let local_addr = socket.local_addr()?;
+            let socket = Arc::new(socket);
+            let (accepted, queue) = mpsc::channel(64);
+            tokio::spawn(demux(socket, self.impairment, self.background, accepted));
+            Ok(Box::new(UdpListener { queue, local_addr }) as Box<dyn Listener>)
+        })
+    }
+}
+
+async fn connect(addr: &str, udp: &Udp) -> io::Result<BoxStream> {
+    let peer = tokio::net::lookup_host(addr)
+        .await?
+        .next()
+        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "no address to connect to"))?;
+    let local = if peer.is_ipv4() {
+        "0.0.0.0:0"
+    } else {
+        "[::]:0"
+    };
+    let socket = UdpSocket::bind(local).await?;
+    udp.options.apply_udp(&socket)?;
+    let socket = Arc::new(socket);
+    let mut link = Link::new(socket.clone(), peer, udp.impairment);
+
+    let mut buf = vec![0u8; 64 * 1024];
+    let mut rtt = None;
+    for attempt in 0..SYN_RETRIES {
+        let sent = Instant::now();
+        link.send(handshake_packet(SYN)).await;
+        let answer = time::timeout(Duration::from_millis(250 << attempt.min(3)), async {
+            loop {
+                let (n, from) = socket.recv_from(&mut buf).await?;
+                if from == peer && is_handshake(&buf[..n], SYN_ACK) {
+                    return io::Result::Ok(());
+                }
+            }
+        })
+        .await;
+        match answer {
+            Ok(Ok(())) => {
+                rtt = Some(sent.elapsed());
+                break;
+            }
+            Ok(Err(e)) => return Err(e),
+            Err(_) => continue,
+        }
+    }
+    let Some(rtt) = rtt else {
+        return Err(io::Error::new(
+            io::ErrorKind::TimedOut,
+            "peer did not answer",
+        ));
+    };
+
+    let (packets, inbox) = mpsc::channel(INBOX);
+    tokio::spawn(async move {
+        loop {
+            tokio::select! {
+                received = socket.recv_from(&mut buf) => match received {
+                    Ok((n, from)) if from == peer => {
+                        // A full inbox is a full socket buffer: drop.
+                        let _ = packets.try_send(buf[..n].to_vec());
+                    }
+                    Ok(_) => {}
+                    Err(_) => return,
+                },
+                _ = packets.closed() => return,
+            }
+        }
+    });
+    let (stream, app) = tokio::io::duplex(APP_BUFFER);
+    tokio::spawn(Connection::new(link, Some(rtt), udp.background).run(inbox, app));
+    Ok(Box::new(stream))
+}
+
+pub struct UdpListener {
+    queue: mpsc::Receiver<(BoxStream, SocketAddr)>,
+    local_addr: SocketAddr,
+}
+
+impl Listener for UdpListener {
+    fn accept(&mut self) -> BoxFuture<'_, io::Result<(BoxStream, SocketAddr)>> {
+        Box::pin(async move {
+            self.queue
+                .recv()
+                .await
+                .ok_or_else(|| io::Error::new(io::ErrorKind::BrokenPipe, "UDP listener stopped"))
+        })
+    }
+
+    fn local_addr(&self) -> io::Result<SocketAddr> {
+        Ok(self.local_addr)
+    }
+}
+
+// Routes datagrams on a listening socket to one task per peer address and
+// starts a connection for every new peer that sends a SYN.
+async fn demux(
+    socket: Arc<UdpSocket>,
+    impairment: Impairment,
+    background: bool,
+    accepted: mpsc::Sender<(BoxStream, SocketAddr)>,
+) {
+    let mut connections: HashMap<SocketAddr, mpsc::Sender<Vec<u8>>> = HashMap::new();
+    let (closed, mut finished) = mpsc::unbounded_channel();
+    let mut buf = vec![0u8; 64 * 1024];
+    loop {
+        let (n, from) = tokio::select! {
+            received = socket.recv_from(&mut buf) => match received {
+                Ok(received) => received,
+                Err(e) => {
+                    eprintln!("UDP listener failed: {}", e);
+                    return;
+                }
+            },
+            Some(addr) = finished.recv() => {
+                connections.remove(&addr);
+                continue;
+            }
+        };
+
+        let packet = &buf[..n];
+        if let Some(connection) = connections.get(&from) {
+            let _ = connection.try_send(packet.to_vec());
+            continue;
+        }
+        if !is_handshake(packet, SYN) {
+            continue;
+        }
+
+        let mut link = Link::new(socket.clone(), from, impairment);
+        link.send(handshake_packet(SYN_ACK)).await;
+        let (packets, inbox) = mpsc::channel(INBOX);
+        connections.insert(from, packets);
+        let (stream, app) = tokio::io::duplex(APP_BUFFER);
+        let closed = closed.clone();
+        tokio::spawn(async move {
+            Connection::new(link, None, background)
+                .run(inbox, app)
+                .await;
+            let _ = closed.send(from);
+        });
+        if accepted.send((Box::new(stream), from)).await.is_err() {
+            return;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn pattern(len: usize, mut state: u64) -> Vec<u8> {
+        (0..len)
+            .map(|_| {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                state as u8
+            })
+            .collect()
+    }
+
+    // Sends `up` bytes to a server and `down` bytes back over loopback with
+    // every datagram of both ends impaired, each side closing its half when
+    // done. Both directions must arrive byte for byte and both streams end,
+    // well before the deadline.
+    async fn exchange(impairment: Impairment, background: bool, up: usize, down: usize) {
+        let udp = Udp::new(impairment, background, SocketOptions::default());
+        let mut listener = udp.bind("127.0.0.1:0").await.unwrap();
+        let addr = listener.local_addr().unwrap().to_string();
+        let (request, reply) = (pattern(up, 1), pattern(down, 2));
+
+        let server = {
+            let (request, reply) = (request.clone(), reply.clone());
+            tokio::spawn(async move {
+                let (mut stream, _) = listener.accept().await?;
+                let mut received = Vec::new();
+                stream.read_to_end(&mut received).await?;
+                assert!(received == request, "request arrived damaged");
+                stream.write_all(&reply).await?;
+                stream.shutdown().await?;
+                io::Result::Ok(())
+            })
+        };
+        let client = async {
+            let mut stream = udp.connect(&addr).await?;
+            stream.write_all(&request).await?;
+            stream.shutdown().await?;
+            let mut received = Vec::new();
+            stream.read_to_end(&mut received).await?;
+            io::Result::Ok(received)
+        };
+        let received = time::timeout(Duration::from_secs(60), client)
+            .await
+            .expect("transfer never finished")
+            .unwrap();
+        assert!(received == reply, "reply arrived damaged");
+        time::timeout(Duration::from_secs(10), server)
+            .await
+            .expect("server never finished")
+            .unwrap()
+            .unwrap();
+    }
+
+    #[tokio::test]
+    async fn lossy_delayed_link_delivers_exactly() {
+        let impairment = Impairment {
+            loss_percent: 3.0,
+            delay: Duration::from_millis(5),
+        };
+        exchange(impairment, false, 64 * 1024, 1 << 20).await;
+    }
+
+    #[tokio::test]
+    async fn background_transfer_survives_heavy_loss() {
+        let impairment = Impairment {
+            loss_percent: 15.0,
+            delay: Duration::from_millis(2),
+        };
+        exchange(impairment, true, 32 * 1024, 128 * 1024).await;
+    }
+
+    // Each end's FIN is the last segment it sends, so only the timeout can
+    // repair losing one; over these rounds nearly every run loses some.
+    #[tokio::test]
+    async fn lost_fins_are_retransmitted() {
+        let impairment = Impairment {
+            loss_percent: 20.0,
+            delay: Duration::ZERO,
+        };
+        for _ in 0..8 {
+            exchange(impairment, false, 0, 0).await;
+        }
+    }
+
+    #[tokio::test]
+    async fn clean_link_ends_an_empty_stream() {
+        exchange(Impairment::default(), false, 0, 0).await;
+    }
+}
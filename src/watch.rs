@@ -0,0 +1,399 @@
+use crate::catalog::{Catalog, FileInfo, Indexed};
+use crate::index::{self, IndexOptions, ShareIndex};
+use crate::pool::{self, Spawner};
+use crate::protocol::CatalogUpdate;
+use std::collections::{BTreeSet, HashMap};
+use std::ffi::CString;
+use std::fs;
+use std::io;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use tokio::sync::broadcast;
+
+const WATCH_MASK: u32 = libc::IN_CLOSE_WRITE
+    | libc::IN_CREATE
+    | libc::IN_DELETE
+    | libc::IN_MOVED_FROM
+    | libc::IN_MOVED_TO;
+
+// Fixed part of `struct inotify_event`; the name follows, NUL padded.
+const EVENT_HEADER_LEN: usize = 16;
+
+enum Event {
+    Changed(String),
+    DirCreated(String),
+    Removed(String),
+    Overflow,
+}
+
+// Recursive inotify watch over a shared directory. Its watches are added
+// on the index thread just before the initial scan, so nothing changing
+// during the scan is missed and startup does not wait for the walk.
+pub struct Watcher {
+    root: PathBuf,
+    fd: OwnedFd,
+    dirs: HashMap<i32, String>,
+}
+
+fn join(dir: &str, name: &str) -> String {
+    if dir.is_empty() {
+        name.to_string()
+    } else {
+        format!("{}/{}", dir, name)
+    }
+}
+
+impl Watcher {
+    pub fn new(root: &Path) -> io::Result<Watcher> {
+        let fd = unsafe { libc::inotify_init1(libc::IN_CLOEXEC) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Watcher {
+            root: root.to_path_buf(),
+            fd: unsafe { OwnedFd::from_raw_fd(fd) },
+            dirs: HashMap::new(),
+        })
+    }
+
+    // Watches the whole share.
+    pub fn watch_share(&mut self, threads: usize) -> io::Result<()> {
+        self.watch_tree("", threads).map(drop)
+    }
+
+    // Watches `relative` and every directory below it, walking on `threads`
+    // workers like the index scan, and returns the files found on the way.
+    fn watch_tree(&mut self, relative: &str, threads: usize) -> io::Result<Vec<String>> {
+        let (fd, root) = (self.fd.as_raw_fd(), &self.root);
+        let watched = Mutex::new(Vec::new());
+        let found = Mutex::new(Vec::new());
+        let error = Mutex::new(None);
+        pool::run(
+            threads,
+            vec![relative.to_string()],
+            |dir: String, spawner| {
+                if let Err(e) = watch_dir(fd, root, &dir, spawner, &watched, &found) {
+                    error.lock().unwrap().get_or_insert(e);
+                }
+            },
+        );
+        self.dirs.extend(watched.into_inner().unwrap());
+        match error.into_inner().unwrap() {
+            Some(e) => Err(e),
+            None => Ok(found.into_inner().unwrap()),
+        }
+    }
+
+    fn read_events(&mut self, buf: &mut [u8]) -> io::Result<Vec<Event>> {
+        let n = loop {
+            let n = unsafe { libc::read(self.fd.as_raw_fd(), buf.as_mut_ptr().cast(), buf.len()) };
+            if n >= 0 {
+                break n as usize;
+            }
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        };
+
+        let mut events = Vec::new();
+        let mut offset = 0;
+        while offset + EVENT_HEADER_LEN <= n {
+            let field = |at: usize| {
+                u32::from_ne_bytes(buf[offset + at..offset + at + 4].try_into().unwrap())
+            };
+            let wd = field(0) as i32;
+            let mask = field(4);
+            let len = field(12) as usize;
+            let name = &buf[offset + EVENT_HEADER_LEN..offset + EVENT_HEADER_LEN + len];
+            let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+            offset += EVENT_HEADER_LEN + len;
+
+            if mask & libc::IN_Q_OVERFLOW != 0 {
+                events.push(Event::Overflow);
+                continue;
+            }
+            if mask & libc::IN_IGNORED != 0 {
+                self.dirs.remove(&wd);
+                continue;
+            }
+            let (Some(dir), Ok(name)) = (self.dirs.get(&wd), std::str::from_utf8(name)) else {
+                continue;
+            };
+            if name.is_empty() {
+                continue;
+            }
+
+            let path = join(dir, name);
+            if index::is_sidecar(&path) {
+                continue;
+            }
+            let is_dir = mask & libc::IN_ISDIR != 0;
+            if mask & (libc::IN_DELETE | libc::IN_MOVED_FROM) != 0 {
+                events.push(Event::Removed(path));
+            } else if is_dir {
+                events.push(Event::DirCreated(path));
+            } else if mask & libc::IN_CREATE == 0 {
+                events.push(Event::Changed(path));
+            } else if fs::symlink_metadata(self.root.join(&path))
+                .is_ok_and(|meta| meta.is_file() && meta.nlink() > 1)
+            {
+                // A new file is indexed once it is closed or moved in, never
+                // half written. A hard link to an existing file is complete
+                // already and only ever shows up as created.
+                events.push(Event::Changed(path));
+            }
+        }
+        Ok(events)
+    }
+
+    // Re-indexes changed files on a background thread and publishes every
+    // resulting catalog change to `updates`. The changes from one read of
+    // events go out as one catalog version, so a release staged outside the
+    // share and renamed into it appears all at once.
+    pub fn spawn(
+        mut self,
+        catalog: Arc<Catalog>,
+        updates: broadcast::Sender<CatalogUpdate>,
+        options: IndexOptions,
+    ) -> io::Result<()> {
+        thread::Builder::new()
+            .name("peernet-watch".to_string())
+            .spawn(move || {
+                let mut buf = vec![0u8; 64 * 1024];
+                loop {
+                    let events = match self.read_events(&mut buf) {
+                        Ok(events) => events,
+                        Err(e) => {
+                            eprintln!("Watcher stopped: {}", e);
+                            return;
+                        }
+                    };
+
+                    let mut changed = BTreeSet::new();
+                    let mut overflow = false;
+                    for event in events {
+                        match event {
+                            Event::Changed(path) => {
+                                changed.insert(path);
+                            }
+                            Event::DirCreated(path) => {
+                                match self.watch_tree(&path, options.threads) {
+                                    Ok(found) => changed.extend(found),
+                                    Err(e) => eprintln!("Cannot watch {}: {}", path, e),
+                                }
+                            }
+                            Event::Removed(path) => {
+                                changed.extend(catalog.paths_under(&format!("{}/", path)));
+                                changed.insert(path);
+                            }
+                            Event::Overflow => overflow = true,
+                        }
+                    }
+
+                    if overflow {
+                        eprintln!("Watch queue overflowed, rescanning share");
+                        self.rescan(&catalog, &updates, &options);
+                        continue;
+                    }
+                    let changes: Vec<_> = changed
+                        .into_iter()
+                        .filter_map(|path| refresh(&self.root, &catalog, path))
+                        .collect();
+                    if changes.is_empty() {
+                        continue;
+                    }
+                    catalog.apply(&changes);
+                    println!(
+                        "Published catalog version {} ({} changes)",
+                        catalog.version(),
+                        changes.len()
+                    );
+                    for (path, indexed) in changes {
+                        publish(&updates, path, indexed.map(|indexed| indexed.info));
+                    }
+                    match catalog.compact(&self.root) {
+                        Ok(true) => println!(
+                            "Compacted changes into the index, catalog version {}",
+                            catalog.version()
+                        ),
+                        Ok(false) => {}
+                        Err(e) => eprintln!("Cannot compact index: {}", e),
+                    }
+                }
+            })?;
+        Ok(())
+    }
+
+    fn rescan(
+        &mut self,
+        catalog: &Catalog,
+        updates: &broadcast::Sender<CatalogUpdate>,
+        options: &IndexOptions,
+    ) {
+        if let Err(e) = self.watch_share(options.threads) {
+            eprintln!("Cannot watch share: {}", e);
+        }
+        let index = match ShareIndex::open(&self.root, options) {
+            Ok((index, _)) => index,
+            Err(e) => {
+                eprintln!("Rescan failed: {}", e);
+                return;
+            }
+        };
+        let changes = catalog.rebase(Arc::new(index));
+        println!(
+            "Rescan found {} changed files, published catalog version {}",
+            changes.len(),
+            catalog.version()
+        );
+        for (path, info) in changes {
+            publish(updates, path, info);
+        }
+    }
+}
+
+fn watch_dir(
+    fd: i32,
+    root: &Path,
+    dir: &str,
+    spawner: &Spawner<String>,
+    watched: &Mutex<Vec<(i32, String)>>,
+    found: &Mutex<Vec<String>>,
+) -> io::Result<()> {
+    let full_path = root.join(dir);
+    let path = CString::new(full_path.as_os_str().as_bytes())?;
+    let wd = unsafe { libc::inotify_add_watch(fd, path.as_ptr(), WATCH_MASK) };
+    if wd < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    watched.lock().unwrap().push((wd, dir.to_string()));
+
+    let mut files = Vec::new();
+    for entry in fs::read_dir(&full_path)? {
+        let entry = entry?;
+        let Some(name) = entry.file_name().to_str().map(str::to_string) else {
+            continue;
+        };
+        let child = join(dir, &name);
+        let file_type = entry.file_type()?;
+        if file_type.is_dir() {
+            spawner.spawn(child);
+        } else if file_type.is_file() {
+            files.push(child);
+        }
+    }
+    found.lock().unwrap().extend(files);
+    Ok(())
+}
+
+pub fn publish(updates: &broadcast::Sender<CatalogUpdate>, path: String, info: Option<FileInfo>) {
+    // Nobody subscribed is not an error.
+    let _ = updates.send(CatalogUpdate {
+        path,
+        file: info.map(|info| (info.size, info.root)),
+    });
+}
+
+// The catalog change for `path`, if its entry no longer matches the file.
+fn refresh(root: &Path, catalog: &Catalog, path: String) -> Option<(String, Option<Indexed>)> {
+    let full_path = root.join(&path);
+    let indexed = match fs::symlink_metadata(&full_path) {
+        Ok(meta) if meta.is_file() => {
+            if catalog
+                .lookup(&path)
+                .is_some_and(|info| info.matches(&meta))
+            {
+                return None;
+            }
+            match Indexed::hash(&full_path, &meta) {
+                Ok(indexed) => Some(indexed),
+                Err(e) => {
+                    eprintln!("Cannot index {}: {}", path, e);
+                    return None;
+                }
+            }
+        }
+        Ok(_) => return None,
+        Err(e) if e.kind() == io::ErrorKind::NotFound => {
+            catalog.lookup(&path)?;
+            None
+        }
+        Err(e) => {
+            eprintln!("Cannot stat {}: {}", path, e);
+            return None;
+        }
+    };
+    println!(
+        "Catalog {}: {}",
+        if indexed.is_some() {
+            "updated"
+        } else {
+            "removed"
+        },
+        path
+    );
+    Some((path, indexed))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+    use std::time::{Duration, Instant};
+
+    #[test]
+    fn a_written_file_is_published_once_it_is_closed() {
+        let share = std::env::temp_dir().join(format!("peernet-watch-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&share);
+        fs::create_dir_all(&share).unwrap();
+        let catalog = Arc::new(Catalog::new(Arc::new(ShareIndex::empty())));
+        let (updates, mut received) = broadcast::channel(16);
+        let options = IndexOptions {
+            precompress: false,
+            threads: 1,
+            io_limit: 1,
+        };
+        let mut watcher = Watcher::new(&share).unwrap();
+        watcher.watch_share(1).unwrap();
+        watcher.spawn(catalog.clone(), updates, options).unwrap();
+
+        // Created, then written in parts with pauses the watcher would
+        // publish between if it indexed files on creation.
+        let mut file = fs::File::create(share.join("new.txt")).unwrap();
+        thread::sleep(Duration::from_millis(200));
+        for part in 0..4 {
+            file.write_all(&[part; 1000]).unwrap();
+            thread::sleep(Duration::from_millis(50));
+        }
+        drop(file);
+        let mut published = |path: &str| {
+            let deadline = Instant::now() + Duration::from_secs(10);
+            while catalog.lookup(path).is_none() && Instant::now() < deadline {
+                thread::sleep(Duration::from_millis(20));
+            }
+            thread::sleep(Duration::from_millis(200));
+            let mut sizes = Vec::new();
+            while let Ok(update) = received.try_recv() {
+                sizes.push((update.path, update.file.map(|(size, _)| size)));
+            }
+            (catalog.version(), sizes)
+        };
+        assert_eq!(
+            published("new.txt"),
+            (1, vec![("new.txt".to_string(), Some(4000))])
+        );
+
+        // A hard link is complete when it appears, so it is published then.
+        fs::hard_link(share.join("new.txt"), share.join("link.txt")).unwrap();
+        assert_eq!(
+            published("link.txt"),
+            (2, vec![("link.txt".to_string(), Some(4000))])
+        );
+        fs::remove_dir_all(&share).unwrap();
+    }
+}